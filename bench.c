@@ -0,0 +1,1068 @@
+/* Layout benchmarks for SVSFS.
+ * Each test runs one workload against images formatted different ways and
+ * prints the disk traffic it caused. The image is an ordinary file, so the
+ * host's page cache hides real seek times; the seek distance column is the
+ * number to compare.
+ */
+#include "fs.h"
+#include "disk.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static double now();
+static int compare_ints(const void *a, const void *b);
+static int bench_groups(const char *image, int nblocks);
+static int bench_async(const char *image, int nblocks);
+static int bench_rmw(const char *image, int nblocks);
+static int bench_simd(const char *image, int nblocks);
+static int bench_log(const char *image, int nblocks);
+static int bench_build(const char *image, int nblocks);
+static int bench_stat(const char *image, int nblocks);
+static int bench_shared(const char *image, int nblocks);
+static int bench_full(const char *image, int nblocks);
+static int bench_dir(const char *image, int nblocks);
+
+struct disk *thedisk = 0;
+
+int main(int argc, char *argv[])
+{
+	// bench <test> <diskfile> <nblocks>
+	if (argc != 4)
+	{
+		printf("use: %s <test> <diskfile> <nblocks>\n", argv[0]);
+		printf("tests are:\n");
+		printf("    groups   read back many files: flat layout against block groups\n");
+		printf("    async    read many files one at a time, then all at once through the async API\n");
+		printf("    rmw      count the disk reads behind different write and read patterns\n");
+		printf("    simd     time the vector kernels against plain C, alone and in fs_delete\n");
+		printf("    log      small appends and overwrites: in-place layout against the log\n");
+		printf("    build    provision an image: create and write file by file against fs_build\n");
+		printf("    stat     list every inode: fs_debug against fs_stat_all\n");
+		printf("    shared   reader processes mounting one image: private mounts against a shared one\n");
+		printf("    full     check that writes past the end of files on a full disk change nothing\n");
+		printf("    dir      grow one directory to a million entries, timing links and lookups\n");
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "groups"))
+	{
+		return !bench_groups(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "async"))
+	{
+		return !bench_async(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "rmw"))
+	{
+		return !bench_rmw(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "simd"))
+	{
+		return !bench_simd(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "log"))
+	{
+		return !bench_log(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "build"))
+	{
+		return !bench_build(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "stat"))
+	{
+		return !bench_stat(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "shared"))
+	{
+		return !bench_shared(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "full"))
+	{
+		return !bench_full(argv[2], atoi(argv[3]));
+	}
+
+	if (!strcmp(argv[1], "dir"))
+	{
+		return !bench_dir(argv[2], atoi(argv[3]));
+	}
+
+	printf("unknown test: %s\n", argv[1]);
+	return 1;
+}
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+// Fill three quarters of the data area with 64K files, written one after
+// another, then remount and read them all back in inode order, as a backup
+// or indexing pass would.
+static int bench_groups(const char *image, int nblocks)
+{
+	const char *names[] = {"flat", "groups"};
+	int flags[] = {0, FS_FORMAT_GROUPS};
+	int file_size = 65536;
+	unsigned char *data = malloc(file_size);
+
+	if (!data)
+	{
+		return 0;
+	}
+	memset(data, 'x', file_size);
+
+	printf("%-8s %8s %10s %12s %14s %10s\n", "layout", "files", "requests", "blocks read", "seek/request", "seconds");
+	for (int l = 0; l < 2; l++)
+	{
+		thedisk = disk_open(image, nblocks);
+		if (!thedisk)
+		{
+			printf("couldn't open %s: %s\n", image, strerror(errno));
+			return 0;
+		}
+		if (!fs_format(flags[l], 0) || !fs_mount())
+		{
+			printf("couldn't format %s\n", image);
+			return 0;
+		}
+
+		// one indirect block per file on top of its data blocks
+		int per_file = file_size / 4096 + 1;
+		int nfiles = nblocks * 9 / 10 * 3 / 4 / per_file;
+		int *inodes = malloc(nfiles * sizeof(int));
+		if (!inodes)
+		{
+			return 0;
+		}
+		for (int i = 0; i < nfiles; i++)
+		{
+			inodes[i] = fs_create();
+			if (!inodes[i] || fs_write(inodes[i], data, file_size, 0) != file_size)
+			{
+				printf("couldn't write file %d\n", i);
+				return 0;
+			}
+		}
+
+		// inode order, whatever order they were handed out in
+		qsort(inodes, nfiles, sizeof(int), compare_ints);
+
+		fs_mount();
+		struct disk_stats before, after;
+		disk_stats(thedisk, &before);
+		double start = now();
+		for (int i = 0; i < nfiles; i++)
+		{
+			int size = fs_getsize(inodes[i]);
+			if (size != file_size || fs_read(inodes[i], data, size, 0) != size)
+			{
+				printf("couldn't read inode %d\n", inodes[i]);
+				return 0;
+			}
+		}
+		double elapsed = now() - start;
+		disk_stats(thedisk, &after);
+
+		long long requests = after.requests - before.requests;
+		printf("%-8s %8d %10lld %12lld %11.1f KB %10.3f\n", names[l], nfiles, requests,
+			   after.reads - before.reads,
+			   (after.seek_bytes - before.seek_bytes) / 1024.0 / (requests ? requests : 1), elapsed);
+
+		free(inodes);
+		fs_unmount();
+		disk_close(thedisk);
+	}
+	free(data);
+	return 1;
+}
+
+// Write a set of 1 MB files through fs_write_async, then read them back
+// twice: with blocking fs_read calls, and with every read queued at once.
+static int bench_async(const char *image, int nblocks)
+{
+	int file_size = 1 << 20;
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk)
+	{
+		printf("couldn't open %s: %s\n", image, strerror(errno));
+		return 0;
+	}
+	if (!fs_format(0, 0) || !fs_mount())
+	{
+		printf("couldn't format %s\n", image);
+		return 0;
+	}
+
+	int nfiles = nblocks * 9 / 10 / 2 / (file_size / 4096 + 1);
+	unsigned char *data = malloc((size_t)nfiles * file_size);
+	unsigned char *back = malloc((size_t)nfiles * file_size);
+	int *inodes = malloc(nfiles * sizeof(int));
+	struct fs_future **futures = malloc(nfiles * sizeof(struct fs_future *));
+	if (!data || !back || !inodes || !futures)
+	{
+		return 0;
+	}
+	for (size_t i = 0; i < (size_t)nfiles * file_size; i++)
+	{
+		data[i] = rand();
+	}
+
+	// no other call may run while async requests are in flight
+	for (int i = 0; i < nfiles; i++)
+	{
+		inodes[i] = fs_create();
+	}
+	for (int i = 0; i < nfiles; i++)
+	{
+		futures[i] = fs_write_async(inodes[i], data + (size_t)i * file_size, file_size, 0, 0, 0);
+	}
+	for (int i = 0; i < nfiles; i++)
+	{
+		if (fs_future_wait(futures[i]) != file_size)
+		{
+			printf("couldn't write inode %d\n", inodes[i]);
+			return 0;
+		}
+	}
+
+	double mb = (double)nfiles * file_size / (1 << 20);
+	printf("%-10s %8s %10s %10s\n", "reads", "files", "seconds", "MB/s");
+
+	memset(back, 0, (size_t)nfiles * file_size);
+	double start = now();
+	for (int i = 0; i < nfiles; i++)
+	{
+		fs_read(inodes[i], back + (size_t)i * file_size, file_size, 0);
+	}
+	double elapsed = now() - start;
+	if (memcmp(data, back, (size_t)nfiles * file_size))
+	{
+		printf("blocking reads returned the wrong data\n");
+		return 0;
+	}
+	printf("%-10s %8d %10.3f %10.1f\n", "blocking", nfiles, elapsed, mb / elapsed);
+
+	memset(back, 0, (size_t)nfiles * file_size);
+	start = now();
+	for (int i = 0; i < nfiles; i++)
+	{
+		futures[i] = fs_read_async(inodes[i], back + (size_t)i * file_size, file_size, 0, 0, 0);
+	}
+	for (int i = 0; i < nfiles; i++)
+	{
+		fs_future_wait(futures[i]);
+	}
+	elapsed = now() - start;
+	if (memcmp(data, back, (size_t)nfiles * file_size))
+	{
+		printf("async reads returned the wrong data\n");
+		return 0;
+	}
+	printf("%-10s %8d %10.3f %10.1f\n", "async", nfiles, elapsed, mb / elapsed);
+
+	fs_async_stop();
+	fs_unmount();
+	disk_close(thedisk);
+	free(data);
+	free(back);
+	free(inodes);
+	free(futures);
+	return 1;
+}
+
+// Run a sequence of calls of size bytes each, from offset start stepping by
+// step, against inode, and report the disk reads they caused. Every call
+// reads the inode's table block; calls past the direct pointers also read
+// the indirect block. Anything beyond that is a read-modify-write. Fails
+// unless the reads per call come within 0.05 of expect.
+static int rmw_pattern(const char *name, int inumber, unsigned char *data, int write, int size, int start, int step, int calls,
+					   double expect)
+{
+	struct disk_stats before, after;
+	disk_stats(thedisk, &before);
+	for (int i = 0; i < calls; i++)
+	{
+		int offset = start + i * step;
+		int actual = write ? fs_write(inumber, data + offset, size, offset) : fs_read(inumber, data + offset, size, offset);
+		if (actual != size)
+		{
+			printf("%s: call %d moved %d bytes, not %d\n", name, i, actual, size);
+			return 0;
+		}
+	}
+	disk_stats(thedisk, &after);
+	double per_call = (double)(after.reads - before.reads) / calls;
+	printf("%-22s %6d %10lld %10lld %12.2f\n", name, calls, after.requests - before.requests,
+		   after.reads - before.reads, per_call);
+	if (fabs(per_call - expect) > 0.05)
+	{
+		printf("FAILED: %s should take %.2f reads a call\n", name, expect);
+		return 0;
+	}
+	return 1;
+}
+
+// Write and read back files in patterns that do and don't need the old
+// contents of a block, and print the disk reads each one takes. Fails if
+// any pattern takes more or fewer reads than it should.
+static int bench_rmw(const char *image, int nblocks)
+{
+	int file_size = 1 << 20;
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk)
+	{
+		printf("couldn't open %s: %s\n", image, strerror(errno));
+		return 0;
+	}
+	if (!fs_format(0, 0) || !fs_mount())
+	{
+		printf("couldn't format %s\n", image);
+		return 0;
+	}
+
+	unsigned char *data = disk_alloc(file_size);
+	unsigned char *back = disk_alloc(file_size);
+	if (!data || !back)
+	{
+		return 0;
+	}
+	for (int i = 0; i < file_size; i++)
+	{
+		data[i] = rand();
+	}
+
+	int a = fs_create(), b = fs_create(), c = fs_create(), d = fs_create();
+	printf("%-22s %6s %10s %10s %12s\n", "pattern", "calls", "requests", "reads", "reads/call");
+	// with 4K blocks nearly every call goes through the indirect block, so
+	// two reads a call are metadata alone: aligned writes read no data, an
+	// unaligned append reads the block it continues, and a 1000 byte read
+	// spans two blocks about a quarter of the time
+	int ok = rmw_pattern("append 4K", a, data, 1, 4096, 0, 4096, file_size / 4096, 2) &&
+			 rmw_pattern("append 1000", b, data, 1, 1000, 0, 1000, file_size / 1000, 3) &&
+			 rmw_pattern("append 6000", c, data, 1, 6000, 0, 6000, file_size / 6000, 3) &&
+			 rmw_pattern("overwrite 4K", a, data, 1, 4096, 0, 4096, file_size / 4096, 2) &&
+			 rmw_pattern("overwrite 100 in 4K", a, data, 1, 100, 1000, 4096, file_size / 4096, 3) &&
+			 rmw_pattern("rewrite 2000 at 0", d, data, 1, 2000, 0, 0, 256, 1) &&
+			 rmw_pattern("read 1M", a, back, 0, file_size, 0, 0, 1, 2 + file_size / 4096) &&
+			 rmw_pattern("read 4K", a, back, 0, 4096, 0, 4096, file_size / 4096, 3) &&
+			 rmw_pattern("read 1000", a, back, 0, 1000, 0, 1000, file_size / 1000, 3.23);
+
+	if (ok && memcmp(data, back, file_size / 1000 * 1000))
+	{
+		printf("read back the wrong data\n");
+		ok = 0;
+	}
+
+	fs_unmount();
+	disk_close(thedisk);
+	free(data);
+	free(back);
+	return ok;
+}
+
+// Nanoseconds per item of one kernel call over n items, repeated.
+#define TIME_KERNEL(result, n, call)                                  \
+	do                                                                \
+	{                                                                 \
+		int rounds = 20000;                                           \
+		double start = now();                                         \
+		for (int r = 0; r < rounds; r++)                              \
+		{                                                             \
+			result = call;                                            \
+			__asm__ volatile("" ::: "memory");                        \
+		}                                                             \
+		printf(" %9.2f", (now() - start) * 1e9 / rounds / (n));       \
+	} while (0)
+
+// Time each kernel of every version this CPU runs on the shapes the
+// filesystem gives them, checking each answer against plain C, then time
+// deleting files whose indirect blocks are mostly empty.
+static int bench_simd(const char *image, int nblocks)
+{
+	const char *versions[] = {"scalar", "sse2", "avx2", "neon"};
+	int n = 16384; // pointers in a 64K indirect block
+	int *pointers = malloc(n * sizeof(int));
+	int *list = malloc(n * sizeof(int));
+	int *out = malloc(n * sizeof(int));
+	unsigned char *bits = malloc(n / 8);
+	unsigned char *scratch = malloc(n / 8);
+	if (!pointers || !list || !out || !bits || !scratch)
+	{
+		return 0;
+	}
+	// a quarter of the pointers set, as in a partly written file
+	for (int i = 0; i < n; i++)
+	{
+		pointers[i] = i < n / 4 ? 1000 + i : 0;
+		list[i] = 1000 + i;
+	}
+	// a full bitmap page but for its last block
+	memset(bits, 0xff, n / 8);
+	bits[n / 8 - 1] = 0x7f;
+
+	int expect[9];
+	printf("ns per item    %9s %9s %9s %9s\n", "nonzero", "range", "find bit", "scatter");
+	for (int v = 0; v < 4; v++)
+	{
+		if (!simd_select(versions[v]))
+			continue;
+		int got[9];
+		printf("%-14s", versions[v]);
+		TIME_KERNEL(got[0], n, simd.nonzero(pointers, n, out));
+		TIME_KERNEL(got[1], n, simd.out_of_range(list, n, 1000, 1000 + n));
+		TIME_KERNEL(got[2], n, simd.find_bit(bits, 0, n, 0));
+		TIME_KERNEL(got[3], n / 4, (memset(scratch, 0, n / 8), simd.scatter_bits(scratch, 1000, pointers, n / 4)));
+		printf("\n");
+		// range edges: empty and inverted ranges, and misses at either end
+		got[4] = simd.out_of_range(list, n, 1000, 1000);
+		got[5] = simd.out_of_range(list, n, 1000 + n, 1000);
+		got[6] = simd.out_of_range(list, n, 1001, 1000 + n);
+		got[7] = simd.out_of_range(list, n, 1000, 999 + n);
+		got[8] = simd.out_of_range(list, 0, 1000, 1000);
+		if (v == 0)
+			memcpy(expect, got, sizeof(got));
+		else if (memcmp(expect, got, sizeof(got)) || memcmp(out, list, n / 4 * sizeof(int)))
+		{
+			printf("%s disagrees with plain C\n", versions[v]);
+			return 0;
+		}
+	}
+
+	// small files in 64K blocks: one pointer in each 16384-entry indirect block
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk)
+	{
+		printf("couldn't open %s: %s\n", image, strerror(errno));
+		return 0;
+	}
+	int file_size = 4 * 65536;
+	// five blocks each; half the 64K blocks the image holds
+	int nfiles = nblocks / 16 / 10;
+	unsigned char *data = calloc(1, file_size);
+	int *inumbers = malloc(nfiles * sizeof(int));
+	if (!data || !inumbers)
+	{
+		return 0;
+	}
+	printf("\n%d files of %d bytes in 64K blocks\n", nfiles, file_size);
+	printf("%-14s %12s\n", "version", "delete (ms)");
+	for (int v = 0; v < 4; v++)
+	{
+		if (!simd_select(versions[v]))
+			continue;
+		if (!fs_format(0, 65536) || !fs_mount())
+		{
+			printf("couldn't format %s\n", image);
+			return 0;
+		}
+		for (int i = 0; i < nfiles; i++)
+		{
+			inumbers[i] = fs_create();
+			if (inumbers[i] <= 0 || fs_write(inumbers[i], data, file_size, 0) != file_size)
+			{
+				printf("couldn't write file %d\n", i);
+				return 0;
+			}
+		}
+		double start = now();
+		for (int i = 0; i < nfiles; i++)
+		{
+			fs_delete(inumbers[i]);
+		}
+		printf("%-14s %12.2f\n", versions[v], (now() - start) * 1e3);
+		fs_unmount();
+	}
+
+	disk_close(thedisk);
+	free(pointers);
+	free(list);
+	free(out);
+	free(bits);
+	free(scratch);
+	free(data);
+	free(inumbers);
+	return 1;
+}
+
+// Print the disk traffic of one phase of bench_log.
+static void log_phase(const char *layout, const char *phase, int calls, struct disk_stats *before, double start)
+{
+	struct disk_stats after;
+	// the log still holds the last blocks written
+	fs_sync();
+	disk_stats(thedisk, &after);
+	long long requests = after.requests - before->requests;
+	long long written = after.writes - before->writes;
+	printf("%-6s %-10s %8d %10lld %10lld %12.1f %12.1f %10.3f\n", layout, phase, calls, requests, written,
+		   requests ? (double)(written + after.reads - before->reads) / requests : 0.0,
+		   (double)(after.seek_bytes - before->seek_bytes) / (1 << 20), now() - start);
+}
+
+// Many writers appending 4K at a time in turn, as loggers or mail spools
+// do, until half the data area is full; then as many random 4K overwrites.
+// The in-place layout scatters each call over data, inode table and free
+// map; the log gathers them into segment-sized sequential writes, at the
+// price of cleaning once the overwrites have used up the clean segments,
+// and of reading files back from wherever their blocks were appended.
+// Everything is read back after a remount.
+static int bench_log(const char *image, int nblocks)
+{
+	const char *names[] = {"flat", "log"};
+	int flags[] = {0, FS_FORMAT_LOG};
+	int nfiles = 64;
+	int chunk = 4096;
+	int per_file = nblocks / 2 / nfiles;
+	int calls = per_file * nfiles;
+	unsigned char *model = malloc((size_t)calls * chunk);
+	unsigned char *back = malloc((size_t)per_file * chunk);
+	int *inodes = malloc(nfiles * sizeof(int));
+	if (!model || !back || !inodes || per_file < 1)
+	{
+		printf("couldn't set up %d files of %d blocks\n", nfiles, per_file);
+		return 0;
+	}
+
+	printf("%-6s %-10s %8s %10s %10s %12s %12s %10s\n", "layout", "phase", "calls", "requests", "written", "blocks/req", "seek MB", "seconds");
+	for (int l = 0; l < 2; l++)
+	{
+		thedisk = disk_open(image, nblocks);
+		if (!thedisk)
+		{
+			printf("couldn't open %s: %s\n", image, strerror(errno));
+			return 0;
+		}
+		if (!fs_format(flags[l], 0) || !fs_mount())
+		{
+			printf("couldn't format %s\n", image);
+			return 0;
+		}
+		srand(1);
+		for (size_t i = 0; i < (size_t)calls * chunk; i++)
+		{
+			model[i] = rand();
+		}
+		for (int f = 0; f < nfiles; f++)
+		{
+			inodes[f] = fs_create();
+		}
+
+		struct disk_stats before;
+		disk_stats(thedisk, &before);
+		double start = now();
+		for (int k = 0; k < per_file; k++)
+		{
+			for (int f = 0; f < nfiles; f++)
+			{
+				size_t at = ((size_t)f * per_file + k) * chunk;
+				if (fs_write(inodes[f], model + at, chunk, k * chunk) != chunk)
+				{
+					printf("%s: append to inode %d failed\n", names[l], inodes[f]);
+					return 0;
+				}
+			}
+		}
+		log_phase(names[l], "append", calls, &before, start);
+
+		disk_stats(thedisk, &before);
+		start = now();
+		for (int i = 0; i < calls; i++)
+		{
+			int f = rand() % nfiles;
+			int k = rand() % per_file;
+			size_t at = ((size_t)f * per_file + k) * chunk;
+			for (int j = 0; j < chunk; j += 64)
+			{
+				model[at + j] = rand();
+			}
+			if (fs_write(inodes[f], model + at, chunk, k * chunk) != chunk)
+			{
+				printf("%s: overwrite of inode %d failed\n", names[l], inodes[f]);
+				return 0;
+			}
+		}
+		log_phase(names[l], "overwrite", calls, &before, start);
+
+		fs_unmount();
+		fs_mount();
+		disk_stats(thedisk, &before);
+		start = now();
+		for (int f = 0; f < nfiles; f++)
+		{
+			int size = per_file * chunk;
+			if (fs_read(inodes[f], back, size, 0) != size || memcmp(back, model + (size_t)f * size, size))
+			{
+				printf("%s: inode %d read back the wrong data\n", names[l], inodes[f]);
+				return 0;
+			}
+		}
+		log_phase(names[l], "read", nfiles, &before, start);
+		fs_unmount();
+		disk_close(thedisk);
+	}
+	free(model);
+	free(back);
+	free(inodes);
+	return 1;
+}
+
+// The contents of the files bench_build provisions, one after another.
+struct build_source
+{
+	const unsigned char *model;
+	const size_t *at;
+};
+
+static int build_fill(int file, unsigned char *data, int length, int offset, void *arg)
+{
+	struct build_source *src = arg;
+	memcpy(data, src->model + src->at[file] + offset, length);
+	return length;
+}
+
+// Provision an image with files of 1K to 1M, spread evenly over the
+// powers of two, until half the disk is used: once the way the shell's
+// copyin does it, fs_create and then fs_write a megabyte at a time, and
+// once through fs_build, which lays everything out first and writes it in
+// large sequential runs. Both images are read back after a remount.
+static int bench_build(const char *image, int nblocks)
+{
+	const char *names[] = {"copyin", "build"};
+	int chunk = 1 << 20;
+	int cap = nblocks;
+	int *sizes = malloc(cap * sizeof(int));
+	size_t *at = malloc(cap * sizeof(size_t));
+	if (!sizes || !at)
+	{
+		return 0;
+	}
+	srand(1);
+	int nfiles = 0;
+	size_t total = 0;
+	while (nfiles < cap && total < (size_t)nblocks * 4096 / 2)
+	{
+		sizes[nfiles] = (1024 << rand() % 11) + rand() % 1024;
+		at[nfiles] = total;
+		total += sizes[nfiles++];
+	}
+	unsigned char *model = malloc(total);
+	unsigned char *back = malloc(2 << 20);
+	if (!model || !back)
+	{
+		return 0;
+	}
+	for (size_t i = 0; i < total; i++)
+	{
+		model[i] = rand();
+	}
+	struct build_source src = {model, at};
+
+	printf("%-8s %8s %10s %10s %12s %10s %10s\n", "method", "files", "requests", "written", "seek MB", "MB/s", "seconds");
+	for (int m = 0; m < 2; m++)
+	{
+		thedisk = disk_open(image, nblocks);
+		if (!thedisk)
+		{
+			printf("couldn't open %s: %s\n", image, strerror(errno));
+			return 0;
+		}
+		struct disk_stats before, after;
+		disk_stats(thedisk, &before);
+		double start = now();
+		if (m == 0)
+		{
+			if (!fs_format(0, 0) || !fs_mount())
+			{
+				printf("couldn't format %s\n", image);
+				return 0;
+			}
+			for (int i = 0; i < nfiles; i++)
+			{
+				int inumber = fs_create();
+				for (int offset = 0; offset < sizes[i]; offset += chunk)
+				{
+					int length = sizes[i] - offset < chunk ? sizes[i] - offset : chunk;
+					if (!inumber || fs_write(inumber, model + at[i] + offset, length, offset) != length)
+					{
+						printf("couldn't write file %d\n", i);
+						return 0;
+					}
+				}
+			}
+		}
+		else if (!fs_build(0, 0, nfiles, sizes, build_fill, &src))
+		{
+			printf("couldn't build %s\n", image);
+			return 0;
+		}
+		double elapsed = now() - start;
+		disk_stats(thedisk, &after);
+		printf("%-8s %8d %10lld %10lld %12.1f %10.1f %10.3f\n", names[m], nfiles, after.requests - before.requests,
+			   after.writes - before.writes, (double)(after.seek_bytes - before.seek_bytes) / (1 << 20),
+			   total / 1048576.0 / elapsed, elapsed);
+
+		// both hand out inumbers 1 to nfiles in order
+		fs_mount();
+		for (int i = 0; i < nfiles; i++)
+		{
+			if (fs_read(i + 1, back, sizes[i], 0) != sizes[i] || memcmp(back, model + at[i], sizes[i]))
+			{
+				printf("%s: inode %d read back the wrong data\n", names[m], i + 1);
+				return 0;
+			}
+		}
+		fs_unmount();
+		disk_close(thedisk);
+	}
+	free(model);
+	free(back);
+	free(sizes);
+	free(at);
+	return 1;
+}
+
+// Build an image of small files, one for every four blocks, and list all
+// the inodes: through fs_debug, with its output thrown away, and through
+// fs_stat_all, which only hands back records, in one call and in batches
+// of 1024. Fails if the batches read more than a block a call beyond what
+// the single call did.
+static int bench_stat(const char *image, int nblocks)
+{
+	int nfiles = nblocks / 4;
+	int *sizes = malloc(nfiles * sizeof(int));
+	unsigned char *model = malloc(8192);
+	size_t *at = calloc(nfiles, sizeof(size_t)); // every file is a prefix of model
+	struct fs_stat *records = malloc(nfiles * sizeof(struct fs_stat));
+	if (!sizes || !model || !at || !records)
+	{
+		return 0;
+	}
+	srand(1);
+	memset(model, 'x', 8192);
+	for (int i = 0; i < nfiles; i++)
+	{
+		sizes[i] = rand() % 8192;
+	}
+	struct build_source src = {model, at};
+
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk)
+	{
+		printf("couldn't open %s: %s\n", image, strerror(errno));
+		return 0;
+	}
+	if (!fs_build(0, 0, nfiles, sizes, build_fill, &src) || !fs_mount())
+	{
+		printf("couldn't build %s\n", image);
+		return 0;
+	}
+
+	const char *names[] = {"debug", "stat", "stat1k"};
+	long long reads[3];
+	int calls = 0;
+	printf("%-8s %8s %10s %10s %10s\n", "method", "inodes", "requests", "blocks", "seconds");
+	for (int m = 0; m < 3; m++)
+	{
+		struct disk_stats before, after;
+		disk_stats(thedisk, &before);
+		double start = now();
+		int found = 0;
+		if (m == 0)
+		{
+			fflush(stdout);
+			int saved = dup(1);
+			int null = open("/dev/null", O_WRONLY);
+			if (saved < 0 || null < 0)
+			{
+				return 0;
+			}
+			dup2(null, 1);
+			fs_debug();
+			fflush(stdout);
+			dup2(saved, 1);
+			close(null);
+			close(saved);
+			found = nfiles;
+		}
+		else
+		{
+			// one call for everything, then batches of 1024 as ls -a asks
+			int next = 0, n;
+			while ((n = fs_stat_all(&next, 0, records, m == 1 ? nfiles : 1024)) > 0)
+			{
+				found += n;
+				calls += m == 2;
+			}
+			if (n < 0 || found != nfiles)
+			{
+				printf("fs_stat_all found %d inodes, not %d\n", found, nfiles);
+				return 0;
+			}
+		}
+		double elapsed = now() - start;
+		disk_stats(thedisk, &after);
+		reads[m] = after.reads - before.reads;
+		printf("%-8s %8d %10lld %10lld %10.3f\n", names[m], found, after.requests - before.requests, reads[m], elapsed);
+	}
+	// small batches may read again the block one call stopped in, but nothing more
+	if (reads[2] > reads[1] + calls)
+	{
+		printf("FAILED: batches of 1024 read %lld blocks, one call %lld\n", reads[2], reads[1]);
+		return 0;
+	}
+	fs_unmount();
+	disk_close(thedisk);
+	free(sizes);
+	free(model);
+	free(at);
+	free(records);
+	return 1;
+}
+
+// Build a dedup image of small files, one for every eight blocks, and
+// start reader processes on it one after another, each mounting the image
+// and reading every file: first with private mounts, each of which scans
+// the image and hashes its data, then with a shared mount, which the first
+// reader builds and the later ones attach to, finding the blocks the
+// earlier ones read already in its cache.
+static int bench_shared(const char *image, int nblocks)
+{
+	const char *names[] = {"private", "shared"};
+	int readers = 4;
+	int nfiles = nblocks / 8;
+	int *sizes = malloc(nfiles * sizeof(int));
+	size_t *at = malloc(nfiles * sizeof(size_t));
+	unsigned char *model = malloc((size_t)nfiles * 4096);
+	if (!sizes || !at || !model)
+	{
+		return 0;
+	}
+	srand(1);
+	for (int i = 0; i < nfiles; i++)
+	{
+		sizes[i] = 1 + rand() % 4000;
+		at[i] = (size_t)i * 4096;
+	}
+	for (size_t i = 0; i < (size_t)nfiles * 4096; i++)
+	{
+		model[i] = rand();
+	}
+	struct build_source src = {model, at};
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk || !fs_build(FS_FORMAT_DEDUP, 0, nfiles, sizes, build_fill, &src))
+	{
+		printf("couldn't build %s\n", image);
+		return 0;
+	}
+	disk_close(thedisk);
+	thedisk = 0;
+
+	char segment[64];
+	snprintf(segment, sizeof(segment), "/svsfs-bench-%d", (int)getpid());
+	printf("%-8s %6s %10s %12s %10s %12s\n", "mount", "reader", "mount s", "mount reqs", "read s", "read reqs");
+	fflush(stdout);
+	for (int m = 0; m < 2; m++)
+	{
+		for (int r = 0; r < readers; r++)
+		{
+			pid_t pid = fork();
+			if (pid < 0)
+			{
+				return 0;
+			}
+			if (pid == 0)
+			{
+				struct disk *d = disk_open(image, nblocks);
+				struct fs *fs = d ? fs_new(d) : 0;
+				unsigned char back[4096];
+				struct disk_stats before, mounted, after;
+				if (!fs)
+				{
+					_exit(1);
+				}
+				disk_stats(d, &before);
+				double start = now();
+				if (!(m ? fs_mount_shared_r(fs, segment) : fs_mount_r(fs)))
+				{
+					printf("%s: reader %d couldn't mount\n", names[m], r);
+					_exit(1);
+				}
+				double mount_time = now() - start;
+				disk_stats(d, &mounted);
+				start = now();
+				for (int i = 0; i < nfiles; i++)
+				{
+					if (fs_read_r(fs, i + 1, back, sizes[i], 0) != sizes[i] || memcmp(back, model + at[i], sizes[i]))
+					{
+						printf("%s: reader %d read back the wrong data from inode %d\n", names[m], r, i + 1);
+						_exit(1);
+					}
+				}
+				double read_time = now() - start;
+				disk_stats(d, &after);
+				printf("%-8s %6d %10.4f %12lld %10.4f %12lld\n", names[m], r, mount_time, mounted.requests - before.requests,
+					   read_time, after.requests - mounted.requests);
+				fflush(stdout);
+				fs_free(fs);
+				disk_close(d);
+				_exit(0);
+			}
+			int status;
+			if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			{
+				fs_shared_remove(segment);
+				return 0;
+			}
+		}
+	}
+	fs_shared_remove(segment);
+	free(sizes);
+	free(at);
+	free(model);
+	return 1;
+}
+
+// Fill the disk, then write past the end of an empty file, of a file with
+// data and beyond the direct blocks, where the indirect block is needed
+// too. Nothing can be stored, so every write must return zero and leave
+// the size as it was; exits non-zero otherwise.
+static int bench_full(const char *image, int nblocks)
+{
+	int chunk = 1 << 20;
+	unsigned char *data = malloc(chunk);
+	if (!data)
+	{
+		return 0;
+	}
+	memset(data, 'x', chunk);
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk || !fs_format(0, 0) || !fs_mount())
+	{
+		printf("couldn't format %s\n", image);
+		return 0;
+	}
+	// a megabyte at a time, four to a file, well inside the largest file
+	int last = 0, full = 0;
+	while (!full)
+	{
+		last = fs_create();
+		if (!last)
+		{
+			printf("ran out of inodes before blocks\n");
+			return 0;
+		}
+		for (int offset = 0; offset < 4 * chunk && !full; offset += chunk)
+		{
+			full = fs_write(last, data, chunk, offset) < chunk;
+		}
+	}
+	int empty = fs_create();
+	struct
+	{
+		const char *what;
+		int inumber;
+		int offset;
+	} cases[] = {
+		{"empty file, past the end", empty, 5 * 4096},
+		{"file with data, past the end", last, fs_getsize(last) + 3 * 4096},
+		{"empty file, beyond the direct blocks", empty, 100 * 4096},
+	};
+	int ok = empty != 0;
+	for (int i = 0; i < 3 && ok; i++)
+	{
+		int size = fs_getsize(cases[i].inumber);
+		int n = fs_write(cases[i].inumber, data, 100, cases[i].offset);
+		int after = fs_getsize(cases[i].inumber);
+		printf("%-40s wrote %d, size %d -> %d\n", cases[i].what, n, size, after);
+		ok = n == 0 && after == size;
+	}
+	fs_unmount();
+	disk_close(thedisk);
+	free(data);
+	if (!ok)
+		printf("FAILED: a write that stored nothing changed the file\n");
+	return ok;
+}
+
+// Link a million names into one directory of a 4K-block image, and each
+// time the count reaches a power of ten look up 10000 of the names linked
+// so far. Lookups should cost the same disk reads at every size. Fails
+// if any link or lookup does.
+static int bench_dir(const char *image, int nblocks)
+{
+	int total = 1000000, probes = 10000;
+	thedisk = disk_open(image, nblocks);
+	if (!thedisk || !fs_format(0, 0) || !fs_mount())
+	{
+		printf("couldn't format %s\n", image);
+		return 0;
+	}
+	int dir = fs_mkdir(fs_root(), "big");
+	int file = fs_create();
+	if (!dir || !file)
+	{
+		return 0;
+	}
+	printf("%10s %12s %12s %14s\n", "entries", "link us", "lookup us", "reads/lookup");
+	char name[64];
+	double start = now();
+	int from = 0;
+	srand(1);
+	for (int n = 10; n <= total; n *= 10)
+	{
+		for (int i = from; i < n; i++)
+		{
+			sprintf(name, "entry-%d", i);
+			if (!fs_link(dir, name, file))
+			{
+				printf("link %d failed\n", i);
+				return 0;
+			}
+		}
+		double linked = now() - start;
+		struct disk_stats before, after;
+		disk_stats(thedisk, &before);
+		double t = now();
+		for (int k = 0; k < probes; k++)
+		{
+			sprintf(name, "entry-%d", rand() % n);
+			if (fs_lookup(dir, name) != file)
+			{
+				printf("lookup of %s failed\n", name);
+				return 0;
+			}
+		}
+		double looked = now() - t;
+		disk_stats(thedisk, &after);
+		printf("%10d %12.2f %12.2f %14.2f\n", n, linked / (n - from) * 1e6, looked / probes * 1e6,
+			   (double)(after.reads - before.reads) / probes);
+		from = n;
+		start = now();
+	}
+	fs_unmount();
+	disk_close(thedisk);
+	return 1;
+}
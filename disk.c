@@ -4,6 +4,8 @@ Make all of your changes to main.c instead.
 */
 
 #define _XOPEN_SOURCE 500L
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include "disk.h"
 
@@ -13,68 +15,499 @@ Make all of your changes to main.c instead.
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 extern ssize_t pread (int __fd, void *__buf, size_t __nbytes, __off_t __offset);
 extern ssize_t pwrite (int __fd, const void *__buf, size_t __nbytes, __off_t __offset);
 
+/*
+A disk is one or more image files. With several members, the byte range of
+the disk is cut into stripe_unit pieces dealt out round-robin, so stripe s
+lives in member s%nmembers at offset (s/nmembers)*stripe_unit. A request
+inside one stripe touches one member and runs on the calling thread. Every
+member except the first has a worker thread; a request that touches several
+members hands each worker its share as one preadv/pwritev and does the
+first member's share itself.
+
+With DISK_DIRECT the members are opened with O_DIRECT. Unaligned buffers
+are staged through bounce buffers of bounce_size bytes, kept in a small
+pool so concurrent requests rarely allocate.
+*/
+
+#define DISK_POOL 4
+#define DISK_BOUNCE (1<<20)
+
+struct disk_io;
+
+struct disk_member {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct disk_io *queue;
+	int stop;
+};
+
+struct disk_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+};
+
+// One member's share of a request: an iovec list over a contiguous range of the member file.
+struct disk_io {
+	struct disk_io *next;
+	struct disk_batch *batch;
+	int write;
+	off_t offset;
+	int iovcnt;
+	struct iovec *iov;
+	ssize_t actual;
+	int error;
+};
 
 struct disk {
 	int fd;
 	int block_size;
 	int nblocks;
+	off_t nbytes;
+	int nmembers;
+	int stripe_unit;
+	struct disk_member *members;
+	struct disk_stats stats;
+	off_t position;
+	int flags;
+	pthread_mutex_t pool_lock;
+	unsigned char *pool[DISK_POOL];
+	int npool;
+	size_t bounce_size;
 };
 
-struct disk * disk_open( const char *diskname, int nblocks )
+static void *disk_worker( void *arg );
+
+struct disk * disk_open_striped( const char **filenames, int nfiles, int nblocks, int stripe_unit )
 {
-	struct disk *d;
+	return disk_open_flags(filenames,nfiles,nblocks,stripe_unit,0);
+}
 
-	d = malloc(sizeof(*d));
-	if(!d) return 0;
+struct disk * disk_open_flags( const char **filenames, int nfiles, int nblocks, int stripe_unit, int flags )
+{
+	struct disk *d;
 
-	d->fd = open(diskname,O_CREAT|O_RDWR,0777);
-	if(d->fd<0) {
-		free(d);
+	if(nfiles<1 || (nfiles>1 && (stripe_unit<=0 || stripe_unit%BLOCK_SIZE))) {
+		errno = EINVAL;
 		return 0;
 	}
 
+	d = calloc(1,sizeof(*d));
+	if(!d) return 0;
+
 	d->block_size = BLOCK_SIZE;
+	d->flags = flags;
+	d->bounce_size = DISK_BOUNCE;
+	pthread_mutex_init(&d->pool_lock,0);
 	d->nblocks = nblocks;
-
-	if(ftruncate(d->fd,d->nblocks*d->block_size)<0) {
-		close(d->fd);
+	d->nbytes = (off_t)nblocks*BLOCK_SIZE;
+	d->nmembers = nfiles;
+	d->stripe_unit = nfiles>1 ? stripe_unit : 0;
+	d->members = calloc(nfiles,sizeof(struct disk_member));
+	if(!d->members) {
+		pthread_mutex_destroy(&d->pool_lock);
 		free(d);
 		return 0;
 	}
 
+	// each member holds every nfiles'th stripe, rounded up to whole stripes
+	off_t member_bytes = d->nbytes;
+	if(nfiles>1) {
+		off_t stripes = (d->nbytes+stripe_unit-1)/stripe_unit;
+		member_bytes = (stripes+nfiles-1)/nfiles*stripe_unit;
+	}
+
+	int i;
+	for(i=0;i<nfiles;i++) {
+		struct disk_member *m = &d->members[i];
+		m->fd = open(filenames[i],O_CREAT|O_RDWR|((flags&DISK_DIRECT) ? O_DIRECT : 0),0777);
+		// an image already the right size is left alone, so opening it doesn't touch its mtime
+		struct stat st;
+		if(m->fd<0 || fstat(m->fd,&st)<0 || (st.st_size!=member_bytes && ftruncate(m->fd,member_bytes)<0)) {
+			int saved = errno;
+			if(m->fd>=0) close(m->fd);
+			d->nmembers = i;
+			disk_close(d);
+			errno = saved;
+			return 0;
+		}
+		pthread_mutex_init(&m->lock,0);
+		pthread_cond_init(&m->wake,0);
+		if(i>0 && pthread_create(&m->thread,0,disk_worker,m)!=0) {
+			close(m->fd);
+			d->nmembers = i;
+			disk_close(d);
+			return 0;
+		}
+	}
+	d->fd = d->members[0].fd;
+
 	return d;
 }
 
-void disk_write( struct disk *d, int block, const unsigned char *data )
+struct disk * disk_open( const char *diskname, int nblocks )
+{
+	return disk_open_striped(&diskname,1,nblocks,0);
+}
+
+void * disk_alloc( size_t size )
+{
+	void *p;
+	if(posix_memalign(&p,DISK_ALIGN,size ? size : 1)) return 0;
+	return p;
+}
+
+static unsigned char * disk_bounce_get( struct disk *d )
 {
-	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_write: invalid block #%d\n",block);
+	unsigned char *b = 0;
+	pthread_mutex_lock(&d->pool_lock);
+	if(d->npool) b = d->pool[--d->npool];
+	pthread_mutex_unlock(&d->pool_lock);
+	if(!b) b = disk_alloc(d->bounce_size);
+	if(!b) {
+		fprintf(stderr,"disk: out of memory for a bounce buffer\n");
 		abort();
 	}
+	return b;
+}
+
+static void disk_bounce_put( struct disk *d, unsigned char *b )
+{
+	pthread_mutex_lock(&d->pool_lock);
+	if(d->npool<DISK_POOL) {
+		d->pool[d->npool++] = b;
+		b = 0;
+	}
+	pthread_mutex_unlock(&d->pool_lock);
+	free(b);
+}
+
+static void disk_pool_drain( struct disk *d )
+{
+	while(d->npool) free(d->pool[--d->npool]);
+}
+
+static void disk_io_run( int fd, struct disk_io *io )
+{
+	io->actual = 0;
+	io->error = 0;
+	while(io->iovcnt>0) {
+		int n = io->iovcnt<IOV_MAX ? io->iovcnt : IOV_MAX;
+		ssize_t want = 0, got;
+		int i;
+		for(i=0;i<n;i++) want += io->iov[i].iov_len;
+		if(io->write) {
+			got = pwritev(fd,io->iov,n,io->offset);
+		} else {
+			got = preadv(fd,io->iov,n,io->offset);
+		}
+		if(got!=want) {
+			io->error = got<0 ? errno : EIO;
+			return;
+		}
+		io->actual += got;
+		io->offset += got;
+		io->iov += n;
+		io->iovcnt -= n;
+	}
+}
+
+static void disk_batch_finish( struct disk_batch *batch )
+{
+	pthread_mutex_lock(&batch->lock);
+	if(--batch->pending==0) pthread_cond_signal(&batch->done);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void *disk_worker( void *arg )
+{
+	struct disk_member *m = arg;
+
+	pthread_mutex_lock(&m->lock);
+	while(1) {
+		while(!m->queue && !m->stop) pthread_cond_wait(&m->wake,&m->lock);
+		if(!m->queue) break;
+		struct disk_io *io = m->queue;
+		m->queue = io->next;
+		pthread_mutex_unlock(&m->lock);
+
+		disk_io_run(m->fd,io);
+		disk_batch_finish(io->batch);
+
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+/*
+Move count blocks starting at block, splitting the range at stripe
+boundaries and running every member's share in parallel.
+*/
+
+static void disk_move( struct disk *d, int block, int count, unsigned char *data, int write )
+{
+	const char *name = write ? "disk_write" : "disk_read";
+	off_t start = (off_t)block*d->block_size;
+	size_t length = (size_t)count*d->block_size;
+
+	int n = d->nmembers;
+	int su = d->stripe_unit;
+	off_t first = n>1 ? start/su : 0;
+	off_t last = n>1 ? (start+length-1)/su : 0;
+	int nstripes = last-first+1;
+
+	// one stripe is one member's: move it here, without waking a worker
+	if(first==last) {
+		int fd = d->members[first%n].fd;
+		off_t offset = (first/n)*su + (start-first*su);
+		ssize_t actual = write ? pwrite(fd,(char*)data,length,offset) : pread(fd,(char*)data,length,offset);
+		if(actual!=(ssize_t)length) {
+			fprintf(stderr,"%s: failed to %s block #%d: %s\n",name,write ? "write" : "read",block,strerror(errno));
+			abort();
+		}
+		return;
+	}
+
+	struct iovec *iov = malloc(nstripes*sizeof(struct iovec));
+	struct disk_io *ios = calloc(n,sizeof(struct disk_io));
+	if(!iov || !ios) {
+		fprintf(stderr,"%s: out of memory\n",name);
+		abort();
+	}
+
+	// stripes first..last, grouped by member; each group is contiguous in its member file
+	int used = 0, m;
+	for(m=0;m<n;m++) {
+		struct disk_io *io = &ios[m];
+		off_t s = first + ((m-first%n)+n)%n;
+		io->write = write;
+		io->iov = iov+used;
+		for(;s<=last;s+=n) {
+			off_t lo = s*su > start ? s*su : start;
+			off_t hi = (s+1)*su < start+(off_t)length ? (s+1)*su : start+(off_t)length;
+			if(io->iovcnt==0) io->offset = (s/n)*su + (lo-s*su);
+			io->iov[io->iovcnt].iov_base = data+(lo-start);
+			io->iov[io->iovcnt].iov_len = hi-lo;
+			io->iovcnt++;
+		}
+		used += io->iovcnt;
+	}
+
+	struct disk_batch batch;
+	pthread_mutex_init(&batch.lock,0);
+	pthread_cond_init(&batch.done,0);
+	batch.pending = 0;
+
+	for(m=1;m<n;m++) {
+		if(!ios[m].iovcnt) continue;
+		ios[m].batch = &batch;
+		batch.pending++;
+	}
+	for(m=1;m<n;m++) {
+		struct disk_member *member = &d->members[m];
+		if(!ios[m].iovcnt) continue;
+		pthread_mutex_lock(&member->lock);
+		ios[m].next = member->queue;
+		member->queue = &ios[m];
+		pthread_cond_signal(&member->wake);
+		pthread_mutex_unlock(&member->lock);
+	}
+	if(ios[0].iovcnt) disk_io_run(d->members[0].fd,&ios[0]);
+
+	pthread_mutex_lock(&batch.lock);
+	while(batch.pending) pthread_cond_wait(&batch.done,&batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+
+	for(m=0;m<n;m++) {
+		if(ios[m].error) {
+			fprintf(stderr,"%s: failed to %s block #%d on member %d: %s\n",name,write ? "write" : "read",block,m,strerror(ios[m].error));
+			abort();
+		}
+	}
+
+	free(iov);
+	free(ios);
+}
 
-	int actual = pwrite(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(errno));
+/*
+Validate and account for a request, then carry it out, through bounce
+buffers when O_DIRECT can't use the caller's buffer.
+*/
+
+static void disk_transfer( struct disk *d, int block, int count, unsigned char *data, int write )
+{
+	if(block<0 || count<0 || block+count>d->nblocks) {
+		fprintf(stderr,"%s: invalid block #%d\n",write ? "disk_write" : "disk_read",block+count-1);
 		abort();
 	}
+
+	off_t start = (off_t)block*d->block_size;
+	off_t length = (off_t)count*d->block_size;
+
+	off_t last_end = __atomic_exchange_n(&d->position,start+length,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&d->stats.requests,1,__ATOMIC_RELAXED);
+	__atomic_add_fetch(write ? &d->stats.writes : &d->stats.reads,count,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&d->stats.seek_bytes,last_end>start ? last_end-start : start-last_end,__ATOMIC_RELAXED);
+
+	if(!(d->flags&DISK_DIRECT) || (uintptr_t)data%DISK_ALIGN==0) {
+		disk_move(d,block,count,data,write);
+		return;
+	}
+
+	__atomic_add_fetch(&d->stats.bounces,count,__ATOMIC_RELAXED);
+	unsigned char *bounce = disk_bounce_get(d);
+	int chunk = d->bounce_size/d->block_size;
+	int done;
+	for(done=0;done<count;done+=chunk) {
+		int n = count-done<chunk ? count-done : chunk;
+		unsigned char *p = data+(size_t)done*d->block_size;
+		if(write) memcpy(bounce,p,(size_t)n*d->block_size);
+		disk_move(d,block+done,n,bounce,write);
+		if(!write) memcpy(p,bounce,(size_t)n*d->block_size);
+	}
+	disk_bounce_put(d,bounce);
+}
+
+void disk_write( struct disk *d, int block, const unsigned char *data )
+{
+	disk_transfer(d,block,1,(unsigned char*)data,1);
 }
 
 void disk_read( struct disk *d, int block, unsigned char *data )
 {
-	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_read: invalid block #%d\n",block);
-		abort();
+	disk_transfer(d,block,1,data,0);
+}
+
+void disk_writev( struct disk *d, int block, int count, const unsigned char *data )
+{
+	disk_transfer(d,block,count,(unsigned char*)data,1);
+}
+
+void disk_readv( struct disk *d, int block, int count, unsigned char *data )
+{
+	disk_transfer(d,block,count,data,0);
+}
+
+/*
+The part of the byte range [start,end) of the disk that lives in member m:
+[*lo,*hi) of the member file, which is contiguous as in disk_move. Returns
+zero when none of it is in m.
+*/
+
+static int disk_member_range( struct disk *d, int m, off_t start, off_t end, off_t *lo, off_t *hi )
+{
+	if(d->nmembers==1) {
+		*lo = start;
+		*hi = end;
+		return start<end;
 	}
+	int n = d->nmembers;
+	off_t su = d->stripe_unit;
+	off_t first = start/su + ((m-start/su%n)+n)%n;
+	off_t last = (end-1)/su - (((end-1)/su%n-m)+n)%n;
+	if(start>=end || first>last) return 0;
+	*lo = (first/n)*su + (first*su<start ? start-first*su : 0);
+	*hi = (last/n)*su + ((last+1)*su<end ? su : end-last*su);
+	return 1;
+}
 
-	int actual = pread(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(errno));
+int disk_discard( struct disk *d, int block, int count )
+{
+	if(!(d->flags&DISK_SPARSE) || count<=0) return 0;
+	if(block<0 || block+count>d->nblocks) {
+		fprintf(stderr,"disk_discard: invalid block #%d\n",block+count-1);
 		abort();
 	}
+
+	off_t start = (off_t)block*d->block_size;
+	off_t end = start+(off_t)count*d->block_size;
+	int m;
+	for(m=0;m<d->nmembers;m++) {
+		off_t lo, hi;
+		if(!disk_member_range(d,m,start,end,&lo,&hi)) continue;
+		if(fallocate(d->members[m].fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,lo,hi-lo)<0) return 0;
+	}
+	__atomic_add_fetch(&d->stats.discards,count,__ATOMIC_RELAXED);
+	return count;
+}
+
+/*
+Where the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after block
+starts, as a byte offset of the disk: the earliest any member reports.
+*/
+
+static off_t disk_seek( struct disk *d, int block, int whence )
+{
+	off_t start = (off_t)block*d->block_size;
+	off_t found = d->nbytes;
+	int m;
+	for(m=0;m<d->nmembers;m++) {
+		off_t lo, hi;
+		if(!disk_member_range(d,m,start,d->nbytes,&lo,&hi)) continue;
+		off_t o = lseek(d->members[m].fd,lo,whence);
+		if(o<0 && errno==ENXIO) continue;
+		if(o<0) return whence==SEEK_DATA ? start : d->nbytes;
+		if(o>=hi) continue;
+		// back from the member file to the disk
+		if(d->nmembers>1) {
+			off_t su = d->stripe_unit;
+			o = ((o/su)*d->nmembers+m)*su + o%su;
+		}
+		if(o<found) found = o;
+	}
+	return found;
+}
+
+int disk_next_data( struct disk *d, int block )
+{
+	return disk_seek(d,block,SEEK_DATA)/d->block_size;
+}
+
+int disk_next_hole( struct disk *d, int block )
+{
+	off_t o = (disk_seek(d,block,SEEK_HOLE)+d->block_size-1)/d->block_size;
+	return o<d->nblocks ? o : d->nblocks;
+}
+
+void disk_set_block_size( struct disk *d, int block_size )
+{
+	d->block_size = block_size;
+	d->nblocks = d->nbytes/block_size;
+
+	// bounce buffers hold at least one block
+	pthread_mutex_lock(&d->pool_lock);
+	disk_pool_drain(d);
+	d->bounce_size = block_size>DISK_BOUNCE ? block_size : DISK_BOUNCE;
+	pthread_mutex_unlock(&d->pool_lock);
+}
+
+int disk_block_size( struct disk *d )
+{
+	return d->block_size;
+}
+
+void disk_stats( struct disk *d, struct disk_stats *s )
+{
+	s->requests = __atomic_load_n(&d->stats.requests,__ATOMIC_RELAXED);
+	s->reads = __atomic_load_n(&d->stats.reads,__ATOMIC_RELAXED);
+	s->writes = __atomic_load_n(&d->stats.writes,__ATOMIC_RELAXED);
+	s->seek_bytes = __atomic_load_n(&d->stats.seek_bytes,__ATOMIC_RELAXED);
+	s->bounces = __atomic_load_n(&d->stats.bounces,__ATOMIC_RELAXED);
+	s->discards = __atomic_load_n(&d->stats.discards,__ATOMIC_RELAXED);
 }
 
 int disk_nblocks( struct disk *d )
@@ -82,8 +515,37 @@ int disk_nblocks( struct disk *d )
 	return d->nblocks;
 }
 
+long long disk_mtime( struct disk *d )
+{
+	long long newest = 0;
+	int i;
+	for(i=0;i<d->nmembers;i++) {
+		struct stat st;
+		if(fstat(d->members[i].fd,&st)<0) return -1;
+		long long t = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+		if(t>newest) newest = t;
+	}
+	return newest;
+}
+
 void disk_close( struct disk *d )
 {
-	close(d->fd);
+	int i;
+	for(i=0;i<d->nmembers;i++) {
+		struct disk_member *m = &d->members[i];
+		if(i>0) {
+			pthread_mutex_lock(&m->lock);
+			m->stop = 1;
+			pthread_cond_signal(&m->wake);
+			pthread_mutex_unlock(&m->lock);
+			pthread_join(m->thread,0);
+		}
+		pthread_mutex_destroy(&m->lock);
+		pthread_cond_destroy(&m->wake);
+		close(m->fd);
+	}
+	disk_pool_drain(d);
+	pthread_mutex_destroy(&d->pool_lock);
+	free(d->members);
 	free(d);
 }
@@ -7,17 +7,68 @@ Make all of your changes to main.c instead.
 #ifndef DISK_H
 #define DISK_H
 
+#include <stddef.h>
+
 #define BLOCK_SIZE 4096
 
 /*
 Create a new virtual disk in the file "filename", with the given number of blocks.
 Returns a pointer to a new disk object, or null on failure.
+The disk starts out with BLOCK_SIZE blocks; "blocks" is always counted in those.
 */
 
 struct disk * disk_open( const char *filename, int blocks );
 
 /*
-Write exactly BLOCK_SIZE bytes to a given block on the virtual disk.
+Create a virtual disk striped across several image files (RAID-0). "blocks"
+is the combined size; consecutive runs of "stripe_unit" bytes (a multiple
+of BLOCK_SIZE) go to the files in turn. Requests that span several files
+are carried out on all of them in parallel.
+*/
+
+struct disk * disk_open_striped( const char **filenames, int nfiles, int blocks, int stripe_unit );
+
+/*
+disk_open_striped with option flags. DISK_DIRECT opens the images with
+O_DIRECT, bypassing the host's page cache, so that caching can be done
+entirely above the disk. Transfers should then use buffers aligned to
+DISK_ALIGN, such as those from disk_alloc; any other buffer is copied
+through an aligned bounce buffer from a small pool.
+*/
+
+#define DISK_DIRECT 0x1
+#define DISK_ALIGN 4096
+
+/*
+DISK_SPARSE lets disk_discard give blocks back to the host.
+*/
+
+#define DISK_SPARSE 0x2
+
+struct disk * disk_open_flags( const char **filenames, int nfiles, int blocks, int stripe_unit, int flags );
+
+/*
+Allocate "size" bytes aligned to DISK_ALIGN, or return null.
+Release the memory with free().
+*/
+
+void * disk_alloc( size_t size );
+
+/*
+Re-divide the disk into blocks of "block_size" bytes, a multiple of BLOCK_SIZE.
+disk_read, disk_write and disk_nblocks use the new size from then on.
+*/
+
+void disk_set_block_size( struct disk *d, int block_size );
+
+/*
+Return the current block size of the disk in bytes.
+*/
+
+int disk_block_size( struct disk *d );
+
+/*
+Write exactly one block to a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to the data to write.
 */
@@ -25,19 +76,76 @@ and "data" is a pointer to the data to write.
 void disk_write( struct disk *d, int block, const unsigned char *data );
 
 /*
-Read exactly BLOCK_SIZE bytes from a given block on the virtual disk.
+Read exactly one block from a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to where the data will be placed.
 */
 
 void disk_read( struct disk *d, int block, unsigned char *data );
 
+/*
+Write or read "count" consecutive blocks starting at "block" in one request.
+*/
+
+void disk_writev( struct disk *d, int block, int count, const unsigned char *data );
+void disk_readv( struct disk *d, int block, int count, unsigned char *data );
+
+/*
+Release count blocks starting at block: a hole is punched in the image
+files there, so the host stops storing them, and they read as zeros from
+then on. Only disks opened with DISK_SPARSE do this. Returns count when
+the blocks were released, or zero when nothing was done.
+*/
+
+int disk_discard( struct disk *d, int block, int count );
+
+/*
+Find the holes in the image files -- regions never written since they
+were created, or released by disk_discard -- so scans can skip them.
+disk_next_data returns the first block at or after "block" that may hold
+data, and disk_next_hole the first block boundary at or after "block"
+where a hole begins; both return disk_nblocks when there is none. Blocks
+between a hole and the next data read as zeros. Where the host can't
+tell, every block holds data.
+*/
+
+int disk_next_data( struct disk *d, int block );
+int disk_next_hole( struct disk *d, int block );
+
+/*
+Traffic since the disk was opened: requests made, blocks moved in each
+direction, and the bytes the position jumped between one request and the
+next -- the distance a disk arm would have to seek. "bounces" counts the
+blocks of DISK_DIRECT transfers that had to be copied through a bounce
+buffer because the caller's buffer was not aligned, and "discards" the
+blocks given back to the host.
+*/
+
+struct disk_stats {
+	long long requests;
+	long long reads;
+	long long writes;
+	long long seek_bytes;
+	long long bounces;
+	long long discards;
+};
+
+void disk_stats( struct disk *d, struct disk_stats *s );
+
 /*
 Return the number of blocks in the virtual disk.
 */
 
 int disk_nblocks( struct disk *d );
 
+/*
+Return the latest modification time of the image files in nanoseconds, or
+-1 on failure, so a copy of the disk's contents kept elsewhere can tell
+whether the disk was written since. Opening a disk does not change it.
+*/
+
+long long disk_mtime( struct disk *d );
+
 /*
 Close the virtual disk.
 */
@@ -1,5 +1,6 @@
 #include "fs.h"
 #include "disk.h"
+#include "simd.h"
 #include <time.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,12 +8,47 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define FS_MAGIC 0x34341023
-#define INODES_PER_BLOCK 128
+#define WIDE_INODE_SIZE 256
 #define POINTERS_PER_INODE 3
-#define POINTERS_PER_BLOCK 1024
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// The block size is chosen at format time and read from the superblock at
+// mount, so everything derived from it is a runtime value. Arrays in the
+// on-disk structures below are declared for the largest block size, but
+// buffers only ever hold block_size bytes.
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
+#define POINTERS_PER_BLOCK (fs->block_size / sizeof(uint32_t))
+#define REFS_PER_BLOCK (fs->block_size / sizeof(uint32_t))
+
+// A snapshot is a frozen copy of the inode table. Its blocks are listed in a
+// chain of map blocks: pointers[0] links to the next map block and the rest
+// hold the copies, one per inode table block, in order. Every block the
+// copied inodes point to, direct or indirect, has its reference count
+// raised, so later writes to the live filesystem copy those blocks instead
+// of overwriting them. The blocks under an indirect block hold one reference
+// for it however many inodes share it; they gain another only when a write
+// gives one of those inodes its own copy of the indirect block.
+#define FS_MAX_SNAPSHOTS 16
+struct fs_snapshot
+{
+	uint32_t id; // zero for an unused slot
+	uint32_t map;
+	int64_t ctime;
+	uint32_t rootdir;
+	uint32_t unused;
+};
 
 struct fs_superblock
 {
@@ -20,109 +56,556 @@ struct fs_superblock
 	uint32_t nblocks;
 	uint32_t ninodeblocks;
 	uint32_t ninodes;
+	uint32_t flags;		 // FS_FORMAT_* options chosen at format time
+	uint32_t nrefblocks; // blocks of per-block reference counts after the inode table
+	uint32_t inode_size; // bytes per inode slot; zero means sizeof(struct fs_inode)
+	uint32_t rootdir;	 // inumber of the root directory, zero until first used
+	uint32_t block_size; // bytes per block; zero means MIN_BLOCK_SIZE
+	uint32_t next_snapshot;
+	struct fs_snapshot snapshots[FS_MAX_SNAPSHOTS];
+	uint32_t itable_uninit; // inode blocks at the end of the table never written since format
+	uint32_t blocks_per_group; // zero for the flat layout (see struct fs_group)
+	uint32_t itable_per_group;
+	uint64_t nblocks64;	 // block count, wide; zero on images that only have nblocks
+	uint32_t nmapblocks; // flat layout: free bitmap blocks after the refcounts
+	uint32_t nimapblocks; // log layout: inode map blocks after the superblock (see struct log_record)
+	uint32_t segment_blocks;
+	uint32_t nsegments;
+	uint32_t log_start; // first block of segment 0
+	uint32_t log_id;	// tells this format's records from those of an earlier one
+	uint32_t log_head;	// where the first record after the checkpoint goes; zero if the log was full
+	uint32_t log_seq;	// the sequence number that record carries
+};
+
+// With FS_FORMAT_GROUPS the blocks after the superblock and refcount table
+// are cut into groups of blocks_per_group. Each group starts with a header
+// block holding its counters and block bitmap, then its share of the inode
+// table, then data. Files get data blocks in their inode's group first.
+#define GROUP_HEADER 64
+#define GROUP_MAX_BLOCKS (8 * (fs->block_size - GROUP_HEADER))
+struct fs_group
+{
+	uint32_t itable_init; // blocks of this group's inode table written since format
+	uint32_t free_inodes;
+	uint32_t unused[GROUP_HEADER / sizeof(uint32_t) - 2];
+	unsigned char bitmap[MAX_BLOCK_SIZE - GROUP_HEADER]; // bit set = block in use
 };
 struct fs_inode
 {
-	uint32_t isvalid;
+	uint16_t isvalid;
+	uint16_t flags; // INODE_* bits
 	uint32_t size;
 	int64_t ctime;
 	uint32_t direct[POINTERS_PER_INODE];
 	uint32_t indirect;
 };
+// With FS_FORMAT_WIDE_INODES each slot is WIDE_INODE_SIZE bytes. Files small
+// enough are stored inline, starting at the direct pointers and running to
+// the end of the slot.
+struct fs_wide_inode
+{
+	struct fs_inode inode;
+	unsigned char extra[WIDE_INODE_SIZE - sizeof(struct fs_inode)];
+};
+#define INODE_INLINE 0x1 // contents live in the inode slot, not in blocks
+#define INODE_DIR 0x2	 // contents are a hashed directory (see fs_lookup)
+#define INODE_DIRDATA 0x4 // holds buckets or the map of a large directory
+#define INLINE_OFFSET offsetof(struct fs_inode, direct)
+
+// Blocks reserved by fs_fallocate but never written have this bit set in
+// the pointers to them. Reads treat them as holes; the first write fills
+// the block in place and clears the bit. Block numbers stay below INT_MAX,
+// so the bit is otherwise unused.
+#define BLOCK_UNWRITTEN 0x80000000u
+#define BLOCK_NUMBER(p) ((int)((p) & ~BLOCK_UNWRITTEN))
+// The block to read file data from, or 0 when it reads as zeros.
+#define BLOCK_READABLE(p) ((p) & BLOCK_UNWRITTEN ? 0 : (int)(p))
+
+// Directories use extendible hashing. File block 0 is a header whose map
+// sends the low global_depth bits of a name hash to a bucket; every bucket
+// holds the entries whose hashes agree on its low local_depth bits. A full
+// bucket splits in two, doubling the map when needed, so a lookup always
+// costs the header, one map entry and one bucket.
+// Buckets are numbered from one. The first are the directory's own file
+// blocks; once it has as many as a file can, the rest go to extents,
+// inodes of a file's worth of buckets each, listed in the header. The map
+// is kept in the header until it outgrows it, then in a map inode.
+#define DIR_MAGIC 0x44495232
+#define DIR_MAGIC_V1 0x44495231 // earlier header: the map right after nentries, no extents
+#define DIR_EXTENTS 256
+#define DIRENT_NAME_MAX 55
+struct fs_dirent
+{
+	uint32_t inumber;
+	uint32_t hash;
+	uint8_t namelen;
+	char name[DIRENT_NAME_MAX];
+};
+#define DIR_MAP_ENTRIES ((fs->block_size - offsetof(struct fs_dirheader, map)) / sizeof(uint32_t))
+#define DIRENTS_PER_BUCKET ((fs->block_size - 2 * sizeof(uint32_t)) / sizeof(struct fs_dirent))
+struct fs_dirheader
+{
+	uint32_t magic;
+	uint32_t global_depth;
+	uint32_t nbuckets;
+	uint32_t nentries;
+	uint32_t map_file; // the map inode, or zero while the map is below
+	uint32_t nextents;
+	uint32_t extents[DIR_EXTENTS];
+	uint32_t map[(MAX_BLOCK_SIZE - (6 + DIR_EXTENTS) * sizeof(uint32_t)) / sizeof(uint32_t)];
+};
+struct fs_dirbucket
+{
+	uint32_t local_depth;
+	uint32_t count;
+	struct fs_dirent entries[(MAX_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct fs_dirent)];
+};
+
+// With FS_FORMAT_LOG nothing but the superblock and the inode map has a
+// fixed place. The rest of the disk is cut into segments, and every block
+// written -- data, indirect blocks and inode table blocks alike -- goes to
+// the next free block of the segment being filled. Blocks are collected in
+// memory and written in chunks of up to a segment, so the disk sees large
+// sequential writes, and a block rewritten before its chunk goes out costs
+// nothing more. The inode map says where each inode table block is. Every
+// chunk starts with a record listing the inode map entries it changes; the
+// map on disk is only rewritten at a checkpoint, and mount replays the
+// records written after it. Overwritten blocks leave holes in older
+// segments, which fs_clean empties by copying what is still live to the
+// head of the log. To find what uses a block without searching every
+// inode, the record also notes the owner of each block of its chunk, in
+// entries filling the record from its end.
+#define LOG_MAGIC 0x4c4f4731
+#define LOG_SEGMENT_BYTES (1 << 20)
+#define LOG_RESERVE 2 // clean segments only the cleaner may take
+#define LOG_LOW 4	  // clean automatically before writing below this many
+struct log_update
+{
+	uint32_t index; // inode table block
+	uint32_t block; // where it is now
+};
+struct log_record
+{
+	uint32_t magic;
+	uint32_t log_id;
+	uint32_t seq;	  // one more than the previous record's
+	uint32_t nblocks; // this block and the ones that follow it
+	uint32_t next;	  // where the next record goes, or zero
+	uint32_t nupdates;
+	uint64_t sum; // hash of the blocks after the record
+	struct log_update updates[(MAX_BLOCK_SIZE - 32) / sizeof(struct log_update)];
+};
+#define LOG_UPDATES ((fs->block_size - offsetof(struct log_record, updates)) / sizeof(struct log_update))
+#define LOG_ITABLE 0xffffffffu	 // inumber of an inode table block, whose index is the offset
+#define LOG_INDIRECT 0xffffffffu // offset of the indirect block of inumber
+struct log_owner
+{
+	uint32_t inumber; // zero when unknown
+	uint32_t offset;  // file block
+};
+
 union fs_block
 {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	unsigned char data[BLOCK_SIZE];
+	int pointers[MAX_BLOCK_SIZE / sizeof(int)];
+	uint32_t refs[MAX_BLOCK_SIZE / sizeof(uint32_t)];
+	struct fs_dirheader dir;
+	struct fs_dirbucket bucket;
+	struct fs_group group;
+	struct log_record log;
+	unsigned char data[MAX_BLOCK_SIZE];
+};
+
+// One slot of the in-memory dedup index: content hash -> disk block, or of
+// its owner table: disk block -> the hash it is indexed under. A slot with
+// block == 0 is empty (block 0 is always the superblock).
+#define DEDUP_INDEX (1 << 18)
+struct dedup_entry
+{
+	uint64_t hash;
+	uint32_t block;
+};
+
+// Inode counters of each group in the grouped layout. They are stored in
+// the group's header block, which is also its free map page.
+struct group_info
+{
+	uint32_t itable_init;
+	uint32_t free_inodes;
 };
 
-// Global Variables
-extern struct disk *thedisk;
-int is_mounted = 0;
-int *freeblock = NULL;
+// One cached page of the free map, or block of the reference count table
+// (see struct fs).
+#define MAP_CACHE 64
+#define REF_CACHE 64
+struct map_slot
+{
+	int page; // -1 when empty
+	int dirty;
+	union fs_block *b;
+};
 
+#define BUFFER_CACHE 16
 
+// A run of blocks freed by the current operation (see discard_flush).
+struct discard_run
+{
+	int start;
+	int count;
+};
 
-// Provided by Flynn:
-int isfree(int b)
+// Where a scan stands in the image: blocks from from to data lie in a
+// hole, and blocks from data to end may hold data (see block_in_hole).
+struct hole_cursor
+{
+	int from;
+	int data;
+	int end;
+};
+
+// A cache of blocks in a shared mount's segment, direct-mapped: key k
+// lives in slot k % nslots. Each slot is a sequence lock over a tag (key
+// plus one, zero when empty) and a block; seq is odd while a process is
+// filling it, and a reader that sees seq change under it misses.
+struct shared_slot
+{
+	uint32_t seq;
+	uint32_t tag;
+};
+struct shared_cache
+{
+	uint64_t slots; // offsets into the segment
+	uint64_t data;
+	uint32_t nslots;
+};
+
+// The shared-memory segment of a shared read-only mount (see
+// fs_mount_shared_r): the state fs_mount builds, then the inode table
+// cache and the block cache. Offsets are from the start of the segment.
+#define SHARED_MAGIC 0x53484d31
+struct shared_header
+{
+	uint32_t magic;
+	uint32_t ready;					 // set once everything else is in place
+	uint64_t size;					 // bytes in the segment
+	struct fs_superblock disk_super; // block 0 of the image, to recognize it by
+	int64_t disk_mtime;				 // and when its files were last written
+	struct fs_superblock super;		 // as mounted
+	uint32_t map_npages;
+	uint64_t groups; // group_count + 1 struct group_info
+	uint64_t imap;	 // log layout: the inode map, or zero
+	uint64_t map_free;
+	uint64_t map_pages; // map_npages free map pages
+	struct shared_cache itable; // keyed by inode table block
+	struct shared_cache blocks; // keyed by disk block
+};
+
+// All the state of one filesystem instance. Every function takes the
+// instance it works on, so separate instances -- one per image, each
+// driven from its own thread -- share nothing.
+struct fs
+{
+	struct disk *disk;
+	int is_mounted;
+	struct fs_superblock super;
+	int block_size;
+	int block_shift;
+
+	// While a snapshot is mounted, view_table[i] is the block holding its copy
+	// of inode table block i, and nothing may be modified.
+	uint32_t *view_table;
+	int readonly;
+
+	// Where the mount scan in dedup mode last found the image's holes.
+	struct hole_cursor mount_holes;
+
+	struct group_info *groups;
+
+	// The free map is a bitmap (bit set = block in use) cut into pages of one
+	// block. Pages live on disk -- in the bitmap blocks of the flat layout or
+	// the group headers of the grouped one -- and map_slots of them are cached,
+	// page p in slot p % map_slots, so memory does not grow with the disk.
+	// Images formatted before the map was kept on disk build every page in
+	// memory at mount instead. map_free counts the free blocks of each page.
+	struct map_slot *map_cache;
+	int map_slots;
+	int map_npages;
+	int map_resident;
+	uint32_t *map_free;
+	pthread_mutex_t map_lock;
+
+	// Where getfreeblock starts looking: the data area of the group of the
+	// inode being written, or zero.
+	int alloc_goal;
+
+	union fs_block *spare_buffers[BUFFER_CACHE];
+	int nspare_buffers;
+	pthread_mutex_t buffer_lock;
+
+	// Reference counts are only kept when the image was formatted with them
+	// (dedup or snapshot mode). Like the free map, the table stays on disk
+	// and ref_slots of its blocks are cached, block i in slot i % ref_slots.
+	struct map_slot *ref_cache;
+	int ref_slots;
+
+	// Dedup index, of a fixed size: each content hash has one slot and a
+	// newer block takes it over, so some duplicates go unnoticed. The owner
+	// table, slot b % size, remembers the hash block b is indexed under so
+	// the entry can be dropped when b is rewritten or freed; a block that
+	// loses its owner slot loses its index entry too.
+	struct dedup_entry *dedup_index;
+	struct dedup_entry *dedup_owner;
+	uint32_t dedup_mask;
+
+	// Log-structured layout. imap[i] is the block holding inode table block
+	// i, or zero while it has never been written. Operations collect their
+	// blocks in log_buffer, the image of the segment being filled, from the
+	// record at log_chunk (zero when no chunk is open) to log_next. The
+	// chunk is written in one request when the segment fills or at fs_sync.
+	uint32_t *imap;
+	unsigned char *imap_dirty; // per inode map block
+	int log_segment;
+	int log_next;
+	int log_chunk;
+	uint32_t log_seq;
+	unsigned char *log_buffer;
+	unsigned char *log_clean;  // per segment: holds nothing live and may be filled
+	unsigned char *log_victim; // per segment: being emptied by fs_clean
+	uint32_t *log_live;		   // per segment: blocks in use
+	int log_full;			   // no segment left to write to
+	int log_switched;		   // a segment was filled since the last checkpoint
+	int log_cleaning;		   // the cleaner may use the reserve
+
+	// A shared read-only mount maps its state from this segment: the free
+	// map pages, map_free, groups and imap point into it, and single block
+	// reads go through its caches.
+	struct shared_header *shared;
+
+	// Blocks freed since the last metadata flush, to be given back to the
+	// host once no block on disk refers to them (see disk_discard).
+	struct discard_run *discards;
+	int ndiscards;
+	int discard_cap;
+
+	// Async request queue and workers (see fs_async_start_r).
+	pthread_mutex_t async_lock;
+	pthread_cond_t async_work;	// queue not empty, or stopping
+	pthread_cond_t async_space; // in_flight dropped
+	pthread_cond_t async_done;	// a request finished
+	pthread_rwlock_t fs_lock;
+	struct fs_future *async_head;
+	struct fs_future *async_tail;
+	pthread_t *async_threads;
+	int async_nthreads;
+	int async_limit;
+	int async_in_flight;
+	int async_stopping;
+};
+
+// Block buffers are too big for the stack once blocks reach a megabyte, so
+// they come from a small free list and go back to it automatically when the
+// variable goes out of scope. The lease remembers whose list that is.
+struct block_lease
+{
+	struct fs *fs;
+	union fs_block *b;
+};
+#define BLOCK_BUFFER(name)                                                                     \
+	struct block_lease name##_lease __attribute__((cleanup(block_put))) = {fs, block_get(fs)}; \
+	union fs_block *name = name##_lease.b
+
+int pemar(char *message);
+int isfree(struct fs *fs, int b);
+int find_free_run(struct fs *fs, int n);
+void log_flush(struct fs *fs);
+void log_reserve(struct fs *fs);
+void shared_detach(struct fs *fs);
+
+union fs_block *block_get(struct fs *fs)
 {
-	int ix = b / 8; // 8 bits per byte; this is the byte number
-	unsigned char mask[] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
-	// if bit is set, return nonzero; else return zero
-	return ((freeblock[ix] & mask[b % 8]) != 0);
+	// async readers share the free list
+	pthread_mutex_lock(&fs->buffer_lock);
+	if (fs->nspare_buffers)
+	{
+		union fs_block *b = fs->spare_buffers[--fs->nspare_buffers];
+		pthread_mutex_unlock(&fs->buffer_lock);
+		return b;
+	}
+	pthread_mutex_unlock(&fs->buffer_lock);
+	// aligned, so the disk can transfer straight into it under O_DIRECT
+	union fs_block *b = disk_alloc(fs->block_size);
+	if (!b)
+	{
+		fprintf(stderr, "error: out of memory for a %d byte block\n", fs->block_size);
+		exit(1);
+	}
+	return b;
 }
 
-int getfreeblock()
+void block_put(struct block_lease *lease)
 {
-	// printf("Searching %d blocks for a free block\n",disk_nblocks(thedisk));
-	for (int i = 0; i < disk_nblocks(thedisk); i++)
-		if (freeblock[i] == 1)
-		{
-			// printf("found free block at %d\n",i);
-			return i;
-		}
-	printf("No free blocks found\n");
-	return -1;
+	struct fs *fs = lease->fs;
+	pthread_mutex_lock(&fs->buffer_lock);
+	if (fs->nspare_buffers < BUFFER_CACHE)
+	{
+		fs->spare_buffers[fs->nspare_buffers++] = lease->b;
+		lease->b = NULL;
+	}
+	pthread_mutex_unlock(&fs->buffer_lock);
+	free(lease->b);
+}
+
+// First block of log segment s.
+int segment_first(struct fs *fs, int s)
+{
+	return fs->super.log_start + s * fs->super.segment_blocks;
+}
+
+// Whether block b belongs to the chunk still being collected in the log
+// buffer. Its contents are only in memory until the chunk is written.
+int log_pending(struct fs *fs, int b)
+{
+	return fs->log_chunk && b > fs->log_chunk && b < fs->log_next;
+}
+
+unsigned char *log_image(struct fs *fs, int b)
+{
+	return fs->log_buffer + ((size_t)(b - segment_first(fs, fs->log_segment)) << fs->block_shift);
+}
+
+// Read disk block b through a cache of the shared segment, as key. A miss
+// reads the disk and fills the slot, unless another process is filling it.
+void shared_read(struct fs *fs, struct shared_cache *c, uint32_t key, int b, unsigned char *data)
+{
+	unsigned char *base = (unsigned char *)fs->shared;
+	struct shared_slot *slot = (struct shared_slot *)(base + c->slots) + key % c->nslots;
+	unsigned char *cached = base + c->data + ((size_t)(key % c->nslots) << fs->block_shift);
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (!(seq & 1) && __atomic_load_n(&slot->tag, __ATOMIC_RELAXED) == key + 1)
+	{
+		memcpy(data, cached, fs->block_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+	disk_read(fs->disk, b, data);
+	if (!(seq & 1) && __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&slot->tag, key + 1, __ATOMIC_RELAXED);
+		memcpy(cached, data, fs->block_size);
+		__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+}
+
+// Block I/O for everything above the free map. Blocks of the open log
+// chunk are served from the log buffer, and a shared mount reads single
+// blocks through its block cache.
+void block_read(struct fs *fs, int b, unsigned char *data)
+{
+	if (log_pending(fs, b))
+		memcpy(data, log_image(fs, b), fs->block_size);
+	else if (fs->shared)
+		shared_read(fs, &fs->shared->blocks, b, b, data);
+	else
+		disk_read(fs->disk, b, data);
+}
+
+void block_readv(struct fs *fs, int b, int n, unsigned char *data)
+{
+	if (!fs->log_chunk || b + n <= fs->log_chunk || b >= fs->log_next)
+	{
+		disk_readv(fs->disk, b, n, data);
+		return;
+	}
+	for (int i = 0; i < n; i++)
+		block_read(fs, b + i, data + ((size_t)i << fs->block_shift));
+}
+
+void block_write(struct fs *fs, int b, const unsigned char *data)
+{
+	if (log_pending(fs, b))
+		memcpy(log_image(fs, b), data, fs->block_size);
+	else
+		disk_write(fs->disk, b, data);
 }
 
-int getfblockindex(struct fs_inode *inode, unsigned int blkno)
+// Switch every size derived from the block size, including the disk's.
+// No block buffer may be held across this call.
+int set_block_size(struct fs *fs, int size)
 {
+	if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)))
+	{
+		return pemar("error: block size must be a power of two from 4K to 1M");
+	}
+	// the cached buffers have the old size
+	while (fs->nspare_buffers)
+		free(fs->spare_buffers[--fs->nspare_buffers]);
+	fs->block_size = size;
+	for (fs->block_shift = 0; (1 << fs->block_shift) < size; fs->block_shift++)
+		;
+	disk_set_block_size(fs->disk, size);
+	return 1;
+}
+
+int getfblockindex(struct fs *fs, struct fs_inode *inode, unsigned int blkno)
+{
+	// Returns the disk block holding file block blkno, or 0 for a hole.
 	assert(blkno < (POINTERS_PER_BLOCK + POINTERS_PER_INODE));
 	if (blkno < POINTERS_PER_INODE)
 	{
-		assert(inode->direct[blkno] != 0);
-
-		assert(!isfree(inode->direct[blkno]));
+		assert(!inode->direct[blkno] || !isfree(fs, inode->direct[blkno]));
 #ifdef DEBUG
 		printf("fblock %d, dblock %d (direct)\n", blkno, inode->direct[blkno]);
 #endif
-		return inode->direct[blkno];
+		return BLOCK_READABLE(inode->direct[blkno]);
 	}
 	else
 	{
+		if (!inode->indirect)
+			return 0;
 		// read indirect block
-		union fs_block ib;
-		assert(!isfree(inode->indirect));
-		disk_read(thedisk, inode->indirect, ib.data);
+		BLOCK_BUFFER(ib);
+		assert(!isfree(fs, inode->indirect));
+		block_read(fs, inode->indirect, ib->data);
 		// read data pointed to by pointer within the block (make sure to offset index)
-		int dbno = ib.pointers[blkno - POINTERS_PER_INODE];
+		int dbno = BLOCK_READABLE(ib->pointers[blkno - POINTERS_PER_INODE]);
 #ifdef DEBUG
 		printf("fblock %d, dblock %d (indirect in block %d)\n", blkno, dbno, inode->indirect);
 #endif
-		assert(dbno != 0);
-		assert(!isfree(dbno));
+		assert(!dbno || !isfree(fs, dbno));
 		return dbno;
 	}
 }
 
-void getfblock(struct fs_inode *inode, unsigned char *data, unsigned int fblkno, unsigned int *bkidx)
+void getfblock(struct fs *fs, struct fs_inode *inode, unsigned char *data, unsigned int fblkno, unsigned int *bkidx)
 {
-	int dblkno = getfblockindex(inode, fblkno);
+	int dblkno = getfblockindex(fs, inode, fblkno);
 #ifdef DEBUG
 	printf("getfblock: file block %d is disk block %d\n", fblkno, dblkno);
 #endif
-	disk_read(thedisk, dblkno, data);
+	if (dblkno)
+		block_read(fs, dblkno, data);
+	else
+		memset(data, 0, fs->block_size);
 	if (bkidx)
 		*bkidx = dblkno;
 }
 
-// set the bit indicating that block b is free.
-void markfree(int b)
+// getfblockindex for loops over many blocks of one file: the indirect block
+// is read into ib the first time it is needed (*loaded records that) and
+// reused after.
+int fblock_cached(struct fs *fs, struct fs_inode *inode, union fs_block *ib, int *loaded, unsigned int blkno)
 {
-	int ix = b / 8; // 8 bits per byte; this is the index of the byte to modify
-	unsigned char mask[] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
-	// OR in the bit that corresponds to the block we're talking about.
-	freeblock[ix] |= mask[b % 8];
-}
-
-// set the bit indicating that block b is used.
-void markused(int b)
-{
-	int ix = b / 8; // 8 bits per byte; this is the index of the byte to modify
-	unsigned char mask[] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
-	// AND the byte with the inverse of the bitmask to force the desired bit to 0
-	freeblock[ix] &= ~mask[b % 8];
+	if (blkno < POINTERS_PER_INODE)
+		return BLOCK_READABLE(inode->direct[blkno]);
+	if (!inode->indirect)
+		return 0;
+	if (!*loaded)
+	{
+		block_read(fs, inode->indirect, ib->data);
+		*loaded = 1;
+	}
+	return BLOCK_READABLE(ib->pointers[blkno - POINTERS_PER_INODE]);
 }
 
 int pemar(char *message)
@@ -131,605 +614,4720 @@ int pemar(char *message)
 	return 0;
 }
 
-void print_freeblock(){
+void print_freeblock(struct fs *fs){
 	// print free block
-	for(int	i = 0; i < disk_nblocks(thedisk); i++){
-		freeblock[i] ? printf("1") : printf("0");
+	for(int	i = 0; i < fs->super.nblocks; i++){
+		isfree(fs, i) ? printf("1") : printf("0");
 	}
 	printf("\n");
 }
 
-int fs_format()
+// Number of blocks needed to hold one reference count per disk block.
+int refblocks_for(struct fs *fs, int nblocks)
 {
-	/**
-	Creates a new filesystem on the disk, destroying any data already present.
-	Sets aside ten percent of the blocks for inodes, clears the inode table, and
-	writes the superblock. Returns one on success, zero otherwise. Formatting a
-	filesystem does not cause it to be mounted. Also, an attempt to format an
-	already-mounted disk should do nothing and return failure.
-	**/
-	if (is_mounted)
-	{
-		return pemar("error: system is already mounted");
-	}
+	return (nblocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+}
 
-	int n = disk_nblocks(thedisk) / 10;
-	if ((disk_nblocks(thedisk) % 10) != 0)
-	{
-		n++;
-	}
+// Grouped layout: where group 0 starts, and how many groups there are.
+int group_base(struct fs *fs)
+{
+	return 1 + fs->super.nrefblocks;
+}
 
-	int n_inodes_blocks = n;
+int group_count(struct fs *fs)
+{
+	return fs->super.blocks_per_group ? fs->super.ninodeblocks / fs->super.itable_per_group : 0;
+}
 
-	union fs_block b;
-	b.super.magic = FS_MAGIC;
-	b.super.nblocks = disk_nblocks(thedisk);
-	b.super.ninodeblocks = n_inodes_blocks;
-	b.super.ninodes = n_inodes_blocks * INODES_PER_BLOCK;
-	disk_write(thedisk, 0, b.data);
-	int to = b.super.ninodeblocks;
-	// iterate through inodes and init it to 0
-	for (int i = 1; i < to; i++)
-	{
-		memset(b.inode, 0, sizeof(struct fs_inode));
-		disk_write(thedisk, i, b.data);
-	}
+int group_start(struct fs *fs, int g)
+{
+	return group_base(fs) + g * fs->super.blocks_per_group;
+}
 
-	// we allocated just the superblock
-	return 1;
+// Header block plus inode table at the front of every group.
+int group_meta(struct fs *fs)
+{
+	return 1 + fs->super.itable_per_group;
 }
 
-void fs_debug()
+int group_of(struct fs *fs, int b)
 {
-	/**
-	Scan a mounted filesystem and report on how the inodes and blocks are organized.
-	**/
-	union fs_block block;
+	return (b - group_base(fs)) / fs->super.blocks_per_group;
+}
 
-	disk_read(thedisk, 0, block.data);
+// Disk block holding refcount block i.
+int refcount_block(struct fs *fs, int i)
+{
+	return fs->super.blocks_per_group ? 1 + i : 1 + fs->super.ninodeblocks + i;
+}
 
-	printf("superblock:\n");
-	printf("    %d blocks\n", block.super.nblocks);
-	printf("    %d inode blocks\n", block.super.ninodeblocks);
-	printf("    %d inodes\n", block.super.ninodes);
+// First block past the fixed metadata (superblock, inode table, refcounts,
+// free bitmap). In the grouped layout, the first data block of group 0;
+// in the log layout, the first block of the first segment.
+int first_data_block(struct fs *fs)
+{
+	if (fs->super.flags & FS_FORMAT_LOG)
+		return fs->super.log_start;
+	if (fs->super.blocks_per_group)
+		return group_start(fs, 0) + group_meta(fs);
+	return 1 + fs->super.ninodeblocks + fs->super.nrefblocks + fs->super.nmapblocks;
+}
 
-	int ninodes = block.super.ninodes;
-	int inodes_per_block = BLOCK_SIZE / sizeof(struct fs_inode);
-	int inode_blocks = ninodes / inodes_per_block;
+// Whether b may hold file data or an indirect block.
+int is_data_block(struct fs *fs, int b)
+{
+	if (b < first_data_block(fs) || b >= fs->super.nblocks)
+		return 0;
+	if (fs->super.flags & FS_FORMAT_LOG)
+		return b < segment_first(fs, fs->super.nsegments);
+	if (!fs->super.blocks_per_group)
+		return 1;
+	return group_of(fs, b) < group_count(fs) && (b - group_base(fs)) % fs->super.blocks_per_group >= group_meta(fs);
+}
 
-	for (int i = 0; i < inode_blocks - 1; i++)
-	{
-		// printf("\n\nRound %d\n\n", i+1);
-		disk_read(thedisk, i + 1, block.data);
-		for (int j = 0; j < inodes_per_block; j++)
-		{
-			if (block.inode[j].isvalid)
-			{
-				char ctime_str[30];
-				struct tm *ctime_tm = localtime(&block.inode[j].ctime);
-				strftime(ctime_str, sizeof(ctime_str), "%a %b %d %H:%M:%S %Y", ctime_tm);
+// Free map pages: a group each in the grouped layout, otherwise
+// 8 * block_size blocks each, counted from block 0.
+int map_page_blocks(struct fs *fs)
+{
+	return fs->super.blocks_per_group ? fs->super.blocks_per_group : 8 * fs->block_size;
+}
 
-				printf("inode %d:\n", j);
-				if (block.inode[j].isvalid == 0)
-				{
-					printf("    valid: NO\n");
-				}
-				else
-				{
-					printf("    valid: YES\n");
-				}
-				printf("    size: %d bytes\n", block.inode[j].size);
-				printf("    created: %s\n", ctime_str);
-				printf("    direct blocks:");
-				for (int k = 0; k < POINTERS_PER_INODE; k++)
-				{
-					if (block.inode[j].direct[k])
-					{
-						printf(" %d", block.inode[j].direct[k]);
-					}
-				}
-				printf("\n");
-				if (block.inode[j].indirect)
-				{
-					printf("    indirect block: %d\n", block.inode[j].indirect);
-					printf("    indirect data blocks:");
-					disk_read(thedisk, block.inode[j].indirect, block.data);
-					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
-					{
-						if (block.pointers[k])
-						{
-							printf(" %d", block.pointers[k]);
-						}
-					}
-					printf("\n");
-				}
-			}
-		}
-	}
+int map_page_first(struct fs *fs, int p)
+{
+	return fs->super.blocks_per_group ? group_start(fs, p) : p * map_page_blocks(fs);
+}
 
-	printf("\n");
-	printf("\n");
+// Free map page covering block b, or -1 for blocks outside every page.
+int map_page_of(struct fs *fs, int b)
+{
+	int p = fs->super.blocks_per_group ? (b < group_base(fs) ? -1 : group_of(fs, b)) : b / map_page_blocks(fs);
+	return p < fs->map_npages ? p : -1;
+}
 
-	return;
+int map_page_block(struct fs *fs, int p)
+{
+	return fs->super.blocks_per_group ? group_start(fs, p) : 1 + fs->super.ninodeblocks + fs->super.nrefblocks + p;
 }
 
-int fs_mount()
+unsigned char *map_bits(struct fs *fs, union fs_block *page)
 {
-	/**
-	Examine the disk for a filesystem. If one is present, read the superblock,
-	build a free block bitmap, and prepare the filesystem for use. Return one on success, zero otherwise.
-	A successful mount is a pre-requisite for the remaining calls.
-	**/
-	union fs_block super_block;
-	disk_read(thedisk, 0, super_block.data);
+	return fs->super.blocks_per_group ? page->group.bitmap : page->data;
+}
 
-	if (super_block.super.magic != FS_MAGIC)
+void map_write(struct fs *fs, struct map_slot *s)
+{
+	if (fs->super.blocks_per_group)
 	{
-		return pemar("error: superblock does not match the MAGIC number.");
+		s->b->group.itable_init = fs->groups[s->page].itable_init;
+		s->b->group.free_inodes = fs->groups[s->page].free_inodes;
 	}
-	if (super_block.super.ninodes == 0 || super_block.super.nblocks == 0)
+	disk_write(fs->disk, map_page_block(fs, s->page), s->b->data);
+	s->dirty = 0;
+}
+
+// The cache slot holding free map page p, loading it if needed.
+struct map_slot *map_slot(struct fs *fs, int p)
+{
+	struct map_slot *s = &fs->map_cache[p % fs->map_slots];
+	if (s->page != p)
 	{
-		// pemar
-		return pemar("error: the filesystem has no blocks");
+		if (s->dirty)
+			map_write(fs, s);
+		block_read(fs, map_page_block(fs, p), s->b->data);
+		s->page = p;
+		s->dirty = 0;
 	}
+	return s;
+}
 
-	// freeblock = (int *)malloc(super_block.super.nblocks, sizeof(unsigned));
-	
-	int NFB = 0;
+// Note a change to page p that must reach the disk at the next flush.
+void map_touch(struct fs *fs, int p)
+{
+	if (!fs->map_resident)
+		map_slot(fs, p)->dirty = 1;
+}
 
-	 // build free block bitmap
-    if (freeblock) free(freeblock);
-	freeblock = (int *)malloc(super_block.super.nblocks * sizeof(int));
-	if (!freeblock)
+// Write back the free map pages changed since the last flush.
+void map_flush(struct fs *fs)
+{
+	for (int i = 0; i < fs->map_slots && !fs->map_resident; i++)
 	{
-		exit(1);
-	}
-    
-	// super block is not free
-	freeblock[0] = 0;
-	for (int i = 1; i < super_block.super.nblocks; i++) {
-		freeblock[i] = 1;
-		NFB++;
+		if (fs->map_cache[i].dirty)
+			map_write(fs, &fs->map_cache[i]);
 	}
+}
+
+// Provided by Flynn:
+int isfree(struct fs *fs, int b)
+{
+	int p = map_page_of(fs, b);
+	if (p < 0)
+		return 0;
+	int j = b - map_page_first(fs, p);
+	// async readers check blocks while others may be loading pages
+	pthread_mutex_lock(&fs->map_lock);
+	int used = map_bits(fs, map_slot(fs, p)->b)[j >> 3] & (1 << (j & 7));
+	pthread_mutex_unlock(&fs->map_lock);
+	return !used;
+}
 
-	// scan through filesystem and mark what is in use
+// Set block b's bit in the free map to used (1) or free (0).
+void map_set(struct fs *fs, int b, int used)
+{
+	int p = map_page_of(fs, b);
+	int j = b - map_page_first(fs, p);
+	struct map_slot *s = map_slot(fs, p);
+	unsigned char *byte = &map_bits(fs, s->b)[j >> 3];
+	if (!(*byte & (1 << (j & 7))) == !used)
+		return;
+	*byte ^= 1 << (j & 7);
+	fs->map_free[p] += used ? -1 : 1;
+	if (!fs->map_resident)
+		s->dirty = 1;
+	if (fs->log_live && b >= fs->super.log_start)
+		fs->log_live[(b - fs->super.log_start) / fs->super.segment_blocks] += used ? 1 : -1;
+}
 
-	for (int i = 1; i < super_block.super.ninodeblocks; i++)
+// set the flag indicating that block b is free.
+void markfree(struct fs *fs, int b)
+{
+	map_set(fs, b, 0);
+	// the log gives back whole segments instead, once they are clean
+	if (fs->imap)
+		return;
+	struct discard_run *last = fs->ndiscards ? &fs->discards[fs->ndiscards - 1] : NULL;
+	if (last && last->start + last->count == b)
 	{
-		/* code */
-		union fs_block b;
-		disk_read(thedisk, i, b.data);
-		// iterate through each inode in the block
-		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		last->count++;
+		return;
+	}
+	if (fs->ndiscards == fs->discard_cap)
+	{
+		fs->discard_cap = fs->discard_cap ? 2 * fs->discard_cap : 64;
+		fs->discards = realloc(fs->discards, fs->discard_cap * sizeof(struct discard_run));
+		if (!fs->discards)
 		{
-			if (!b.inode[j].isvalid)
-			{
-				continue;
-			}
-
-			for (int k = 0; k < POINTERS_PER_INODE; k++)
-			{
-				if (b.inode[j].direct[k])
-				{
-					markused(b.inode[j].direct[k]);
-					freeblock[b.inode[j].direct[k]] = 0;
-					NFB--;
-				}
-			}
-			if (b.inode[j].indirect != 0)
-			{
-				// iterate through all the indirect
-				union fs_block indirect_block;
-				disk_read(thedisk, b.inode[j].indirect, indirect_block.data);
-				for (int k = 0; k < POINTERS_PER_BLOCK; k++)
-				{
-
-					if (indirect_block.pointers[k])
-					{
-						markused(indirect_block.pointers[k]);
-						freeblock[indirect_block.pointers[k]] = 0;
-						NFB--;
-					}
-					else
-					{
-						break;
-					}
-				}
-			}
+			exit(1);
 		}
 	}
-
-	is_mounted = 1 == 1;
-
-	return 1;
+	fs->discards[fs->ndiscards++] = (struct discard_run){b, 1};
 }
 
-int fs_create()
+// set the flag indicating that block b is used.
+void markused(struct fs *fs, int b)
 {
-	// Create a new inode of zero length. On success, return the (positive)
-	// inumber. On failure, return zero.
+	map_set(fs, b, 1);
+}
 
-	if (!is_mounted)
+// Mark the n blocks of list used, setting the bits of each free map page
+// in one pass. The blocks must all lie in pages.
+void map_set_used(struct fs *fs, const int *list, int n)
+{
+	for (int i = 0; i < n;)
 	{
-		return pemar("error: system is already mounted");
+		int p = map_page_of(fs, list[i]);
+		int first = map_page_first(fs, p);
+		int k = i + 1;
+		while (k < n && (unsigned)(list[k] - first) < (unsigned)map_page_blocks(fs))
+			k++;
+		struct map_slot *s = map_slot(fs, p);
+		int added = simd.scatter_bits(map_bits(fs, s->b), first, list + i, k - i);
+		fs->map_free[p] -= added;
+		if (added && !fs->map_resident)
+			s->dirty = 1;
+		i = k;
 	}
+}
 
-	// Read super_block and get number of inodes
-	union fs_block block;
-	disk_read(thedisk, 0, block.data);
-
-	int NIN = block.super.ninodes;
-	int BLK = 1;
-	int INODEI = 0;
-
-	union fs_block b;
-	disk_read(thedisk, BLK, b.data);
+// Lowest clear bit of page p at or after block offset from, or -1.
+int map_scan_page(struct fs *fs, int p, int from)
+{
+	unsigned char *bits = map_bits(fs, map_slot(fs, p)->b);
+	int n = MIN(map_page_blocks(fs), fs->super.nblocks - map_page_first(fs, p));
+	return simd.find_bit(bits, from, n, 0);
+}
 
-	for (int i = 1; i < NIN - 1; i++)
+int getfreeblock(struct fs *fs)
+{
+	// Search from the allocation goal, skipping pages with nothing free,
+	// and wrap around to the start.
+	int start = MAX(map_page_of(fs, fs->alloc_goal), 0);
+	for (int k = 0; k <= fs->map_npages; k++)
 	{
-		/* code */
-
-		if (i % INODES_PER_BLOCK == 0)
-		{
-			BLK += 1;
-			disk_read(thedisk, BLK, b.data);
-		}
-
-		if (b.inode[i].isvalid == 0)
-		{
-			INODEI = i;
-			break;
-		}
-		// iterate through each inode in the block
+		int p = (start + k) % fs->map_npages;
+		if (!fs->map_free[p])
+			continue;
+		int from = k == 0 ? fs->alloc_goal - map_page_first(fs, p) : 0;
+		int j = map_scan_page(fs, p, MAX(from, 0));
+		if (j >= 0)
+			return map_page_first(fs, p) + j;
 	}
+	printf("No free blocks found\n");
+	return -1;
+}
 
-	if (!INODEI)
-	{
-		return pemar("error: system is full and can't create more inodes.");
-	}
+int inodes_per_block(struct fs *fs)
+{
+	return fs->block_size / fs->super.inode_size;
+}
 
-	b.inode[INODEI].isvalid = 1;
+// Disk block holding block i of the inode table currently in view.
+int inode_table_block(struct fs *fs, int i)
+{
+	if (fs->view_table)
+		return fs->view_table[i];
+	if (fs->imap)
+		return fs->imap[i];
+	if (fs->super.blocks_per_group)
+		return group_start(fs, i / fs->super.itable_per_group) + 1 + i % fs->super.itable_per_group;
+	return i + 1;
+}
 
-	// set ctime
-	b.inode[INODEI].ctime = time(NULL);
-	b.inode[INODEI].direct[0] = 0;
-	b.inode[INODEI].direct[1] = 0;
-	b.inode[INODEI].direct[2] = 0;
-	b.inode[INODEI].indirect = 0;
+// Disk block holding inode inumber.
+int inode_block(struct fs *fs, int inumber)
+{
+	return inode_table_block(fs, inumber / inodes_per_block(fs));
+}
 
-	disk_write(thedisk, BLK, b.data);
+// Inode table blocks below the watermark have been zeroed; the rest still
+// hold whatever was on the disk before format and count as empty.
+// Each group of the grouped layout keeps its own watermark instead.
+int itable_watermark(struct fs *fs)
+{
+	return fs->super.ninodeblocks - fs->super.itable_uninit;
+}
 
-	return INODEI;
+int itable_initialized(struct fs *fs, int i)
+{
+	if (fs->imap)
+		return fs->imap[i] != 0;
+	if (fs->super.blocks_per_group)
+		return fs->groups && i % fs->super.itable_per_group < fs->groups[i / fs->super.itable_per_group].itable_init;
+	return i < itable_watermark(fs);
+}
 
-	return 0;
+// Read block i of the inode table in view.
+void read_itable(struct fs *fs, int i, union fs_block *b)
+{
+	if (!fs->view_table && !itable_initialized(fs, i))
+		memset(b->data, 0, fs->block_size);
+	else if (fs->shared)
+		shared_read(fs, &fs->shared->itable, i, inode_table_block(fs, i), b->data);
+	else
+		block_read(fs, inode_table_block(fs, i), b->data);
 }
 
-int fs_delete(int inumber)
+// Read the inode table block holding inode inumber.
+void read_inode_block(struct fs *fs, int inumber, union fs_block *b)
 {
-	// Delete the inode indicated by the inumber. Release all data and indirect
-	// blocks assigned to this inode and return them to the free block map. On
-	// success, return one. On failure, return 0.
+	read_itable(fs, inumber / inodes_per_block(fs), b);
+}
 
-	if (!is_mounted)
+// Write zeros over count blocks starting at first, in large runs. A
+// sparse disk punches a hole there instead.
+void zero_blocks(struct fs *fs, int first, int count)
+{
+	if (disk_discard(fs->disk, first, count))
 	{
-		return pemar("error: system is already mounted");
+		return;
 	}
-
-	if (inumber < 1)
+	int chunk = MIN(count, MAX_BLOCK_SIZE / fs->block_size);
+	unsigned char *zeros = disk_alloc((size_t)(chunk ? chunk : 1) * fs->block_size);
+	if (!zeros)
 	{
-		char error[100];
-		sprintf(error, "error: invalid inode %d.", inumber);
-		return pemar(error);
+		exit(1);
+	}
+	memset(zeros, 0, (size_t)(chunk ? chunk : 1) * fs->block_size);
+	for (int done = 0; done < count; done += chunk)
+	{
+		disk_writev(fs->disk, first + done, MIN(chunk, count - done), zeros);
 	}
+	free(zeros);
+}
+
+// The slot of inode inumber inside its (already read) inode block.
+struct fs_inode *inode_at(struct fs *fs, union fs_block *b, int inumber)
+{
+	return (struct fs_inode *)(b->data + (inumber % inodes_per_block(fs)) * fs->super.inode_size);
+}
 
-	int BLK = inumber / INODES_PER_BLOCK + 1;
-	int OFF = inumber % INODES_PER_BLOCK;
+// Inline file data starts where the block pointers would be.
+unsigned char *inline_data(struct fs_inode *inode)
+{
+	return (unsigned char *)inode + INLINE_OFFSET;
+}
+
+int inline_capacity(struct fs *fs)
+{
+	return fs->super.inode_size - INLINE_OFFSET;
+}
 
-	union fs_block b;
-	disk_read(thedisk, BLK, b.data);
+// Store the in-memory superblock, which changes after format.
+void write_super(struct fs *fs)
+{
+	if (fs->readonly)
+		return;
+	BLOCK_BUFFER(b);
+	block_read(fs, 0, b->data);
+	b->super = fs->super;
+	disk_write(fs->disk, 0, b->data);
+}
 
-	if (!b.inode[OFF].isvalid)
+// The cache slot holding the refcount block with block b's count, loading
+// it if needed.
+struct map_slot *ref_slot(struct fs *fs, int b)
+{
+	int i = b / REFS_PER_BLOCK;
+	struct map_slot *s = &fs->ref_cache[i % fs->ref_slots];
+	if (s->page != i)
 	{
-		char error[100];
-		sprintf(error, "error: invalid inode %d is already marked invalid.", inumber);
-		return pemar(error);
+		if (s->dirty)
+			disk_write(fs->disk, refcount_block(fs, s->page), s->b->data);
+		block_read(fs, refcount_block(fs, i), s->b->data);
+		s->page = i;
+		s->dirty = 0;
 	}
+	return s;
+}
 
-	for (int i = 0; i < POINTERS_PER_INODE; i++)
+// Block b's reference count; zero when the image keeps none.
+uint32_t refcount_get(struct fs *fs, int b)
+{
+	if (!fs->ref_cache)
+		return 0;
+	return ref_slot(fs, b)->b->refs[b % REFS_PER_BLOCK];
+}
+
+void refcount_set(struct fs *fs, int b, uint32_t count)
+{
+	if (!fs->ref_cache)
+		return;
+	struct map_slot *s = ref_slot(fs, b);
+	s->b->refs[b % REFS_PER_BLOCK] = count;
+	s->dirty = 1;
+}
+
+// Write back the refcount blocks touched since the last flush.
+void refcount_flush(struct fs *fs)
+{
+	for (int i = 0; i < fs->ref_slots; i++)
 	{
-		if (b.inode[OFF].direct[i])
-		{
-			// markfree(b.inode[OFF].direct[i]);
-			freeblock[b.inode[OFF].direct[i]] = 1;
-			b.inode[OFF].direct[i] = 0;
-		}
+		struct map_slot *s = &fs->ref_cache[i];
+		if (!s->dirty)
+			continue;
+		disk_write(fs->disk, refcount_block(fs, s->page), s->b->data);
+		s->dirty = 0;
 	}
+}
 
-	if (b.inode[OFF].indirect)
+// Give the blocks freed by the current operation back to the host. This
+// waits until the inodes and maps that no longer use them are written, so
+// a crash can't leave anything on disk pointing at a hole, and skips any
+// block that was taken again meanwhile.
+void discard_flush(struct fs *fs)
+{
+	for (int i = 0; i < fs->ndiscards; i++)
 	{
-		union fs_block indirect_block;
-		disk_read(thedisk, b.inode[OFF].indirect, indirect_block.data);
-		for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+		int end = fs->discards[i].start + fs->discards[i].count;
+		for (int b = fs->discards[i].start; b < end;)
 		{
-			if (indirect_block.pointers[i])
-			{
-				// markfree(indirect_block.pointers[i]);
-				freeblock[indirect_block.pointers[i]] = 1;
-				indirect_block.pointers[i] = 0;
-			}
+			int n = 0;
+			while (b + n < end && isfree(fs, b + n))
+				n++;
+			disk_discard(fs->disk, b, n);
+			b += n + 1;
 		}
-
-		// markfree(b.inode[OFF].indirect);
-		freeblock[b.inode[OFF].indirect] = 1;
-		b.inode[OFF].indirect = 0;
-		disk_write(thedisk, b.inode[OFF].indirect, indirect_block.data);
 	}
-
-	memset(&b.inode[OFF], 0, sizeof(struct fs_inode));
-	disk_write(thedisk, BLK, b.data);
-	// markfree(BLK);
-	freeblock[BLK] = 1;
-
-	return 1;
+	fs->ndiscards = 0;
 }
 
-int fs_getsize(int inumber)
+// Write back all allocation metadata changed by the current operation.
+void metadata_flush(struct fs *fs)
 {
-	// Return the logical size of the given inode, in bytes. Zero is a valid
-	// logical size for an inode! On failure, return -1
+	refcount_flush(fs);
+	map_flush(fs);
+	log_flush(fs);
+	discard_flush(fs);
+}
 
-	if (!is_mounted)
+// Whether block b, met by a scan, lies in a hole of the image: it reads
+// as zeros, so it need not be read. The cursor keeps the hole and the
+// data run last found, so a scan moving up the disk asks the disk twice
+// per run rather than once per block.
+int block_in_hole(struct fs *fs, struct hole_cursor *c, int b)
+{
+	if (log_pending(fs, b))
+		return 0;
+	if (b < c->from || b >= c->end)
 	{
-		return pemar("error: system is already mounted") - 1;
+		c->from = b;
+		c->data = disk_next_data(fs->disk, b);
+		c->end = c->data < disk_nblocks(fs->disk) ? disk_next_hole(fs->disk, c->data) : c->data;
 	}
+	return b < c->data;
+}
 
-	int BLK = inumber / INODES_PER_BLOCK + 1;
-	int OFF = inumber % INODES_PER_BLOCK;
-
-	union fs_block b;
-
-	disk_read(thedisk, BLK, b.data);
-
-	if (!b.inode[OFF].isvalid)
+static inline uint64_t hash_words(const uint64_t *w, int nwords)
+{
+	// FNV-1a over 64-bit words; collisions are caught by dedup_lookup.
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < nwords; i++)
 	{
-		char error[100];
-		sprintf(error, "error: inode %d is invalid.", inumber);
-		return pemar(error) - 1;
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+		h ^= h >> 29;
 	}
-
-	return b.inode[OFF].size;
+	return h;
 }
 
-int bytes_to_read(union fs_block block, int length, int offset)
+uint64_t block_hash(struct fs *fs, const unsigned char *data)
 {
-	// End Case
-	if (offset < length && length < offset + BLOCK_SIZE)
+	// constant trip counts for the common sizes let the compiler unroll
+	switch (fs->block_size)
 	{
-		return length - offset;
+	case 4096:
+		return hash_words((const uint64_t *)data, 4096 / 8);
+	case 65536:
+		return hash_words((const uint64_t *)data, 65536 / 8);
+	default:
+		return hash_words((const uint64_t *)data, fs->block_size / 8);
 	}
+}
 
-	// Partial and full block cases
-	int BR = BLOCK_SIZE - (offset % BLOCK_SIZE);
+// Drop block b's index entry, if it has one.
+void dedup_remove(struct fs *fs, int b)
+{
+	if (!fs->dedup_index)
+		return;
+	struct dedup_entry *owner = &fs->dedup_owner[b & fs->dedup_mask];
+	if (owner->block != b)
+		return;
+	struct dedup_entry *e = &fs->dedup_index[owner->hash & fs->dedup_mask];
+	if (e->block == b)
+		e->block = 0;
+	owner->block = 0;
+}
 
-	return BR; // return total bytes
+// Index block b under hash, evicting whatever held its two slots.
+void dedup_insert(struct fs *fs, uint64_t hash, int b)
+{
+	if (!fs->dedup_index)
+		return;
+	dedup_remove(fs, b);
+	struct dedup_entry *e = &fs->dedup_index[hash & fs->dedup_mask];
+	if (e->block)
+		dedup_remove(fs, e->block);
+	struct dedup_entry *owner = &fs->dedup_owner[b & fs->dedup_mask];
+	if (owner->block)
+		dedup_remove(fs, owner->block);
+	*e = (struct dedup_entry){hash, b};
+	*owner = (struct dedup_entry){hash, b};
 }
 
-int fs_read(int inumber, unsigned char *data, int length, int offset)
+// The hash block b is indexed under, or zero when it has no entry.
+uint64_t dedup_hash_of(struct fs *fs, int b)
 {
-	/** Read data from a valid inode. Copy length bytes from the inode into the
-  address pointed to by data, starting at offset in the inode. Return the total
-  number of bytes read. The number of bytes actually read could be smaller than
-  the number of bytes requested, perhaps if the end of the inode is reached. If
-  the given inumber is invalid, or any other error is encountered, return 0.
-  **/
+	if (!fs->dedup_index || fs->dedup_owner[b & fs->dedup_mask].block != b)
+		return 0;
+	return fs->dedup_owner[b & fs->dedup_mask].hash;
+}
 
-	// 1. If file system has not been mounted, PEMAR
-	if (!is_mounted)
+// Find an in-use block whose contents equal data, or return 0.
+int dedup_lookup(struct fs *fs, uint64_t hash, const unsigned char *data)
+{
+	if (!fs->dedup_index)
+		return 0;
+	struct dedup_entry *e = &fs->dedup_index[hash & fs->dedup_mask];
+	if (!e->block || e->hash != hash)
+		return 0;
+	int b = e->block;
+	BLOCK_BUFFER(candidate);
+	block_read(fs, b, candidate->data);
+	if (!isfree(fs, b) && !memcmp(candidate->data, data, fs->block_size))
+		return b;
+	return 0;
+}
+
+void dedup_teardown(struct fs *fs)
+{
+	free(fs->dedup_index);
+	free(fs->dedup_owner);
+	for (int i = 0; i < fs->ref_slots; i++)
 	{
-		return pemar("error: system is already mounted");
+		free(fs->ref_cache[i].b);
 	}
+	free(fs->ref_cache);
+	fs->dedup_index = NULL;
+	fs->dedup_owner = NULL;
+	fs->ref_cache = NULL;
+	fs->ref_slots = 0;
+}
 
-	// 2. figure out block number BLK and offset OFF of inode numbered inumber
-	int BLK = inumber / INODES_PER_BLOCK + 1;
-	int OFF = inumber % INODES_PER_BLOCK;
-
-	// 3. read BLK and look at the inode INODE corresponding to index `inumber` (use OFFto get the index)
-	union fs_block block;
-	disk_read(thedisk, BLK, block.data);
-	struct fs_inode inode = block.inode[OFF];
-
-	// 3a. If INODE is not valid, PEMAR
-	if (inode.isvalid == 0)
+// Blocks of log segment s in use, counted from the free map. The free map
+// of the log layout is always resident, so this reads the bits directly.
+int log_count_used(struct fs *fs, int s)
+{
+	int used = 0;
+	int end = segment_first(fs, s + 1);
+	for (int b = segment_first(fs, s); b < end;)
 	{
-		return pemar("error: inode is not valid");
+		int p = map_page_of(fs, b);
+		int first = map_page_first(fs, p);
+		unsigned char *bits = map_bits(fs, map_slot(fs, p)->b);
+		for (int stop = MIN(end, first + map_page_blocks(fs)); b < stop; b++)
+			used += (bits[(b - first) >> 3] >> ((b - first) & 7)) & 1;
 	}
+	return used;
+}
 
-	// 3b. If offset is > file size, PEMAR
-	if (offset > inode.size)
+// Count the blocks in use of every segment, once the mount has built the
+// free map; from then on map_set keeps the counts.
+void log_tally(struct fs *fs)
+{
+	for (int s = 0; s < fs->super.nsegments; s++)
+		fs->log_live[s] = log_count_used(fs, s);
+}
+
+int log_count_clean(struct fs *fs)
+{
+	int clean = 0;
+	for (int s = 0; s < fs->super.nsegments; s++)
+		clean += fs->log_clean[s];
+	return clean;
+}
+
+// Take the first clean segment after the current one to write next. The
+// last LOG_RESERVE are kept for the cleaner, which needs somewhere to copy
+// to. Returns -1 when there is none.
+int log_pick(struct fs *fs)
+{
+	int n = fs->super.nsegments;
+	int clean = 0;
+	int pick = -1;
+	for (int k = 1; k <= n; k++)
 	{
-		// at the end of the file
-		return pemar("error: offset is greater than inode size");
+		int s = (fs->log_segment + k) % n;
+		if (fs->log_clean[s])
+		{
+			clean++;
+			if (pick < 0)
+				pick = s;
+		}
 	}
-
-	// 3c. If offset + length > file size, reduce length to size - offset
-	if (offset + length > inode.size)
+	if (pick < 0 || (clean <= LOG_RESERVE && !fs->log_cleaning))
 	{
-		length = inode.size - offset;
+		return -1;
 	}
+	fs->log_clean[pick] = 0;
+	return pick;
+}
 
-	// 4. Read length bytes from the blocks on disk and copy them to data
-	// 4a Read a whole block
-
-	int changing_blk = offset / BLOCK_SIZE;				   // inode block number
-	int changing_off = offset - changing_blk * BLOCK_SIZE; // offset in the block
-
-	int bytes_read = 0;
-	union fs_block buffer_block;
-
-	while (bytes_read < length)
+// Start writing again after the log filled up, if a segment is free now.
+void log_resume(struct fs *fs)
+{
+	int s = fs->log_full ? log_pick(fs) : -1;
+	if (s >= 0)
 	{
-		int BLK = getfblockindex(&inode, offset + bytes_read);
-		disk_read(thedisk, BLK, buffer_block.data);
-
-		int BTR = bytes_to_read(buffer_block, length, offset + bytes_read);
-		memcpy(data + bytes_read, buffer_block.data + changing_off, BTR);
-		bytes_read += BTR;
+		fs->log_segment = s;
+		fs->log_next = segment_first(fs, s);
+		fs->log_full = 0;
 	}
-
-	return bytes_read;
 }
 
-int allocate_block(int old_file_size, struct fs_inode * INODE, int blocks_to_allocate)
+// Write the open chunk -- its record and the blocks after it -- in one
+// request. A segment with no room left for another chunk is finished here,
+// and the record points into the next one.
+void log_commit(struct fs *fs)
 {
-	// Loop through the direct blocks
-	// If there is a free block, return it
-	// If there is no free block, allocate a new block
-
-	int blocks_allocated = 0;
-	for (int i = 0; i < POINTERS_PER_INODE && blocks_allocated < blocks_to_allocate; i++)
+	if (!fs->log_chunk)
+	{
+		return;
+	}
+	int s = fs->log_segment;
+	int next = fs->log_next;
+	if (segment_first(fs, s + 1) - next < 2)
 	{
-		if (!INODE->direct[i])
+		s = log_pick(fs);
+		next = s < 0 ? 0 : segment_first(fs, s);
+	}
+	int n = fs->log_next - fs->log_chunk;
+	struct log_record *r = (struct log_record *)log_image(fs, fs->log_chunk);
+	r->magic = LOG_MAGIC;
+	r->log_id = fs->super.log_id;
+	r->seq = fs->log_seq++;
+	r->nblocks = n;
+	r->next = next;
+	r->sum = hash_words((const uint64_t *)log_image(fs, fs->log_chunk + 1), ((n - 1) << fs->block_shift) / 8);
+	disk_writev(fs->disk, fs->log_chunk, n, log_image(fs, fs->log_chunk));
+	fs->log_chunk = 0;
+	if (s != fs->log_segment)
+	{
+		fs->log_switched = 1;
+		fs->log_full = s < 0;
+		if (s >= 0)
 		{
-			int new_block = getfreeblock();
-			if (new_block == -1)
-			{
-				break;
-			}
-			INODE->direct[i] = new_block; 	
-			//markused(new_block);
-			freeblock[new_block] = 0;
-			blocks_allocated++;
+			fs->log_segment = s;
+			fs->log_next = next;
 		}
 	}
+}
 
-	if (blocks_allocated < blocks_to_allocate)
+// Make the disk describe the filesystem without the records: write the
+// changed inode map blocks, then point the superblock at the head of the
+// log. Segments holding nothing live become clean, since no record after
+// the checkpoint can refer to them.
+void log_checkpoint(struct fs *fs)
+{
+	log_commit(fs);
+	int per = fs->block_size / sizeof(uint32_t);
+	for (int i = 0; i < fs->super.nimapblocks; i++)
 	{
-		if (INODE->indirect == 0)
+		if (fs->imap_dirty[i])
 		{
-			// allocate a new block in inode
-			int new_block = getfreeblock();
-			if (new_block == -1)
-			{
-				blocks_to_allocate = blocks_allocated;
-			}
-			else
-			{
-				INODE->indirect = new_block;
-				// allocate a new block in free block map
-				//markused(new_block);
-				freeblock[new_block] = 0;
-				union fs_block indirect_block;
-				memset(indirect_block.data, 0, BLOCK_SIZE);
-				disk_write(thedisk, INODE->indirect, indirect_block.data);
-			}
+			disk_write(fs->disk, 1 + i, (unsigned char *)(fs->imap + (size_t)i * per));
+			fs->imap_dirty[i] = 0;
 		}
-
-		union fs_block indirect_block;
-		disk_read(thedisk, INODE->indirect, indirect_block.data);
-
-		// Loop through the indirect blocks
-		for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+	}
+	for (int s = 0; s < fs->super.nsegments; s++)
+	{
+		// 2 marks a segment clean only from now on, to be given back below
+		int clean = (fs->log_full || s != fs->log_segment) && !fs->log_live[s];
+		fs->log_clean[s] = clean && !fs->log_clean[s] ? 2 : clean;
+	}
+	log_resume(fs);
+	fs->super.log_head = fs->log_full ? 0 : fs->log_next;
+	fs->super.log_seq = fs->log_seq;
+	fs->log_switched = 0;
+	write_super(fs);
+	for (int s = 0; s < fs->super.nsegments; s++)
+	{
+		if (fs->log_clean[s] == 2)
 		{
-			if (indirect_block.pointers[i] == 0)
-			{
-				int new_block = getfreeblock();
-
-				// no blocks available
-				if (new_block == -1)
-				{
-					break;
-				}
-				indirect_block.pointers[i] = new_block;
-
-				// allocate a new block in inode
-				//markused(new_block);
-				freeblock[new_block] = 0;
-
-				// increase the number of blocks to allocate
-				blocks_allocated++;
-
-				if (blocks_allocated >= blocks_to_allocate)
-				{
-					break;
-				}
-			}
+			disk_discard(fs->disk, segment_first(fs, s), fs->super.segment_blocks);
+			fs->log_clean[s] = 1;
 		}
-		disk_write(thedisk, INODE->indirect, indirect_block.data);
 	}
-	return blocks_allocated;
 }
 
-int fs_write(int inumber, const unsigned char *data, int length, int offset)
+// End an operation on the log. Its blocks stay in the open chunk, to go
+// out with those of later operations, but a checkpoint is taken here if a
+// segment filled up meanwhile.
+void log_flush(struct fs *fs)
 {
-	// 1.If file system has not been mounted, PEMAR
-	if (!is_mounted)
+	if (fs->imap && fs->log_switched)
 	{
-		return pemar("Error: system is not mounted");
+		log_checkpoint(fs);
 	}
+}
 
-	// 2.Figure out block number BLK and offset OFF of inode numbered inumber
-	int BLK = inumber / INODES_PER_BLOCK + 1;
-	int OFF = inumber % INODES_PER_BLOCK;
-
-	union fs_block block;
-	disk_read(thedisk, BLK, block.data);
-	struct fs_inode INODE = block.inode[OFF];
+// Entries left in the record of the open chunk, shared by inode map
+// updates and block owners.
+int log_room(struct fs *fs)
+{
+	struct log_record *r = (struct log_record *)log_image(fs, fs->log_chunk);
+	return LOG_UPDATES - r->nupdates - (fs->log_next - fs->log_chunk - 1);
+}
 
-	// Read BLK and look at the inode INODE corresponding to index inumber (use OFF to get the index)
-	// If INODE is not valid, PEMAR
-	if (!(INODE.isvalid))
+// Note in the record of the open chunk that block b holds file block
+// offset of inode inumber (see struct log_owner). Blocks already written
+// keep what their record says.
+void log_note(struct fs *fs, int b, uint32_t inumber, uint32_t offset)
+{
+	if (!fs->imap || !log_pending(fs, b))
 	{
-		char error[100];
-		sprintf(error, "Error: inode %d is not valid", inumber);
-		return pemar(error);
+		return;
 	}
+	struct log_owner *end = (struct log_owner *)(log_image(fs, fs->log_chunk) + fs->block_size);
+	end[fs->log_chunk - b] = (struct log_owner){inumber, offset};
+}
 
-	int new_file_size = offset + length;
-	int old_file_size = INODE.size;
-	int new_num_blocks = (new_file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	int old_num_blocks = (old_file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	int blocks_to_allocate = new_num_blocks - old_num_blocks;
-
-	// Allocate new blocks
-	if (blocks_to_allocate)
+// The next block at the head of the log, opening a chunk if none is open.
+// Returns zero when the log is full.
+int log_alloc(struct fs *fs)
+{
+	if (fs->log_chunk && (fs->log_next == segment_first(fs, fs->log_segment + 1) || log_room(fs) < 1))
 	{
-		allocate_block(old_file_size, &INODE, blocks_to_allocate);
+		log_commit(fs);
 	}
-
-	int bytes_written = 0;
-	int remaining_length = length;
-	int current_block = offset / BLOCK_SIZE;
-	int changing_off = offset % BLOCK_SIZE;
-
-	while (bytes_written < length)
+	if (fs->log_full)
 	{
+		return 0;
+	}
+	if (!fs->log_chunk)
+	{
+		fs->log_chunk = fs->log_next++;
+		memset(log_image(fs, fs->log_chunk), 0, fs->block_size);
+	}
+	int b = fs->log_next++;
+	markused(fs, b);
+	return b;
+}
 
-		int BTW = MIN(BLOCK_SIZE - changing_off, remaining_length);
-		union fs_block buffer_block;
-		int useBLK = getfblockindex(&INODE, current_block);
+// Block b (zero for none) is about to be rewritten. In the log layout the
+// new contents go to the head of the log and b is freed, unless b is still
+// in the open chunk, where it is simply rewritten. Returns the block to
+// write: b itself in the other layouts, or when the log is full.
+int log_move(struct fs *fs, int b)
+{
+	if (!fs->imap || log_pending(fs, b))
+	{
+		return b;
+	}
+	int to = log_alloc(fs);
+	if (!to)
+	{
+		return b;
+	}
+	if (b)
+	{
+		markfree(fs, b);
+	}
+	return to;
+}
 
-		if (BTW != BLOCK_SIZE)
+// Write block i of the inode table. In the log layout the block moves to
+// the head of the log, and the record of the chunk it joins notes the
+// inode map change.
+void write_itable(struct fs *fs, int i, union fs_block *b)
+{
+	int to = inode_table_block(fs, i);
+	if (fs->imap)
+	{
+		// room for the block's owner and the map update
+		if (fs->log_chunk && log_room(fs) < 2 && !log_pending(fs, to))
 		{
-			disk_read(thedisk, useBLK, buffer_block.data);
+			log_commit(fs);
 		}
+		to = log_move(fs, to);
+		if (!to)
+		{
+			pemar("error: the log is full");
+			return;
+		}
+		log_note(fs, to, LOG_ITABLE, i);
+		if (to != fs->imap[i])
+		{
+			struct log_record *r = (struct log_record *)log_image(fs, fs->log_chunk);
+			r->updates[r->nupdates].index = i;
+			r->updates[r->nupdates++].block = to;
+			fs->imap[i] = to;
+			fs->imap_dirty[i / (fs->block_size / sizeof(uint32_t))] = 1;
+		}
+	}
+	block_write(fs, to, b->data);
+}
 
-		// Write to buffer block
-		memcpy(buffer_block.data + changing_off, data + bytes_written, BTW);
-
-		// Write buffer block to disk
-		disk_write(thedisk, useBLK, buffer_block.data);
+// Write the inode table block holding inode inumber.
+void write_inode_block(struct fs *fs, int inumber, union fs_block *b)
+{
+	write_itable(fs, inumber / inodes_per_block(fs), b);
+}
 
-		bytes_written += BTW;
-		remaining_length -= BTW;
-		current_block++;
-		changing_off = 0;
+// Load the inode map of a log layout and bring it up to date by replaying
+// the records written since the last checkpoint, stopping at the first
+// that is missing or torn. The head of the log is where replay stopped.
+int log_mount(struct fs *fs)
+{
+	struct fs_superblock *sb = &fs->super;
+	int per = fs->block_size / sizeof(uint32_t);
+	int64_t end = sb->log_start + (int64_t)sb->nsegments * sb->segment_blocks;
+	if (sb->segment_blocks < 4 || (int64_t)sb->segment_blocks * fs->block_size > 64 * LOG_SEGMENT_BYTES ||
+		sb->log_start != 1 + sb->nimapblocks || (int64_t)sb->nimapblocks * per < sb->ninodeblocks ||
+		sb->nsegments <= LOG_LOW || end > sb->nblocks || (sb->log_head && (sb->log_head < sb->log_start || sb->log_head >= end)))
+	{
+		return pemar("error: the log layout is corrupt");
 	}
-
-	if (INODE.size < new_file_size)
+	fs->imap = disk_alloc((size_t)sb->nimapblocks * fs->block_size);
+	fs->imap_dirty = calloc(sb->nimapblocks, 1);
+	fs->log_buffer = disk_alloc((size_t)sb->segment_blocks * fs->block_size);
+	fs->log_clean = calloc(sb->nsegments, 1);
+	fs->log_victim = calloc(sb->nsegments, 1);
+	fs->log_live = calloc(sb->nsegments, sizeof(uint32_t));
+	if (!fs->imap || !fs->imap_dirty || !fs->log_buffer || !fs->log_clean || !fs->log_victim || !fs->log_live)
 	{
-		INODE.size = new_file_size;
-		disk_write(thedisk, BLK, block.data);
+		exit(1);
 	}
+	disk_readv(fs->disk, 1, sb->nimapblocks, (unsigned char *)fs->imap);
+	fs->log_chunk = 0;
+	fs->log_cleaning = 0;
 
-	return bytes_written;
-}
\ No newline at end of file
+	int head = sb->log_head;
+	uint32_t seq = sb->log_seq;
+	BLOCK_BUFFER(b);
+	struct log_record *r = &b->log;
+	while (head)
+	{
+		int room = segment_first(fs, (head - sb->log_start) / sb->segment_blocks + 1) - head;
+		disk_read(fs->disk, head, b->data);
+		if (r->magic != LOG_MAGIC || r->log_id != sb->log_id || r->seq != seq || r->nblocks < 1 || r->nblocks > room ||
+			r->nupdates > LOG_UPDATES || (r->next && (r->next < sb->log_start || r->next >= end ||
+													  (r->next - sb->log_start) % sb->segment_blocks > sb->segment_blocks - 2)))
+		{
+			break;
+		}
+		if (r->nblocks > 1)
+		{
+			// the record may have reached the disk without the blocks after it
+			disk_readv(fs->disk, head + 1, r->nblocks - 1, fs->log_buffer);
+			if (hash_words((const uint64_t *)fs->log_buffer, ((r->nblocks - 1) << fs->block_shift) / 8) != r->sum)
+				break;
+		}
+		for (int k = 0; k < r->nupdates; k++)
+		{
+			if (r->updates[k].index < sb->ninodeblocks)
+			{
+				fs->imap[r->updates[k].index] = r->updates[k].block;
+				fs->imap_dirty[r->updates[k].index / per] = 1;
+			}
+		}
+		seq++;
+		head = r->next;
+	}
+	fs->log_seq = seq;
+	fs->log_full = !head;
+	fs->log_segment = head ? (head - sb->log_start) / sb->segment_blocks : 0;
+	fs->log_next = head;
+	// the caller checkpoints once the free map is built
+	fs->log_switched = 1;
+	return 1;
+}
+
+// Forget the log state of the mounted filesystem.
+void log_teardown(struct fs *fs)
+{
+	free(fs->imap);
+	free(fs->imap_dirty);
+	free(fs->log_buffer);
+	free(fs->log_clean);
+	free(fs->log_victim);
+	free(fs->log_live);
+	fs->imap = NULL;
+	fs->imap_dirty = NULL;
+	fs->log_buffer = NULL;
+	fs->log_clean = NULL;
+	fs->log_victim = NULL;
+	fs->log_live = NULL;
+	fs->log_chunk = 0;
+}
+
+// The superblock sits at the start of block 0 whatever the block size, so
+// it is read as a minimum-size block before the real size is known.
+void read_super(struct fs *fs, struct fs_superblock *sb)
+{
+	unsigned char raw[MIN_BLOCK_SIZE] __attribute__((aligned(DISK_ALIGN)));
+	disk_set_block_size(fs->disk, MIN_BLOCK_SIZE);
+	block_read(fs, 0, raw);
+	memcpy(sb, raw, sizeof(*sb));
+}
+
+int fs_format_r(struct fs *fs, int flags, int size)
+{
+	/**
+	Creates a new filesystem on the disk, destroying any data already present.
+	Sets aside ten percent of the blocks for inodes, clears the inode table, and
+	writes the superblock and the free map. Returns one on success, zero otherwise. Formatting a
+	filesystem does not cause it to be mounted. Also, an attempt to format an
+	already-mounted disk should do nothing and return failure.
+	With FS_FORMAT_DEDUP, a table of per-block reference counts is placed after
+	the inode table so that identical blocks can be shared between files.
+	FS_FORMAT_SNAPSHOTS keeps the same table so snapshots can share blocks.
+	FS_FORMAT_GROUPS splits the disk into block groups (see struct fs_group).
+	FS_FORMAT_LOG makes the layout log-structured (see struct log_record); it
+	cannot be combined with the other three.
+	size is the block size in bytes (zero for the default 4K); the disk is
+	re-divided into blocks of that size.
+	The inode table is not written here: the superblock records how much of
+	it is still uninitialized, so formatting takes the same time on any disk.
+	On a sparse disk the whole image is given back to the host first.
+	**/
+	if (fs->is_mounted)
+	{
+		return pemar("error: system is already mounted");
+	}
+	if ((flags & FS_FORMAT_LOG) && (flags & (FS_FORMAT_DEDUP | FS_FORMAT_SNAPSHOTS | FS_FORMAT_GROUPS)))
+	{
+		return pemar("error: the log layout cannot be combined with dedup, snapshots or groups");
+	}
+
+	// records left by an earlier log format must never replay into this one
+	struct fs_superblock old;
+	read_super(fs, &old);
+
+	if (!set_block_size(fs, size ? size : MIN_BLOCK_SIZE))
+	{
+		return 0;
+	}
+	// a sparse disk gives back everything the old filesystem stored
+	disk_discard(fs->disk, 1, disk_nblocks(fs->disk) - 1);
+
+	int n = disk_nblocks(fs->disk) / 10;
+	if ((disk_nblocks(fs->disk) % 10) != 0)
+	{
+		n++;
+	}
+
+	int inode_size = (flags & FS_FORMAT_WIDE_INODES) ? WIDE_INODE_SIZE : sizeof(struct fs_inode);
+	// inumbers are ints
+	int n_inodes_blocks = MIN(n, INT_MAX / (fs->block_size / inode_size));
+
+	BLOCK_BUFFER(b);
+	memset(b->data, 0, fs->block_size);
+	b->super.magic = FS_MAGIC;
+	b->super.nblocks = disk_nblocks(fs->disk);
+	b->super.nblocks64 = disk_nblocks(fs->disk);
+	b->super.ninodeblocks = n_inodes_blocks;
+	b->super.inode_size = inode_size;
+	b->super.ninodes = n_inodes_blocks * (fs->block_size / b->super.inode_size);
+	b->super.flags = flags;
+	b->super.nrefblocks = (flags & (FS_FORMAT_DEDUP | FS_FORMAT_SNAPSHOTS)) ? refblocks_for(fs, b->super.nblocks) : 0;
+	b->super.block_size = fs->block_size;
+	b->super.itable_uninit = n_inodes_blocks;
+
+	if (flags & FS_FORMAT_GROUPS)
+	{
+		// aim for eight or more groups, but not tiny ones
+		int avail = b->super.nblocks - 1 - b->super.nrefblocks;
+		int bpg = MIN(GROUP_MAX_BLOCKS, MAX((avail + 7) / 8, 64));
+		int ipg = (bpg + 9) / 10;
+		int ngroups = avail / bpg + (avail % bpg > 1 + ipg);
+		if ((int64_t)ngroups * ipg * (fs->block_size / inode_size) > INT_MAX)
+		{
+			ipg = INT_MAX / (fs->block_size / inode_size) / ngroups;
+		}
+		b->super.blocks_per_group = bpg;
+		b->super.itable_per_group = ipg;
+		b->super.ninodeblocks = ngroups * ipg;
+		b->super.ninodes = b->super.ninodeblocks * (fs->block_size / b->super.inode_size);
+		b->super.itable_uninit = 0;
+		if (!ngroups)
+		{
+			return pemar("error: disk is too small for the requested format");
+		}
+	}
+
+	else if (flags & FS_FORMAT_LOG)
+	{
+		// the inode table has no place of its own: its blocks live in the
+		// log and the inode map finds them
+		struct fs_superblock *sb = &b->super;
+		sb->itable_uninit = 0;
+		sb->nimapblocks = ((int64_t)sb->ninodeblocks * sizeof(uint32_t) + fs->block_size - 1) / fs->block_size;
+		sb->segment_blocks = MAX(4, LOG_SEGMENT_BYTES / fs->block_size);
+		sb->log_start = 1 + sb->nimapblocks;
+		sb->nsegments = sb->nblocks > sb->log_start ? (sb->nblocks - sb->log_start) / sb->segment_blocks : 0;
+		sb->log_head = sb->log_start;
+		sb->log_seq = 1;
+		sb->log_id = MAX((uint32_t)time(NULL), old.magic == FS_MAGIC ? old.log_id + 1 : 0);
+		if (sb->nsegments <= LOG_LOW)
+		{
+			return pemar("error: disk is too small for the requested format");
+		}
+	}
+
+	else
+	{
+		b->super.nmapblocks = (b->super.nblocks + 8 * fs->block_size - 1) / (8 * fs->block_size);
+	}
+
+	if (!(flags & FS_FORMAT_LOG) && 1 + b->super.ninodeblocks + b->super.nrefblocks + b->super.nmapblocks >= b->super.nblocks)
+	{
+		return pemar("error: disk is too small for the requested format");
+	}
+
+	// the inode table is zeroed lazily (see fs_create); refcounts must start at zero
+	fs->super = b->super;
+	disk_write(fs->disk, 0, b->data);
+	zero_blocks(fs, refcount_block(fs, 0), fs->super.nrefblocks);
+	zero_blocks(fs, 1, fs->super.nimapblocks);
+
+	for (int g = 0; g < group_count(fs); g++)
+	{
+		// every group starts with only its own header and inode table in use
+		memset(b->data, 0, fs->block_size);
+		b->group.free_inodes = fs->super.itable_per_group * inodes_per_block(fs) - (g == 0);
+		for (int j = 0; j < fs->super.blocks_per_group; j++)
+		{
+			if (j < group_meta(fs) || group_start(fs, g) + j >= fs->super.nblocks)
+				b->group.bitmap[j / 8] |= 1 << (j % 8);
+		}
+		disk_write(fs->disk, group_start(fs, g), b->data);
+	}
+
+	for (int p = 0; p < fs->super.nmapblocks; p++)
+	{
+		// the flat layout's free map: metadata and blocks past the end are in use
+		memset(b->data, 0, fs->block_size);
+		int first = p * 8 * fs->block_size;
+		for (int j = 0; j < 8 * fs->block_size; j++)
+		{
+			if (first + j < first_data_block(fs) || first + j >= fs->super.nblocks)
+				b->data[j >> 3] |= 1 << (j & 7);
+		}
+		disk_write(fs->disk, map_page_block(fs, p), b->data);
+	}
+
+	// we allocated just the superblock
+	return 1;
+}
+
+void fs_debug_r(struct fs *fs)
+{
+	/**
+	Scan a mounted filesystem and report on how the inodes and blocks are organized.
+	**/
+	BLOCK_BUFFER(block);
+
+	block_read(fs, 0, block->data);
+
+	printf("superblock:\n");
+	printf("    %d blocks\n", block->super.nblocks);
+	printf("    %d inode blocks\n", block->super.ninodeblocks);
+	printf("    %d inodes\n", block->super.ninodes);
+	if (block->super.flags & FS_FORMAT_DEDUP)
+	{
+		printf("    dedup enabled (%d refcount blocks)\n", block->super.nrefblocks);
+	}
+	if (block->super.flags & FS_FORMAT_SNAPSHOTS)
+	{
+		int count = 0;
+		for (int i = 0; i < FS_MAX_SNAPSHOTS; i++)
+			count += block->super.snapshots[i].id != 0;
+		printf("    snapshots enabled (%d taken)\n", count);
+	}
+	if (fs->view_table)
+	{
+		printf("    viewing a read-only snapshot\n");
+	}
+	if (fs->shared)
+	{
+		printf("    mounted read-only from a shared segment\n");
+	}
+	if (block->super.flags & FS_FORMAT_LOG)
+	{
+		printf("    log-structured: %d segments of %d blocks", block->super.nsegments, block->super.segment_blocks);
+		if (fs->imap && fs->log_clean)
+			printf(", %d clean, head at %d", log_count_clean(fs), fs->log_full ? 0 : fs->log_next);
+		printf("\n");
+	}
+
+	if (fs->block_size != MIN_BLOCK_SIZE)
+	{
+		printf("    %d byte blocks\n", fs->block_size);
+	}
+	if (block->super.inode_size > sizeof(struct fs_inode))
+	{
+		printf("    %d byte inodes\n", block->super.inode_size);
+	}
+
+	int uninit = block->super.itable_uninit;
+	if (block->super.blocks_per_group)
+	{
+		printf("    %d block groups of %d blocks\n", group_count(fs), block->super.blocks_per_group);
+		for (int g = 0; g < group_count(fs) && fs->groups; g++)
+			uninit += fs->super.itable_per_group - fs->groups[g].itable_init;
+	}
+	if (uninit)
+	{
+		printf("    %d inode blocks not yet initialized\n", uninit);
+	}
+
+	int inode_blocks = block->super.ninodeblocks;
+	int inode_size = block->super.inode_size ? block->super.inode_size : sizeof(struct fs_inode);
+	int per_block = fs->block_size / inode_size;
+
+	struct hole_cursor holes = {0, 0, 0};
+	for (int i = 0; i < inode_blocks; i++)
+	{
+		// printf("\n\nRound %d\n\n", i+1);
+		if (block_in_hole(fs, &holes, inode_table_block(fs, i)))
+			continue;
+		read_itable(fs, i, block);
+		for (int j = 0; j < per_block; j++)
+		{
+			struct fs_inode *inode = (struct fs_inode *)(block->data + j * inode_size);
+			if (inode->isvalid)
+			{
+				char ctime_str[30];
+				time_t ctime = inode->ctime;
+				struct tm *ctime_tm = localtime(&ctime);
+				strftime(ctime_str, sizeof(ctime_str), "%a %b %d %H:%M:%S %Y", ctime_tm);
+
+				printf("inode %d:\n", i * per_block + j);
+				printf("    valid: YES\n");
+				printf("    size: %d bytes\n", inode->size);
+				printf("    created: %s\n", ctime_str);
+				if (inode->flags & INODE_INLINE)
+				{
+					printf("    inline data\n");
+					continue;
+				}
+				printf("    direct blocks:");
+				for (int k = 0; k < POINTERS_PER_INODE; k++)
+				{
+					if (inode->direct[k])
+					{
+						printf(" %d%s", BLOCK_NUMBER(inode->direct[k]), inode->direct[k] & BLOCK_UNWRITTEN ? "u" : "");
+					}
+				}
+				printf("\n");
+				if (inode->indirect)
+				{
+					BLOCK_BUFFER(ib);
+					printf("    indirect block: %d\n", inode->indirect);
+					printf("    indirect data blocks:");
+					block_read(fs, inode->indirect, ib->data);
+					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+					{
+						if (ib->pointers[k])
+						{
+							printf(" %d%s", BLOCK_NUMBER(ib->pointers[k]), ib->pointers[k] & BLOCK_UNWRITTEN ? "u" : "");
+						}
+					}
+					printf("\n");
+				}
+			}
+		}
+	}
+
+	printf("\n");
+	printf("\n");
+
+	return;
+}
+
+#define STAT_RUN_BYTES (1 << 20)
+
+// Whether an inode's record passes filter.
+int stat_match(const struct fs_stat_filter *filter, const struct fs_stat *st)
+{
+	return st->size >= filter->min_size && (!filter->max_size || st->size <= filter->max_size) &&
+		   st->ctime >= filter->min_ctime && (!filter->max_ctime || st->ctime < filter->max_ctime) &&
+		   (st->flags & filter->flags) == filter->flags;
+}
+
+int fs_stat_all_r(struct fs *fs, int *next, const struct fs_stat_filter *filter, struct fs_stat *records, int max)
+{
+	/**
+	List inode metadata in bulk. Fill records with up to max entries, one
+	for each valid inode from *next on that passes filter (null passes
+	them all), and move *next past the last inode looked at; start with
+	*next at zero and call again until it returns zero. Records come
+	straight from the inode table, read in runs of contiguous blocks, so
+	ask for many at a time; no indirect block is read and nothing is
+	formatted. Returns how many records were filled, or -1 on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+	if (!next || *next < 0 || !records || max < 1)
+	{
+		return pemar("error: invalid stat request") - 1;
+	}
+
+	int per_block = inodes_per_block(fs);
+	int nrun = MAX(1, STAT_RUN_BYTES / fs->block_size);
+	unsigned char *run = disk_alloc((size_t)nrun * fs->block_size);
+	if (!run)
+	{
+		exit(1);
+	}
+
+	// run holds inode table blocks first .. first + count - 1
+	int first = 0, count = 0, n = 0;
+	struct hole_cursor holes = {0, 0, 0};
+	while (n < max && *next < fs->super.ninodes)
+	{
+		int i = *next / per_block;
+		if (i < first || i >= first + count)
+		{
+			// read only the blocks the records still wanted can need, plus
+			// the partial first one; when the filter turns records away and
+			// the run has to be refilled, the next run is twice as long
+			int want = MIN(nrun, MAX((max - n + per_block - 1) / per_block + 1, 2 * count));
+			int b = inode_table_block(fs, i);
+			first = i;
+			count = 0;
+			while (count < want && i + count < fs->super.ninodeblocks &&
+				   (fs->view_table || itable_initialized(fs, i + count)) &&
+				   inode_table_block(fs, i + count) == b + count && !block_in_hole(fs, &holes, b + count))
+				count++;
+			if (!count)
+			{
+				// never written, so it holds no inodes
+				*next = (i + 1) * per_block;
+				continue;
+			}
+			block_readv(fs, b, count, run);
+		}
+
+		int inumber = (*next)++;
+		struct fs_inode *inode = (struct fs_inode *)(run + ((size_t)(i - first) << fs->block_shift) +
+													  (inumber % per_block) * fs->super.inode_size);
+		if (!inode->isvalid)
+			continue;
+		struct fs_stat *st = &records[n];
+		st->inumber = inumber;
+		st->size = inode->size;
+		st->ctime = inode->ctime;
+		st->flags = (inode->flags & (INODE_DIR | INODE_DIRDATA) ? FS_STAT_DIR : 0) | (inode->flags & INODE_INLINE ? FS_STAT_INLINE : 0);
+		st->blocks = inode->flags & INODE_INLINE ? 0 : (int)((inode->size + fs->block_size - 1) / fs->block_size) + (inode->indirect != 0);
+		if (!filter || stat_match(filter, st))
+			n++;
+	}
+	free(run);
+	return n;
+}
+
+// Enter data block b, found by the mount scan, into the dedup index.
+void mount_hash(struct fs *fs, int b)
+{
+	if (!fs->dedup_index)
+		return;
+	BLOCK_BUFFER(data);
+	if (block_in_hole(fs, &fs->mount_holes, b))
+		memset(data->data, 0, fs->block_size);
+	else
+		block_read(fs, b, data->data);
+	dedup_insert(fs, block_hash(fs, data->data), b);
+}
+
+// Account for one more reference to data or indirect block b found during the mount scan.
+int mount_claim(struct fs *fs, int b, int data)
+{
+	if (!is_data_block(fs, b))
+	{
+		fprintf(stderr, "error: block %d referenced by an inode is out of range\n", b);
+		return 0;
+	}
+	markused(fs, b);
+	if (data)
+		mount_hash(fs, b);
+	return 1;
+}
+
+// Claim every data block an indirect block points to. The pointers are
+// packed to the front of ib along the way.
+int mount_claim_indirect(struct fs *fs, union fs_block *ib)
+{
+	int *list = ib->pointers;
+	int n = simd.nonzero(list, POINTERS_PER_BLOCK, list);
+	for (int k = 0; k < n; k++)
+	{
+		// unwritten blocks hold nothing for the dedup index; bad pointers
+		// are caught below
+		if ((unsigned)list[k] < (unsigned)fs->super.nblocks)
+			mount_hash(fs, list[k]);
+		list[k] = BLOCK_NUMBER(list[k]);
+	}
+	int bad = simd.out_of_range(list, n, first_data_block(fs), fs->super.nblocks);
+	for (int k = 0; k < n && bad < 0 && fs->super.blocks_per_group; k++)
+	{
+		// group headers and inode tables sit between the data areas
+		if (!is_data_block(fs, list[k]))
+			bad = k;
+	}
+	if (bad >= 0)
+	{
+		fprintf(stderr, "error: block %d referenced by an inode is out of range\n", list[bad]);
+		return 0;
+	}
+	map_set_used(fs, list, n);
+	return 1;
+}
+
+void fs_unmount_r(struct fs *fs)
+{
+	/**
+	Forget the mounted filesystem and release the memory kept for it.
+	Everything is already on disk, so there is nothing to write, except
+	that the log layout writes what it holds and takes a checkpoint, so the
+	next mount replays nothing. A shared mount only detaches from its
+	segment.
+	**/
+	if (fs->shared)
+	{
+		shared_detach(fs);
+	}
+	if (fs->imap && fs->is_mounted)
+	{
+		log_checkpoint(fs);
+	}
+	log_teardown(fs);
+	dedup_teardown(fs);
+	free(fs->discards);
+	fs->discards = NULL;
+	fs->ndiscards = 0;
+	fs->discard_cap = 0;
+	free(fs->view_table);
+	fs->view_table = NULL;
+	fs->readonly = 0;
+	fs->is_mounted = 0;
+	free(fs->groups);
+	fs->groups = NULL;
+	for (int i = 0; i < fs->map_slots; i++)
+	{
+		free(fs->map_cache[i].b);
+	}
+	free(fs->map_cache);
+	free(fs->map_free);
+	fs->map_cache = NULL;
+	fs->map_free = NULL;
+	fs->map_slots = 0;
+	fs->map_npages = 0;
+}
+
+int fs_mount_r(struct fs *fs)
+{
+	/**
+	Examine the disk for a filesystem. If one is present, read the superblock,
+	build a free block bitmap, and prepare the filesystem for use. Return one on success, zero otherwise.
+	A successful mount is a pre-requisite for the remaining calls.
+	In dedup mode the reference counts are loaded and every data block is
+	hashed into the in-memory dedup index. Mounting drops any snapshot view.
+	Images with the free map on disk read it from there instead. Holes in
+	the image are skipped without being read.
+	**/
+	if (fs->is_mounted)
+	{
+		// finish with the mounted filesystem while the disk has its block size
+		fs_unmount_r(fs);
+	}
+	struct fs_superblock sb;
+	read_super(fs, &sb);
+
+	if (sb.magic != FS_MAGIC)
+	{
+		return pemar("error: superblock does not match the MAGIC number.");
+	}
+	if (sb.ninodes == 0 || sb.nblocks == 0)
+	{
+		// pemar
+		return pemar("error: the filesystem has no blocks");
+	}
+	if (!set_block_size(fs, sb.block_size ? sb.block_size : MIN_BLOCK_SIZE))
+	{
+		return 0;
+	}
+	if (sb.nblocks64)
+	{
+		if (sb.nblocks64 > INT_MAX)
+		{
+			return pemar("error: the filesystem has more blocks than 32-bit block pointers can reach");
+		}
+		sb.nblocks = sb.nblocks64;
+	}
+	if (sb.nblocks > disk_nblocks(fs->disk))
+	{
+		return pemar("error: the filesystem is larger than the disk");
+	}
+	if (sb.itable_uninit > sb.ninodeblocks)
+	{
+		return pemar("error: the inode table watermark is corrupt");
+	}
+	if (sb.blocks_per_group && (sb.blocks_per_group > GROUP_MAX_BLOCKS || !sb.itable_per_group ||
+								sb.ninodeblocks % sb.itable_per_group || 1 + sb.itable_per_group >= sb.blocks_per_group))
+	{
+		return pemar("error: the block group layout is corrupt");
+	}
+
+	fs->super = sb;
+	fs->super.block_size = fs->block_size;
+	if (!fs->super.inode_size)
+	{
+		fs->super.inode_size = sizeof(struct fs_inode);
+	}
+	fs_unmount_r(fs);
+	if ((fs->super.flags & FS_FORMAT_LOG) && !log_mount(fs))
+	{
+		return 0;
+	}
+
+	 // build free block bitmap
+	fs->map_npages = fs->super.blocks_per_group ? group_count(fs) : (fs->super.nblocks + map_page_blocks(fs) - 1) / map_page_blocks(fs);
+	fs->map_resident = !fs->super.blocks_per_group && !fs->super.nmapblocks;
+	fs->map_slots = fs->map_resident ? fs->map_npages : MIN(fs->map_npages, MAP_CACHE);
+	fs->map_cache = calloc(fs->map_slots, sizeof(struct map_slot));
+	fs->map_free = calloc(fs->map_npages, sizeof(uint32_t));
+	fs->groups = calloc(group_count(fs) + 1, sizeof(struct group_info));
+	if (!fs->map_cache || !fs->map_free || !fs->groups)
+	{
+		exit(1);
+	}
+	for (int i = 0; i < fs->map_slots; i++)
+	{
+		fs->map_cache[i].page = -1;
+		fs->map_cache[i].b = disk_alloc(fs->block_size);
+		if (!fs->map_cache[i].b)
+		{
+			exit(1);
+		}
+	}
+
+	for (int p = 0; p < fs->map_npages; p++)
+	{
+		int first = map_page_first(fs, p);
+		int n = MIN(map_page_blocks(fs), fs->super.nblocks - first);
+		if (fs->map_resident)
+		{
+			// no map on disk: data blocks start out free and the scan below claims them
+			struct map_slot *slot = &fs->map_cache[p];
+			slot->page = p;
+			memset(slot->b->data, 0xff, fs->block_size);
+			for (int j = 0; j < n; j++)
+			{
+				if (is_data_block(fs, first + j))
+				{
+					slot->b->data[j >> 3] &= ~(1 << (j & 7));
+					fs->map_free[p]++;
+				}
+			}
+			continue;
+		}
+		// the bitmaps on disk say which data blocks are in use
+		struct map_slot *slot = map_slot(fs, p);
+		unsigned char *bits = map_bits(fs, slot->b);
+		if (fs->super.blocks_per_group)
+		{
+			fs->groups[p].itable_init = MIN(slot->b->group.itable_init, fs->super.itable_per_group);
+			fs->groups[p].free_inodes = slot->b->group.free_inodes;
+		}
+		fs->map_free[p] = n;
+		for (int j = 0; j < n / 8; j++)
+		{
+			fs->map_free[p] -= __builtin_popcount(bits[j]);
+		}
+		for (int j = n & ~7; j < n; j++)
+		{
+			fs->map_free[p] -= (bits[j >> 3] >> (j & 7)) & 1;
+		}
+	}
+
+	if (fs->super.nrefblocks)
+	{
+		fs->ref_slots = MIN(fs->super.nrefblocks, REF_CACHE);
+		fs->ref_cache = calloc(fs->ref_slots, sizeof(struct map_slot));
+		if (!fs->ref_cache)
+		{
+			exit(1);
+		}
+		for (int i = 0; i < fs->ref_slots; i++)
+		{
+			// read straight from the disk, so it must be aligned
+			fs->ref_cache[i].page = -1;
+			fs->ref_cache[i].b = disk_alloc(fs->block_size);
+			if (!fs->ref_cache[i].b)
+			{
+				exit(1);
+			}
+		}
+		// an on-disk free map already holds the blocks only snapshots still
+		// use; a resident one is rebuilt, and finds them through their counts
+		for (int i = first_data_block(fs); i < fs->super.nblocks && fs->map_resident; i++)
+		{
+			if (refcount_get(fs, i))
+				markused(fs, i);
+		}
+	}
+	if (fs->super.flags & FS_FORMAT_DEDUP)
+	{
+		// small images need no more slots than they have blocks
+		uint32_t size = 1;
+		while (size < fs->super.nblocks && size < DEDUP_INDEX)
+			size <<= 1;
+		fs->dedup_index = calloc(size, sizeof(struct dedup_entry));
+		fs->dedup_owner = calloc(size, sizeof(struct dedup_entry));
+		if (!fs->dedup_index || !fs->dedup_owner)
+		{
+			exit(1);
+		}
+		fs->dedup_mask = size - 1;
+		fs->mount_holes = (struct hole_cursor){0, 0, 0};
+	}
+
+	// scan through filesystem and mark what is in use; with the free map on
+	// disk that is only needed when the dedup index wants the data blocks.
+	// Inode table blocks in holes of the image hold no inodes.
+	int scan = fs->map_resident || fs->dedup_index;
+	struct hole_cursor holes = {0, 0, 0};
+
+	for (int i = 0; i < fs->super.ninodeblocks && scan; i++)
+	{
+		/* code */
+		if (!itable_initialized(fs, i))
+			continue;
+		if (fs->imap && !mount_claim(fs, fs->imap[i], 0))
+			return 0;
+		if (block_in_hole(fs, &holes, inode_table_block(fs, i)))
+			continue;
+		BLOCK_BUFFER(b);
+		block_read(fs, inode_table_block(fs, i), b->data);
+		// iterate through each inode in the block
+		for (int j = 0; j < inodes_per_block(fs); j++)
+		{
+			struct fs_inode *inode = (struct fs_inode *)(b->data + j * fs->super.inode_size);
+			if (!inode->isvalid || (inode->flags & INODE_INLINE))
+			{
+				continue;
+			}
+
+			for (int k = 0; k < POINTERS_PER_INODE; k++)
+			{
+				if (inode->direct[k])
+				{
+					if (!mount_claim(fs, BLOCK_NUMBER(inode->direct[k]), !(inode->direct[k] & BLOCK_UNWRITTEN)))
+						return 0;
+				}
+			}
+			if (inode->indirect != 0)
+			{
+				// iterate through all the indirect
+				BLOCK_BUFFER(indirect_block);
+				if (!mount_claim(fs, inode->indirect, 0))
+					return 0;
+				block_read(fs, inode->indirect, indirect_block->data);
+				if (!mount_claim_indirect(fs, indirect_block))
+					return 0;
+			}
+		}
+	}
+
+	// store any group bitmap the scan corrected
+	map_flush(fs);
+	if (fs->imap)
+	{
+		log_tally(fs);
+		log_checkpoint(fs);
+	}
+
+	fs->is_mounted = 1 == 1;
+
+	return 1;
+}
+
+int fs_zero_inodes_r(struct fs *fs, int count)
+{
+	/**
+	Zero up to count more blocks of the inode table past the watermark, so a
+	caller with idle time can finish what fs_format skipped in bounded steps.
+	fs_create zeroes blocks itself as it needs them, so this is optional.
+	Returns the number of blocks still uninitialized, or -1 on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only") - 1;
+	}
+	if (fs->super.blocks_per_group)
+	{
+		int left = 0;
+		for (int g = 0; g < group_count(fs); g++)
+		{
+			int n = MIN(MAX(count, 0), (int)(fs->super.itable_per_group - fs->groups[g].itable_init));
+			if (n)
+			{
+				zero_blocks(fs, inode_table_block(fs, g * fs->super.itable_per_group + fs->groups[g].itable_init), n);
+				fs->groups[g].itable_init += n;
+				map_touch(fs, g);
+				count -= n;
+			}
+			left += fs->super.itable_per_group - fs->groups[g].itable_init;
+		}
+		map_flush(fs);
+		return left;
+	}
+	count = MIN(MAX(count, 0), (int)fs->super.itable_uninit);
+	if (count)
+	{
+		zero_blocks(fs, itable_watermark(fs) + 1, count);
+		fs->super.itable_uninit -= count;
+		write_super(fs);
+	}
+	return fs->super.itable_uninit;
+}
+
+// The builder writes file data in runs of this many bytes.
+#define BUILD_RUN_BYTES (8 << 20)
+
+// Blocks a built file of size bytes takes: its data, plus an indirect
+// block when the direct pointers are not enough. Files that fit in the
+// inode slot take none.
+int64_t build_blocks(struct fs *fs, int size)
+{
+	if (size <= inline_capacity(fs))
+		return 0;
+	int n = (size + fs->block_size - 1) / fs->block_size;
+	return n + (n > POINTERS_PER_INODE);
+}
+
+int fs_max_file_size(int block_size)
+{
+	/**
+	Return the largest file, in bytes, that the direct and single indirect
+	pointers reach with blocks of block_size bytes, or of the default size
+	when block_size is zero.
+	**/
+	int64_t size = block_size ? block_size : MIN_BLOCK_SIZE;
+	return MIN((POINTERS_PER_INODE + size / (int64_t)sizeof(uint32_t)) * size, INT_MAX);
+}
+
+int fs_build_r(struct fs *fs, int flags, int block_size, int nfiles, const int *sizes, fs_fill fill, void *arg)
+{
+	/**
+	Format the disk and fill it with nfiles files in one pass, for building
+	images offline. File i gets inumber i + 1 and sizes[i] bytes, which
+	fill(i, data, length, offset, arg) supplies from offset 0 up, file after
+	file, returning how many bytes it gave. The layout is worked out in
+	memory: each file's indirect block and data blocks follow one another
+	from the start of the data area, so the data goes out in large
+	sequential writes, and the inode table goes out last in one request.
+	Only the flat layout can be built; dedup and snapshot images start with
+	every block counted once. The filesystem is left unmounted. Returns one
+	on success, zero otherwise.
+	**/
+	if (flags & (FS_FORMAT_GROUPS | FS_FORMAT_LOG))
+	{
+		return pemar("error: only the flat layout can be built offline");
+	}
+	if (nfiles < 0)
+	{
+		return pemar("error: invalid build request");
+	}
+	if (!fs_format_r(fs, flags, block_size) || !fs_mount_r(fs))
+	{
+		return 0;
+	}
+
+	int max_file_size = fs_max_file_size(fs->block_size);
+	int64_t total = 0;
+	for (int i = 0; i < nfiles; i++)
+	{
+		if (sizes[i] < 0 || sizes[i] > max_file_size)
+		{
+			fs_unmount_r(fs);
+			char error[100];
+			sprintf(error, "error: file %d is larger than the filesystem allows", i);
+			return pemar(error);
+		}
+		total += build_blocks(fs, sizes[i]);
+	}
+	if (nfiles >= fs->super.ninodes || first_data_block(fs) + total > fs->super.nblocks)
+	{
+		fs_unmount_r(fs);
+		return pemar("error: the files do not fit on the disk");
+	}
+
+	// inodes 0 to nfiles, and a run buffer holding blocks start to start + used
+	int nitable = (nfiles + inodes_per_block(fs)) / inodes_per_block(fs);
+	int nrun = MAX(1, BUILD_RUN_BYTES / fs->block_size);
+	unsigned char *itable = disk_alloc((size_t)nitable * fs->block_size);
+	unsigned char *run = disk_alloc((size_t)nrun * fs->block_size);
+	if (!itable || !run)
+	{
+		exit(1);
+	}
+	memset(itable, 0, (size_t)nitable * fs->block_size);
+	int start = first_data_block(fs);
+	int used = 0;
+	int64_t ctime = time(NULL);
+
+	int ok = 1;
+	for (int i = 0; i < nfiles && ok; i++)
+	{
+		struct fs_inode *inode = (struct fs_inode *)(itable + (size_t)(i + 1) * fs->super.inode_size);
+		inode->isvalid = 1;
+		inode->ctime = ctime;
+		inode->size = sizes[i];
+		if (!build_blocks(fs, sizes[i]))
+		{
+			if (sizes[i])
+			{
+				inode->flags = INODE_INLINE;
+				ok = fill(i, inline_data(inode), sizes[i], 0, arg) == sizes[i];
+			}
+			continue;
+		}
+
+		int n = (sizes[i] + fs->block_size - 1) / fs->block_size;
+		if (n > POINTERS_PER_INODE)
+		{
+			if (used == nrun)
+			{
+				disk_writev(fs->disk, start, used, run);
+				start += used;
+				used = 0;
+			}
+			// the data follows its indirect block
+			uint32_t *pointers = (uint32_t *)(run + (size_t)used * fs->block_size);
+			memset(pointers, 0, fs->block_size);
+			inode->indirect = start + used;
+			for (int k = POINTERS_PER_INODE; k < n; k++)
+			{
+				pointers[k - POINTERS_PER_INODE] = inode->indirect + 1 + k;
+			}
+			used++;
+		}
+		for (int k = 0; k < MIN(n, POINTERS_PER_INODE); k++)
+		{
+			inode->direct[k] = start + used + k;
+		}
+
+		for (int offset = 0; offset < sizes[i] && ok;)
+		{
+			if (used == nrun)
+			{
+				disk_writev(fs->disk, start, used, run);
+				start += used;
+				used = 0;
+			}
+			unsigned char *data = run + (size_t)used * fs->block_size;
+			int length = MIN(sizes[i] - offset, (nrun - used) * fs->block_size);
+			int nblocks = (length + fs->block_size - 1) / fs->block_size;
+			ok = fill(i, data, length, offset, arg) == length;
+			// the tail of the last block reads as zeros
+			memset(data + length, 0, (size_t)nblocks * fs->block_size - length);
+			used += nblocks;
+			offset += length;
+		}
+	}
+
+	if (ok)
+	{
+		disk_writev(fs->disk, start, used, run);
+		disk_writev(fs->disk, inode_table_block(fs, 0), nitable, itable);
+		for (int b = first_data_block(fs); b < start + used; b++)
+		{
+			markused(fs, b);
+			refcount_set(fs, b, 1);
+		}
+		fs->super.itable_uninit -= nitable;
+		write_super(fs);
+		metadata_flush(fs);
+	}
+	free(itable);
+	free(run);
+	fs_unmount_r(fs);
+	return ok ? 1 : pemar("error: a file gave fewer bytes than its size");
+}
+
+// Grouped layout: take a free inode in the group with the most free data
+// blocks, so the file's data can stay next to it. The inode table block
+// holding it is left in b and its disk block in *blk. Returns the inumber,
+// or zero when no group has a free inode.
+int group_pick_inode(struct fs *fs, union fs_block *b, int *blk)
+{
+	int ipb = inodes_per_block(fs);
+	while (1)
+	{
+		int best = -1;
+		for (int g = 0; g < group_count(fs); g++)
+		{
+			if (fs->groups[g].free_inodes && (best < 0 || fs->map_free[g] > fs->map_free[best]))
+				best = g;
+		}
+		if (best < 0)
+		{
+			return 0;
+		}
+		struct group_info *gi = &fs->groups[best];
+		map_touch(fs, best);
+		for (int k = 0; k < gi->itable_init; k++)
+		{
+			int i = best * fs->super.itable_per_group + k;
+			*blk = inode_table_block(fs, i);
+			block_read(fs, *blk, b->data);
+			for (int inumber = MAX(1, i * ipb); inumber < (i + 1) * ipb; inumber++)
+			{
+				if (!inode_at(fs, b, inumber)->isvalid)
+				{
+					gi->free_inodes--;
+					return inumber;
+				}
+			}
+		}
+		if (gi->itable_init < fs->super.itable_per_group)
+		{
+			// every initialized inode of the group is taken: zero the next table block
+			int i = best * fs->super.itable_per_group + gi->itable_init++;
+			*blk = inode_table_block(fs, i);
+			memset(b->data, 0, fs->block_size);
+			gi->free_inodes--;
+			return MAX(1, i * ipb);
+		}
+		// the counter was wrong; correct it and look elsewhere
+		gi->free_inodes = 0;
+	}
+}
+
+int fs_create_r(struct fs *fs)
+{
+	// Create a new inode of zero length. On success, return the (positive)
+	// inumber. On failure, return zero.
+
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only");
+	}
+	log_reserve(fs);
+
+	int NIN = MIN(fs->super.ninodes, itable_watermark(fs) * inodes_per_block(fs));
+	int BLK = 1;
+	int INODEI = 0;
+
+	BLOCK_BUFFER(b);
+	if (fs->super.blocks_per_group)
+	{
+		INODEI = group_pick_inode(fs, b, &BLK);
+		NIN = 0;
+	}
+	else
+	{
+		read_itable(fs, BLK - 1, b);
+	}
+
+	// inode 0 is reserved so that zero can mean failure
+	for (int i = 1; i < NIN; i++)
+	{
+		/* code */
+
+		if (i % inodes_per_block(fs) == 0)
+		{
+			BLK += 1;
+			read_itable(fs, BLK - 1, b);
+		}
+
+		if (inode_at(fs, b, i)->isvalid == 0)
+		{
+			INODEI = i;
+			break;
+		}
+		// iterate through each inode in the block
+	}
+
+	int grow = 0;
+	if (!INODEI && fs->super.itable_uninit)
+	{
+		// every initialized inode is taken: zero the next table block
+		BLK = itable_watermark(fs) + 1;
+		INODEI = MAX(1, (BLK - 1) * inodes_per_block(fs));
+		memset(b->data, 0, fs->block_size);
+		grow = 1;
+	}
+
+	if (!INODEI)
+	{
+		return pemar("error: system is full and can't create more inodes.");
+	}
+
+	struct fs_inode *inode = inode_at(fs, b, INODEI);
+	memset(inode, 0, fs->super.inode_size);
+	inode->isvalid = 1;
+
+	// set ctime
+	inode->ctime = time(NULL);
+
+	write_inode_block(fs, INODEI, b);
+	if (grow)
+	{
+		fs->super.itable_uninit--;
+		write_super(fs);
+	}
+	metadata_flush(fs);
+
+	return INODEI;
+}
+
+// Drop one reference to block b and return it to the free map when none remain.
+void release_block(struct fs *fs, int b)
+{
+	if (refcount_get(fs, b) > 1)
+	{
+		refcount_set(fs, b, refcount_get(fs, b) - 1);
+		return;
+	}
+	refcount_set(fs, b, 0);
+	dedup_remove(fs, b);
+	markfree(fs, b);
+}
+
+// Add one reference to each block inode points to: its direct blocks and
+// its indirect block. The blocks under the indirect block are left alone;
+// see retain_children.
+void retain_tree(struct fs *fs, struct fs_inode *inode)
+{
+	// inline files own no blocks; the pointer bytes hold their data
+	if (!inode->isvalid || (inode->flags & INODE_INLINE))
+		return;
+	for (int i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		int b = BLOCK_NUMBER(inode->direct[i]);
+		if (b)
+			refcount_set(fs, b, refcount_get(fs, b) + 1);
+	}
+	if (inode->indirect)
+		refcount_set(fs, inode->indirect, refcount_get(fs, inode->indirect) + 1);
+}
+
+// A shared indirect block is being copied for one of the inodes using it,
+// and ib holds the copy: every block it points to gains the copy as a
+// second parent.
+void retain_children(struct fs *fs, union fs_block *ib)
+{
+	for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+	{
+		int b = BLOCK_NUMBER(ib->pointers[i]);
+		if (b)
+			refcount_set(fs, b, refcount_get(fs, b) + 1);
+	}
+}
+
+// Drop inode's references: one to each direct block and to the indirect
+// block, and, when that was the indirect block's last one, one to each block
+// under it.
+void release_tree(struct fs *fs, struct fs_inode *inode)
+{
+	if (!inode->isvalid || (inode->flags & INODE_INLINE))
+		return;
+	for (int i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		if (inode->direct[i])
+			release_block(fs, BLOCK_NUMBER(inode->direct[i]));
+	}
+	if (inode->indirect && refcount_get(fs, inode->indirect) > 1)
+	{
+		release_block(fs, inode->indirect);
+	}
+	else if (inode->indirect)
+	{
+		BLOCK_BUFFER(ib);
+		block_read(fs, inode->indirect, ib->data);
+		int n = simd.nonzero(ib->pointers, POINTERS_PER_BLOCK, ib->pointers);
+		for (int i = 0; i < n; i++)
+		{
+			release_block(fs, BLOCK_NUMBER(ib->pointers[i]));
+		}
+		release_block(fs, inode->indirect);
+	}
+}
+
+int fs_delete_r(struct fs *fs, int inumber)
+{
+	// Delete the inode indicated by the inumber. Release all data and indirect
+	// blocks assigned to this inode and return them to the free block map. On
+	// success, return one. On failure, return 0.
+
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only");
+	}
+
+	if (inumber < 1 || inumber >= fs->super.ninodes)
+	{
+		char error[100];
+		sprintf(error, "error: invalid inode %d.", inumber);
+		return pemar(error);
+	}
+
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, inumber, b);
+	struct fs_inode *inode = inode_at(fs, b, inumber);
+
+	if (!inode->isvalid)
+	{
+		char error[100];
+		sprintf(error, "error: invalid inode %d is already marked invalid.", inumber);
+		return pemar(error);
+	}
+
+	if (inode->flags & INODE_DIR)
+	{
+		BLOCK_BUFFER(head);
+		getfblock(fs, inode, head->data, 0, NULL);
+		if (head->dir.nentries)
+		{
+			char error[100];
+			sprintf(error, "error: directory %d is not empty.", inumber);
+			return pemar(error);
+		}
+		if (inumber == fs->super.rootdir)
+		{
+			fs->super.rootdir = 0;
+			write_super(fs);
+		}
+		// a large directory's map inode and extents go with it
+		if (head->dir.magic == DIR_MAGIC)
+		{
+			if (head->dir.map_file)
+				fs_delete_r(fs, head->dir.map_file);
+			for (uint32_t i = 0; i < head->dir.nextents && i < DIR_EXTENTS; i++)
+				fs_delete_r(fs, head->dir.extents[i]);
+			// they may share this inode's table block
+			read_inode_block(fs, inumber, b);
+			inode = inode_at(fs, b, inumber);
+		}
+	}
+
+	release_tree(fs, inode);
+	memset(inode, 0, fs->super.inode_size);
+	if (fs->super.blocks_per_group)
+	{
+		int g = inumber / inodes_per_block(fs) / fs->super.itable_per_group;
+		fs->groups[g].free_inodes++;
+		map_touch(fs, g);
+	}
+	write_inode_block(fs, inumber, b);
+	metadata_flush(fs);
+
+	return 1;
+}
+
+int fs_getsize_r(struct fs *fs, int inumber)
+{
+	// Return the logical size of the given inode, in bytes. Zero is a valid
+	// logical size for an inode! On failure, return -1
+
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+
+	if (inumber < 1 || inumber >= fs->super.ninodes)
+	{
+		char error[100];
+		sprintf(error, "error: invalid inode %d.", inumber);
+		return pemar(error) - 1;
+	}
+
+	BLOCK_BUFFER(b);
+
+	read_inode_block(fs, inumber, b);
+	struct fs_inode *inode = inode_at(fs, b, inumber);
+
+	if (!inode->isvalid)
+	{
+		char error[100];
+		sprintf(error, "error: inode %d is invalid.", inumber);
+		return pemar(error) - 1;
+	}
+
+	return inode->size;
+}
+
+int bytes_to_read(struct fs *fs, int length, int offset)
+{
+	// length is the end of the request and offset the current position, both
+	// in bytes from the start of the file.
+
+	// End Case
+	if (offset < length && length < offset + fs->block_size)
+	{
+		return MIN(length - offset, fs->block_size - (offset & (fs->block_size - 1)));
+	}
+
+	// Partial and full block cases
+	int BR = fs->block_size - (offset & (fs->block_size - 1));
+
+	return BR; // return total bytes
+}
+
+int fs_read_r(struct fs *fs, int inumber, unsigned char *data, int length, int offset)
+{
+	/** Read data from a valid inode-> Copy length bytes from the inode into the
+  address pointed to by data, starting at offset in the inode-> Return the total
+  number of bytes read. The number of bytes actually read could be smaller than
+  the number of bytes requested, perhaps if the end of the inode is reached. If
+  the given inumber is invalid, or any other error is encountered, return 0.
+  **/
+
+	// 1. If file system has not been mounted, PEMAR
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+
+	if (inumber < 1 || inumber >= fs->super.ninodes || offset < 0 || length < 0)
+	{
+		return pemar("error: invalid read request");
+	}
+
+	// 2. read the inode table block holding inode inumber and look at the
+	// inode INODE corresponding to index `inumber`
+	BLOCK_BUFFER(block);
+	read_inode_block(fs, inumber, block);
+	struct fs_inode *inode = inode_at(fs, block, inumber);
+
+	// 3a. If INODE is not valid, PEMAR
+	if (inode->isvalid == 0)
+	{
+		return pemar("error: inode is not valid");
+	}
+
+	// 3b. If offset is > file size, PEMAR
+	if (offset > inode->size)
+	{
+		// at the end of the file
+		return pemar("error: offset is greater than inode size");
+	}
+
+	// 3c. If offset + length > file size, reduce length to size - offset
+	if (offset + length > inode->size)
+	{
+		length = inode->size - offset;
+	}
+
+	// Small files are served straight from the inode block we already have
+	if (inode->flags & INODE_INLINE)
+	{
+		memcpy(data, inline_data(inode) + offset, length);
+		return length;
+	}
+
+	// 4. Read length bytes from the blocks on disk and copy them to data.
+	// Whole blocks go straight into data, as many disk-contiguous ones per
+	// request as possible; only the partial blocks at either end are staged.
+
+	int bytes_read = 0;
+	BLOCK_BUFFER(buffer_block);
+	BLOCK_BUFFER(ib);
+	int ib_loaded = 0;
+
+	while (bytes_read < length)
+	{
+		int changing_blk = (offset + bytes_read) >> fs->block_shift;	   // inode block number
+		int changing_off = (offset + bytes_read) & (fs->block_size - 1); // offset in the block
+		int BTR = bytes_to_read(fs, offset + length, offset + bytes_read);
+		int dblk = fblock_cached(fs, inode, ib, &ib_loaded, changing_blk);
+
+		if (BTR == fs->block_size)
+		{
+			// 4a. a run of whole blocks, or of holes
+			int run = 1;
+			while (bytes_read + (run + 1) * fs->block_size <= length)
+			{
+				int next = fblock_cached(fs, inode, ib, &ib_loaded, changing_blk + run);
+				if (dblk ? next != dblk + run : next != 0)
+					break;
+				run++;
+			}
+			if (dblk)
+				block_readv(fs, dblk, run, data + bytes_read);
+			else
+				memset(data + bytes_read, 0, (size_t)run * fs->block_size);
+			bytes_read += run * fs->block_size;
+			continue;
+		}
+
+		// 4b. part of a block
+		if (dblk)
+			block_read(fs, dblk, buffer_block->data);
+		else
+			memset(buffer_block->data, 0, fs->block_size);
+		memcpy(data + bytes_read, buffer_block->data + changing_off, BTR);
+		bytes_read += BTR;
+	}
+
+	return bytes_read;
+}
+
+int allocate_block(struct fs *fs)
+{
+	// Take the lowest free block for a new data or indirect block, or the
+	// next one at the head of the log in the log layout.
+	// Returns the block number, or zero when the disk is full.
+
+	if (fs->imap)
+	{
+		return log_alloc(fs);
+	}
+	int new_block = getfreeblock(fs);
+	if (new_block == -1)
+	{
+		return 0;
+	}
+	markused(fs, new_block);
+	refcount_set(fs, new_block, 1);
+	return new_block;
+}
+
+// Store one block of file data that currently lives in disk block old (zero
+// if the file block is a hole). Returns the disk block now holding the data,
+// which differs from old when the block was shared, deduplicated or newly
+// allocated. Returns zero when the disk is full.
+int place_block(struct fs *fs, int old, const unsigned char *data, int full)
+{
+	uint64_t hash = 0;
+
+	if (fs->dedup_index && full)
+	{
+		hash = block_hash(fs, data);
+		int match = dedup_lookup(fs, hash, data);
+		if (match && match == old)
+		{
+			return old;
+		}
+		if (match)
+		{
+			refcount_set(fs, match, refcount_get(fs, match) + 1);
+			if (old)
+			{
+				release_block(fs, old);
+			}
+			return match;
+		}
+	}
+
+	int target = old;
+	if (!old || refcount_get(fs, old) > 1 || (fs->imap && !log_pending(fs, old)))
+	{
+		// copy-on-write: other files still see the old contents, or the
+		// log layout never writes over a block in place
+		target = allocate_block(fs);
+		if (!target)
+		{
+			return 0;
+		}
+		if (old)
+		{
+			release_block(fs, old);
+		}
+	}
+
+	block_write(fs, target, data);
+	if (fs->dedup_index)
+	{
+		if (full)
+			dedup_insert(fs, hash, target);
+		else
+			dedup_remove(fs, target);
+	}
+	return target;
+}
+
+// Move the contents of inline file inumber into a data block. inode is the
+// caller's working copy of the inode in slot. Returns zero when the disk
+// is full.
+int inline_to_block(struct fs *fs, int inumber, struct fs_inode *inode, struct fs_inode *slot)
+{
+	BLOCK_BUFFER(first);
+	memset(first->data, 0, fs->block_size);
+	memcpy(first->data, inline_data(slot), inode->size);
+	inode->flags &= ~INODE_INLINE;
+	memset(inode->direct, 0, sizeof(inode->direct));
+	inode->indirect = 0;
+	if (inode->size)
+	{
+		inode->direct[0] = place_block(fs, 0, first->data, 0);
+		if (!inode->direct[0])
+			return 0;
+		log_note(fs, inode->direct[0], inumber, 0);
+	}
+	return 1;
+}
+
+int fs_write_r(struct fs *fs, int inumber, const unsigned char *data, int length, int offset)
+{
+	// 1.If file system has not been mounted, PEMAR
+	if (!fs->is_mounted)
+	{
+		return pemar("Error: system is not mounted");
+	}
+	if (fs->readonly)
+	{
+		return pemar("Error: the filesystem is mounted read-only");
+	}
+
+	if (inumber < 1 || inumber >= fs->super.ninodes || offset < 0 || length < 0)
+	{
+		return pemar("Error: invalid write request");
+	}
+	log_reserve(fs);
+
+	// new blocks go in the inode's group when there is one
+	fs->alloc_goal = 0;
+	if (fs->super.blocks_per_group)
+	{
+		fs->alloc_goal = group_start(fs, inumber / inodes_per_block(fs) / fs->super.itable_per_group) + group_meta(fs);
+	}
+
+	BLOCK_BUFFER(block);
+	read_inode_block(fs, inumber, block);
+	struct fs_inode *slot = inode_at(fs, block, inumber);
+	struct fs_inode INODE = *slot;
+
+	// Read BLK and look at the inode INODE corresponding to index inumber
+	// If INODE is not valid, PEMAR
+	if (!(INODE.isvalid))
+	{
+		char error[100];
+		sprintf(error, "Error: inode %d is not valid", inumber);
+		return pemar(error);
+	}
+
+	// clamp to the largest file the direct and indirect pointers can describe
+	int max_file_size = MIN((int64_t)(POINTERS_PER_INODE + POINTERS_PER_BLOCK) * fs->block_size, INT_MAX);
+	if (offset >= max_file_size)
+	{
+		return 0;
+	}
+	length = MIN(length, max_file_size - offset);
+
+	// Files that still fit in the inode slot never get a data block
+	int has_blocks = INODE.direct[0] || INODE.direct[1] || INODE.direct[2] || INODE.indirect;
+	if (offset + length <= inline_capacity(fs) &&
+		((INODE.flags & INODE_INLINE) || (INODE.size == 0 && !has_blocks)))
+	{
+		if (!(INODE.flags & INODE_INLINE))
+		{
+			memset(inline_data(slot), 0, inline_capacity(fs));
+			slot->flags |= INODE_INLINE;
+		}
+		memcpy(inline_data(slot) + offset, data, length);
+		if (slot->size < offset + length)
+		{
+			slot->size = offset + length;
+		}
+		write_inode_block(fs, inumber, block);
+		metadata_flush(fs);
+		return length;
+	}
+
+	// The file outgrew its slot: move the inline bytes to a data block
+	if ((INODE.flags & INODE_INLINE) && !inline_to_block(fs, inumber, &INODE, slot))
+	{
+		return 0;
+	}
+
+	int bytes_written = 0;
+	int remaining_length = length;
+	int current_block = offset >> fs->block_shift;
+	int changing_off = offset & (fs->block_size - 1);
+
+	BLOCK_BUFFER(indirect_block);
+	int indirect_loaded = 0;
+	int indirect_dirty = 0;
+
+	while (bytes_written < length)
+	{
+
+		int BTW = MIN(fs->block_size - changing_off, remaining_length);
+		BLOCK_BUFFER(buffer_block);
+		const unsigned char *src = data + bytes_written;
+		uint32_t pointer;
+
+		if (current_block < POINTERS_PER_INODE)
+		{
+			pointer = INODE.direct[current_block];
+		}
+		else
+		{
+			if (!indirect_loaded)
+			{
+				if (INODE.indirect)
+				{
+					block_read(fs, INODE.indirect, indirect_block->data);
+				}
+				else
+				{
+					memset(indirect_block->data, 0, fs->block_size);
+				}
+				indirect_loaded = 1;
+				if (INODE.indirect && refcount_get(fs, INODE.indirect) > 1)
+				{
+					// a snapshot shares the indirect block: this file gets its own copy
+					int copy = allocate_block(fs);
+					if (!copy)
+					{
+						break;
+					}
+					retain_children(fs, indirect_block);
+					release_block(fs, INODE.indirect);
+					INODE.indirect = copy;
+					indirect_dirty = 1;
+				}
+			}
+			pointer = indirect_block->pointers[current_block - POINTERS_PER_INODE];
+		}
+		// a reserved block is written in place, its old contents unread
+		int old = BLOCK_NUMBER(pointer);
+		int unwritten = pointer & BLOCK_UNWRITTEN;
+
+		if (BTW != fs->block_size)
+		{
+			// Bytes past the end of the file are always zero on disk, so the
+			// old block is only read when some of the file's bytes survive.
+			int64_t live = MAX(0, MIN((int64_t)INODE.size - ((int64_t)current_block << fs->block_shift), fs->block_size));
+			if (old && !unwritten && live && !(changing_off == 0 && live <= BTW))
+			{
+				block_read(fs, old, buffer_block->data);
+			}
+			else
+			{
+				memset(buffer_block->data, 0, fs->block_size);
+			}
+
+			// Write to buffer block
+			memcpy(buffer_block->data + changing_off, data + bytes_written, BTW);
+			src = buffer_block->data;
+		}
+
+		if (current_block >= POINTERS_PER_INODE && !INODE.indirect)
+		{
+			INODE.indirect = allocate_block(fs);
+			if (!INODE.indirect)
+			{
+				break;
+			}
+			indirect_dirty = 1;
+		}
+
+		// Write buffer block to disk
+		int useBLK = place_block(fs, old, src, changing_off + BTW == fs->block_size);
+		if (!useBLK)
+		{
+			break;
+		}
+		log_note(fs, useBLK, inumber, current_block);
+
+		if (useBLK != old || unwritten)
+		{
+			if (current_block < POINTERS_PER_INODE)
+			{
+				INODE.direct[current_block] = useBLK;
+			}
+			else
+			{
+				indirect_block->pointers[current_block - POINTERS_PER_INODE] = useBLK;
+				indirect_dirty = 1;
+			}
+		}
+
+		bytes_written += BTW;
+		remaining_length -= BTW;
+		current_block++;
+		changing_off = 0;
+	}
+
+	if (indirect_dirty)
+	{
+		INODE.indirect = log_move(fs, INODE.indirect);
+		log_note(fs, INODE.indirect, inumber, LOG_INDIRECT);
+		block_write(fs, INODE.indirect, indirect_block->data);
+	}
+
+	// a write that stored nothing leaves the size alone, as the inline path does
+	if (bytes_written > 0 && INODE.size < offset + bytes_written)
+	{
+		INODE.size = offset + bytes_written;
+	}
+	if (memcmp(&INODE, slot, sizeof(INODE)))
+	{
+		// clearing the whole slot also drops bytes left over from inline data
+		memset(slot, 0, fs->super.inode_size);
+		*slot = INODE;
+		write_inode_block(fs, inumber, block);
+	}
+	metadata_flush(fs);
+
+	return bytes_written;
+}
+
+// Blocks free in the whole free map.
+int count_free_blocks(struct fs *fs)
+{
+	int n = 0;
+	for (int p = 0; p < fs->map_npages; p++)
+	{
+		n += fs->map_free[p];
+	}
+	return n;
+}
+
+// The next block of a reservation: block *k of the run at start, or the
+// lowest free block when no run was found (start < 0).
+int reserve_block(struct fs *fs, int start, int *k)
+{
+	if (start < 0)
+		return allocate_block(fs);
+	int b = start + (*k)++;
+	markused(fs, b);
+	refcount_set(fs, b, 1);
+	return b;
+}
+
+int fs_fallocate_r(struct fs *fs, int inumber, int offset, int length)
+{
+	/**
+	Reserve disk blocks for bytes offset to offset + length of the file, so
+	that writes there later need no allocation. Every hole in the range gets
+	a block, all from one contiguous run when the disk has one, marked
+	unwritten: it reads as zeros until a write fills it. Blocks the file
+	already has are left alone. The file grows to cover the range.
+	The log layout writes every block to a new place, so nothing can be
+	reserved ahead; there only the size changes.
+	Return one on success, zero otherwise.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only");
+	}
+	int max_file_size = MIN((int64_t)(POINTERS_PER_INODE + POINTERS_PER_BLOCK) * fs->block_size, INT_MAX);
+	if (inumber < 1 || inumber >= fs->super.ninodes || offset < 0 || length < 0 ||
+		(int64_t)offset + length > max_file_size)
+	{
+		return pemar("error: invalid fallocate request");
+	}
+
+	BLOCK_BUFFER(block);
+	read_inode_block(fs, inumber, block);
+	struct fs_inode *slot = inode_at(fs, block, inumber);
+	struct fs_inode INODE = *slot;
+	if (!INODE.isvalid)
+	{
+		return pemar("error: inode is not valid");
+	}
+	if (length == 0)
+	{
+		return 1;
+	}
+	int end = offset + length;
+
+	fs->alloc_goal = 0;
+	if (fs->super.blocks_per_group)
+	{
+		fs->alloc_goal = group_start(fs, inumber / inodes_per_block(fs) / fs->super.itable_per_group) + group_meta(fs);
+	}
+	if ((INODE.flags & INODE_INLINE) && end > inline_capacity(fs) && !inline_to_block(fs, inumber, &INODE, slot))
+	{
+		return pemar("error: no free blocks");
+	}
+
+	BLOCK_BUFFER(ib);
+	int indirect_dirty = 0;
+	if (!(INODE.flags & INODE_INLINE) && !fs->imap)
+	{
+		int first = offset >> fs->block_shift;
+		int last = (end - 1) >> fs->block_shift;
+		int use_indirect = last >= POINTERS_PER_INODE;
+		if (INODE.indirect)
+			block_read(fs, INODE.indirect, ib->data);
+		else
+			memset(ib->data, 0, fs->block_size);
+
+		// count the blocks first, so one search finds room for all of them;
+		// a new indirect block, or a private copy of a shared one, is one
+		int new_indirect = use_indirect && (!INODE.indirect || refcount_get(fs, INODE.indirect) > 1);
+		int need = new_indirect;
+		for (int i = first; i <= last; i++)
+		{
+			need += !(i < POINTERS_PER_INODE ? INODE.direct[i] : ib->pointers[i - POINTERS_PER_INODE]);
+		}
+		if (need > count_free_blocks(fs))
+		{
+			return pemar("error: not enough free blocks");
+		}
+		int start = need ? find_free_run(fs, need) : -1;
+		int k = 0;
+
+		// hand out the run in the order of file_layout: direct blocks, the
+		// indirect block, then the blocks it points to
+		for (int i = first; i <= last && i < POINTERS_PER_INODE; i++)
+		{
+			if (!INODE.direct[i])
+				INODE.direct[i] = reserve_block(fs, start, &k) | BLOCK_UNWRITTEN;
+		}
+		if (new_indirect)
+		{
+			if (INODE.indirect)
+			{
+				retain_children(fs, ib);
+				release_block(fs, INODE.indirect);
+			}
+			INODE.indirect = reserve_block(fs, start, &k);
+			indirect_dirty = 1;
+		}
+		for (int i = MAX(first, POINTERS_PER_INODE); i <= last; i++)
+		{
+			if (!ib->pointers[i - POINTERS_PER_INODE])
+			{
+				ib->pointers[i - POINTERS_PER_INODE] = reserve_block(fs, start, &k) | BLOCK_UNWRITTEN;
+				indirect_dirty = 1;
+			}
+		}
+	}
+
+	if (indirect_dirty)
+	{
+		block_write(fs, INODE.indirect, ib->data);
+	}
+	if (INODE.size < end)
+	{
+		INODE.size = end;
+	}
+	if ((INODE.flags & INODE_INLINE) && slot->size < end)
+	{
+		// bytes past the end of an inline file are already zero
+		slot->size = end;
+		write_inode_block(fs, inumber, block);
+	}
+	else if (memcmp(&INODE, slot, sizeof(INODE)))
+	{
+		memset(slot, 0, fs->super.inode_size);
+		*slot = INODE;
+		write_inode_block(fs, inumber, block);
+	}
+	metadata_flush(fs);
+	return 1;
+}
+
+int fs_seek_r(struct fs *fs, int inumber, int offset, int whence)
+{
+	/**
+	Find where the next data (FS_SEEK_DATA) or the next hole (FS_SEEK_HOLE)
+	of a file starts, at or after offset, so sparse files can be copied
+	without reading their holes. A hole is a block that was never written:
+	one the file has no block for, one reserved by fs_fallocate, or one in
+	a hole of the image. Offsets found are block-aligned, except that none
+	is below offset. Returns the offset, the file size when there is no
+	more data or hole before the end, or -1 on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+	if (inumber < 1 || inumber >= fs->super.ninodes || offset < 0 ||
+		(whence != FS_SEEK_DATA && whence != FS_SEEK_HOLE))
+	{
+		return pemar("error: invalid seek request") - 1;
+	}
+
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, inumber, b);
+	struct fs_inode inode = *inode_at(fs, b, inumber);
+	if (!inode.isvalid)
+	{
+		char error[100];
+		sprintf(error, "error: inode %d is invalid.", inumber);
+		return pemar(error) - 1;
+	}
+	if (offset >= inode.size || (inode.flags & INODE_INLINE))
+	{
+		return whence == FS_SEEK_DATA ? MIN(offset, (int)inode.size) : (int)inode.size;
+	}
+
+	BLOCK_BUFFER(ib);
+	int loaded = 0;
+	struct hole_cursor holes = {0, 0, 0};
+	int nblocks = (inode.size + fs->block_size - 1) / fs->block_size;
+	for (int k = offset / fs->block_size; k < nblocks; k++)
+	{
+		int d = fblock_cached(fs, &inode, ib, &loaded, k);
+		int hole = !d || block_in_hole(fs, &holes, d);
+		if (hole == (whence == FS_SEEK_HOLE))
+		{
+			return MAX(offset, k * fs->block_size);
+		}
+	}
+	return inode.size;
+}
+
+// List the blocks of inode's tree in the order a sequential write lays them
+// out: direct blocks, the indirect block, then the blocks it points to.
+// ib holds the indirect block. Returns how many were stored in list.
+int file_layout(struct fs *fs, const struct fs_inode *inode, const union fs_block *ib, int *list)
+{
+	int n = 0;
+	for (int i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		if (inode->direct[i])
+			list[n++] = BLOCK_NUMBER(inode->direct[i]);
+	}
+	if (inode->indirect)
+	{
+		list[n++] = inode->indirect;
+		for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+		{
+			if (ib->pointers[i])
+				list[n++] = BLOCK_NUMBER(ib->pointers[i]);
+		}
+	}
+	return n;
+}
+
+// Number of contiguous runs in a block list.
+int count_runs(const int *list, int n)
+{
+	int runs = n > 0;
+	for (int i = 1; i < n; i++)
+	{
+		runs += list[i] != list[i - 1] + 1;
+	}
+	return runs;
+}
+
+// First block of the lowest run of n free blocks, or -1. Free map pages
+// cover consecutive blocks, so a run may carry over from one to the next.
+int find_free_run(struct fs *fs, int n)
+{
+	int start = -1;
+	for (int p = MAX(map_page_of(fs, first_data_block(fs)), 0); p < fs->map_npages; p++)
+	{
+		int first = map_page_first(fs, p);
+		int end = MIN(map_page_blocks(fs), fs->super.nblocks - first);
+		int j = MAX(first_data_block(fs) - first, 0);
+		pthread_mutex_lock(&fs->map_lock);
+		unsigned char *bits = map_bits(fs, map_slot(fs, p)->b);
+		while (j < end)
+		{
+			if (start < 0)
+			{
+				j = simd.find_bit(bits, j, end, 0);
+				if (j < 0)
+					break;
+				start = first + j;
+			}
+			// the run holds if nothing is used before it is long enough
+			int used = simd.find_bit(bits, j, MIN(end, start + n - first), 1);
+			if (used >= 0)
+			{
+				start = -1;
+				j = used + 1;
+			}
+			else if (start + n - first <= end)
+			{
+				pthread_mutex_unlock(&fs->map_lock);
+				return start;
+			}
+			else
+			{
+				j = end;
+			}
+		}
+		pthread_mutex_unlock(&fs->map_lock);
+	}
+	return -1;
+}
+
+int fs_fragments_r(struct fs *fs, int inumber)
+{
+	/**
+	Measure how scattered a file is: the number of contiguous runs its data
+	and indirect blocks form in file order. Files without blocks have none.
+	Returns -1 on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+	if (inumber < 1 || inumber >= fs->super.ninodes)
+	{
+		return pemar("error: invalid inode") - 1;
+	}
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, inumber, b);
+	struct fs_inode *inode = inode_at(fs, b, inumber);
+	if (!inode->isvalid)
+	{
+		return pemar("error: invalid inode") - 1;
+	}
+	if (inode->flags & INODE_INLINE)
+	{
+		return 0;
+	}
+	BLOCK_BUFFER(ib);
+	if (inode->indirect)
+	{
+		block_read(fs, inode->indirect, ib->data);
+	}
+	int *list = malloc((POINTERS_PER_INODE + 1 + POINTERS_PER_BLOCK) * sizeof(int));
+	if (!list)
+	{
+		exit(1);
+	}
+	int runs = count_runs(list, file_layout(fs, inode, ib, list));
+	free(list);
+	return runs;
+}
+
+// Move the blocks of inode inumber into one free run. The new copies are
+// written first and the inode slot last, so the file switches to them in a
+// single block write. Files with shared blocks stay where they are, since
+// the other references could not be updated. Returns blocks moved.
+int defrag_file(struct fs *fs, int inumber)
+{
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, inumber, b);
+	struct fs_inode *slot = inode_at(fs, b, inumber);
+	struct fs_inode INODE = *slot;
+	if (!INODE.isvalid || (INODE.flags & INODE_INLINE))
+	{
+		return 0;
+	}
+	BLOCK_BUFFER(ib);
+	if (INODE.indirect)
+	{
+		block_read(fs, INODE.indirect, ib->data);
+	}
+
+	int *list = malloc((POINTERS_PER_INODE + 1 + POINTERS_PER_BLOCK) * sizeof(int));
+	if (!list)
+	{
+		exit(1);
+	}
+	int n = file_layout(fs, &INODE, ib, list);
+	int start = -1;
+	int shared = 0;
+	for (int k = 0; k < n && fs->ref_cache; k++)
+	{
+		shared |= refcount_get(fs, list[k]) > 1;
+	}
+	if (count_runs(list, n) > 1 && !shared)
+	{
+		start = find_free_run(fs, n);
+	}
+	if (start < 0)
+	{
+		free(list);
+		return 0;
+	}
+
+	// renumber the tree in layout order; ib becomes the new indirect block
+	int k = 0;
+	int islot = -1;
+	for (int i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		// reserved blocks stay unwritten in their new place
+		if (INODE.direct[i])
+			INODE.direct[i] = (start + k++) | (INODE.direct[i] & BLOCK_UNWRITTEN);
+	}
+	if (INODE.indirect)
+	{
+		islot = k;
+		INODE.indirect = start + k++;
+		for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+		{
+			if (ib->pointers[i])
+				ib->pointers[i] = (start + k++) | (ib->pointers[i] & BLOCK_UNWRITTEN);
+		}
+	}
+
+	// copy in large sequential runs: gather old blocks, write the new run
+	int chunk = MAX(1, MAX_BLOCK_SIZE / fs->block_size);
+	unsigned char *buffer = disk_alloc((size_t)chunk * fs->block_size);
+	if (!buffer)
+	{
+		exit(1);
+	}
+	for (int first = 0; first < n; first += chunk)
+	{
+		int count = MIN(chunk, n - first);
+		for (int i = 0; i < count;)
+		{
+			if (first + i == islot)
+			{
+				memcpy(buffer + (size_t)i * fs->block_size, ib->data, fs->block_size);
+				i++;
+				continue;
+			}
+			int run = 1;
+			while (i + run < count && list[first + i + run] == list[first + i] + run && first + i + run != islot)
+				run++;
+			block_readv(fs, list[first + i], run, buffer + (size_t)i * fs->block_size);
+			i += run;
+		}
+		disk_writev(fs->disk, start + first, count, buffer);
+	}
+	free(buffer);
+
+	for (k = 0; k < n; k++)
+	{
+		markused(fs, start + k);
+		refcount_set(fs, start + k, 1);
+		uint64_t hash = dedup_hash_of(fs, list[k]);
+		if (hash)
+			dedup_insert(fs, hash, start + k);
+	}
+	metadata_flush(fs);
+
+	memset(slot, 0, fs->super.inode_size);
+	*slot = INODE;
+	write_inode_block(fs, inumber, b);
+
+	for (k = 0; k < n; k++)
+	{
+		release_block(fs, list[k]);
+	}
+	metadata_flush(fs);
+	free(list);
+	return n;
+}
+
+int fs_defrag_r(struct fs *fs, int *inumber, int budget)
+{
+	/**
+	Relocate fragmented files into contiguous runs, a bounded step at a
+	time so that other requests can be served between steps. Start a pass
+	with *inumber set to 1; each call continues from *inumber, stops once
+	budget blocks have moved, and sets *inumber to 0 when the pass is done.
+	A file is always moved whole. Returns blocks moved, or -1 on failure.
+	The log layout has nothing to do here: it writes sequentially anyway,
+	and fs_clean compacts it.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only") - 1;
+	}
+	if (fs->imap)
+	{
+		*inumber = 0;
+		return 0;
+	}
+
+	int moved = 0;
+	int i = MAX(*inumber, 1);
+	int end = fs->super.blocks_per_group ? fs->super.ninodes : MIN(fs->super.ninodes, itable_watermark(fs) * inodes_per_block(fs));
+	for (; i < end && moved < budget; i++)
+	{
+		moved += defrag_file(fs, i);
+	}
+	*inumber = i < end ? i : 0;
+	return moved;
+}
+
+// Cleaning: copy block b, file block offset of inode inumber, to the head
+// of the log if it lies in a segment being emptied. Returns where it is now.
+int log_evacuate(struct fs *fs, int b, int inumber, int offset)
+{
+	if (!b || !fs->log_victim[(b - fs->super.log_start) / fs->super.segment_blocks])
+	{
+		return b;
+	}
+	int to = log_alloc(fs);
+	if (!to)
+	{
+		return b;
+	}
+	log_note(fs, to, inumber, offset);
+	BLOCK_BUFFER(data);
+	block_read(fs, b, data->data);
+	block_write(fs, to, data->data);
+	markfree(fs, b);
+	return to;
+}
+
+// Move the blocks of inode inumber that lie in segments being emptied.
+// Returns nonzero when the inode changed.
+int log_clean_inode(struct fs *fs, int inumber, struct fs_inode *inode)
+{
+	if (!inode->isvalid || (inode->flags & INODE_INLINE))
+	{
+		return 0;
+	}
+	int changed = 0;
+	for (int k = 0; k < POINTERS_PER_INODE; k++)
+	{
+		int b = log_evacuate(fs, inode->direct[k], inumber, k);
+		changed |= b != inode->direct[k];
+		inode->direct[k] = b;
+	}
+	if (inode->indirect)
+	{
+		BLOCK_BUFFER(ib);
+		block_read(fs, inode->indirect, ib->data);
+		int dirty = fs->log_victim[(inode->indirect - fs->super.log_start) / fs->super.segment_blocks];
+		for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+		{
+			int b = log_evacuate(fs, ib->pointers[k], inumber, POINTERS_PER_INODE + k);
+			dirty |= b != ib->pointers[k];
+			ib->pointers[k] = b;
+		}
+		if (dirty)
+		{
+			int b = log_move(fs, inode->indirect);
+			log_note(fs, b, inumber, LOG_INDIRECT);
+			block_write(fs, b, ib->data);
+			changed |= b != inode->indirect;
+			inode->indirect = b;
+		}
+	}
+	return changed;
+}
+
+// Move what lies in segments being emptied of the inode table block or
+// the inode that owner names.
+void log_clean_owner(struct fs *fs, struct log_owner owner)
+{
+	int i = owner.inumber == LOG_ITABLE ? (int)owner.offset : (int)(owner.inumber / inodes_per_block(fs));
+	if (!owner.inumber || i < 0 || i >= fs->super.ninodeblocks || !fs->imap[i] ||
+		(owner.inumber != LOG_ITABLE && owner.inumber >= fs->super.ninodes))
+	{
+		return;
+	}
+	BLOCK_BUFFER(b);
+	read_itable(fs, i, b);
+	int changed = owner.inumber != LOG_ITABLE && log_clean_inode(fs, owner.inumber, inode_at(fs, b, owner.inumber));
+	if (changed || fs->log_victim[(fs->imap[i] - fs->super.log_start) / fs->super.segment_blocks])
+		write_itable(fs, i, b);
+}
+
+// Empty segment s through the owners its records note: walk its chunks
+// from the first, stopping at a record left over from an earlier pass over
+// the segment, which comes before the last one read.
+void log_clean_segment(struct fs *fs, int s)
+{
+	int end = segment_first(fs, s + 1);
+	uint32_t seq = 0;
+	BLOCK_BUFFER(b);
+	struct log_record *r = &b->log;
+	struct log_owner *owners = (struct log_owner *)(b->data + fs->block_size);
+	for (int at = segment_first(fs, s); at < end - 1 && fs->log_live[s];)
+	{
+		disk_read(fs->disk, at, b->data);
+		if (r->magic != LOG_MAGIC || r->log_id != fs->super.log_id || r->nblocks < 1 || r->nblocks > end - at ||
+			(seq && r->seq <= seq))
+		{
+			break;
+		}
+		for (int k = 0; k < (int)r->nblocks - 1; k++)
+		{
+			if (!isfree(fs, at + 1 + k))
+				log_clean_owner(fs, owners[-1 - k]);
+		}
+		seq = r->seq;
+		at += r->nblocks;
+	}
+}
+
+int fs_clean_r(struct fs *fs, int budget)
+{
+	/**
+	Reclaim space in a log-structured filesystem, a bounded step at a time
+	so that other requests can be served between steps. The segments with
+	the least live data are emptied by copying what is live in them to the
+	head of the log, up to budget blocks per call (always at least one
+	segment), after which they can be written again. Writes clean by
+	themselves when clean segments run low; this lets a caller with idle
+	time do it ahead. Returns how many more segments are clean than before:
+	zero when there is nothing worth cleaning or the layout is not
+	log-structured, and -1 on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted") - 1;
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only") - 1;
+	}
+	if (!fs->imap)
+	{
+		return 0;
+	}
+	log_commit(fs);
+
+	// least live first; a segment more than three quarters live would cost
+	// more to copy than it gives back
+	int n = fs->super.nsegments;
+	int victims = 0;
+	int copied = 0;
+	while (1)
+	{
+		int best = -1;
+		for (int s = 0; s < n; s++)
+		{
+			int current = !fs->log_full && s == fs->log_segment;
+			if (!fs->log_victim[s] && !fs->log_clean[s] && !current && fs->log_live[s] <= 3 * fs->super.segment_blocks / 4 &&
+				(best < 0 || fs->log_live[s] < fs->log_live[best]))
+				best = s;
+		}
+		if (best < 0 || (victims && copied + (int)fs->log_live[best] > budget))
+			break;
+		fs->log_victim[best] = 1;
+		victims++;
+		copied += fs->log_live[best];
+	}
+	if (!victims)
+	{
+		return 0;
+	}
+
+	// the copies may go to the reserve, since they are what frees segments
+	fs->log_cleaning = 1;
+	log_resume(fs);
+	int left = 0;
+	for (int s = 0; s < n; s++)
+	{
+		if (fs->log_victim[s])
+		{
+			log_clean_segment(fs, s);
+			left += fs->log_live[s];
+		}
+	}
+	// records written before they noted owners leave blocks behind; those
+	// are found the slow way, through every inode, unless the log is full
+	// and nothing could move anyway
+	BLOCK_BUFFER(b);
+	for (int i = 0; i < fs->super.ninodeblocks && left && !fs->log_full; i++)
+	{
+		if (!fs->imap[i])
+			continue;
+		read_itable(fs, i, b);
+		int changed = 0;
+		for (int j = 0; j < inodes_per_block(fs); j++)
+		{
+			int inumber = i * inodes_per_block(fs) + j;
+			changed |= log_clean_inode(fs, inumber, inode_at(fs, b, inumber));
+		}
+		if (changed || fs->log_victim[(fs->imap[i] - fs->super.log_start) / fs->super.segment_blocks])
+			write_itable(fs, i, b);
+	}
+	fs->log_cleaning = 0;
+
+	// emptied victims turn clean at the checkpoint; a copy that did not fit
+	// leaves its segment as it was
+	memset(fs->log_victim, 0, n);
+	int before = log_count_clean(fs);
+	log_checkpoint(fs);
+	return MAX(log_count_clean(fs) - before, 0);
+}
+
+int fs_sync_r(struct fs *fs)
+{
+	/**
+	Make every call that has returned durable. The log layout holds the
+	blocks of recent calls in memory until a segment's worth has built up,
+	and writes them now; the other layouts write through, so there is
+	nothing to do. Return one on success, zero otherwise.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->imap)
+	{
+		log_commit(fs);
+	}
+	return 1;
+}
+
+// Before an operation that appends to the log, clean while fewer than
+// LOG_LOW segments are clean, as long as that keeps gaining segments.
+void log_reserve(struct fs *fs)
+{
+	for (int k = 0; fs->imap && k < fs->super.nsegments && log_count_clean(fs) < LOG_LOW; k++)
+	{
+		if (fs_clean_r(fs, fs->super.segment_blocks) <= 0)
+			break;
+	}
+}
+
+uint32_t name_hash(const char *name, int len)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Blocks in one part of a directory -- the directory itself, an extent or
+// the map inode: as many as a file can have.
+int dir_part_blocks(struct fs *fs)
+{
+	return MIN(POINTERS_PER_INODE + POINTERS_PER_BLOCK, INT_MAX / fs->block_size);
+}
+
+// Largest global depth whose map still fits in a map inode.
+int dir_max_depth(struct fs *fs)
+{
+	int depth = 0;
+	while ((2ull << depth) <= (uint64_t)dir_part_blocks(fs) * (fs->block_size / sizeof(uint32_t)))
+		depth++;
+	return depth;
+}
+
+// Load the inode of directory dir and its header block.
+int dir_open(struct fs *fs, int dir, struct fs_inode *inode, union fs_block *head)
+{
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (dir < 1 || dir >= fs->super.ninodes)
+	{
+		return pemar("error: invalid directory inode");
+	}
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, dir, b);
+	*inode = *inode_at(fs, b, dir);
+	if (!inode->isvalid || !(inode->flags & INODE_DIR))
+	{
+		char error[100];
+		sprintf(error, "error: inode %d is not a directory.", dir);
+		return pemar(error);
+	}
+	getfblock(fs, inode, head->data, 0, NULL);
+	if (head->dir.magic == DIR_MAGIC_V1 && (1u << head->dir.global_depth) <= DIR_MAP_ENTRIES)
+	{
+		// move the map to where it is now kept; the header is stored that
+		// way the next time it changes
+		uint32_t n = 1u << head->dir.global_depth;
+		memmove(head->dir.map, &head->dir.map_file, n * sizeof(uint32_t));
+		memset(&head->dir.map_file, 0, offsetof(struct fs_dirheader, map) - offsetof(struct fs_dirheader, map_file));
+		head->dir.magic = DIR_MAGIC;
+	}
+	if (head->dir.magic != DIR_MAGIC || head->dir.global_depth > dir_max_depth(fs) || head->dir.nextents > DIR_EXTENTS)
+	{
+		return pemar("error: directory header is corrupt");
+	}
+	return 1;
+}
+
+// A new inode to hold part of a large directory.
+int dir_new_part(struct fs *fs)
+{
+	int inumber = fs_create_r(fs);
+	if (!inumber)
+	{
+		return 0;
+	}
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, inumber, b);
+	inode_at(fs, b, inumber)->flags |= INODE_DIRDATA;
+	write_inode_block(fs, inumber, b);
+	return inumber;
+}
+
+// The bucket that hash goes to, or zero if the map is damaged.
+uint32_t dir_bucket_of(struct fs *fs, union fs_block *head, uint32_t hash)
+{
+	uint32_t i = hash & ((1u << head->dir.global_depth) - 1);
+	uint32_t bucket = 0;
+	if (!head->dir.map_file)
+		bucket = head->dir.map[i];
+	else
+		fs_read_r(fs, head->dir.map_file, (unsigned char *)&bucket, sizeof(bucket), i * sizeof(bucket));
+	if (!bucket || bucket > head->dir.nbuckets)
+	{
+		return pemar("error: directory map is corrupt");
+	}
+	return bucket;
+}
+
+int dir_map_set(struct fs *fs, union fs_block *head, uint32_t i, uint32_t bucket)
+{
+	if (!head->dir.map_file)
+	{
+		head->dir.map[i] = bucket;
+		return 1;
+	}
+	return fs_write_r(fs, head->dir.map_file, (unsigned char *)&bucket, sizeof(bucket), i * sizeof(bucket)) == sizeof(bucket);
+}
+
+// Double the map: entry n + i starts out as entry i. A map too big for the
+// header moves to a map inode.
+int dir_grow_map(struct fs *fs, union fs_block *head)
+{
+	uint32_t n = 1u << head->dir.global_depth;
+	if (!head->dir.map_file && 2 * n <= DIR_MAP_ENTRIES)
+	{
+		memcpy(head->dir.map + n, head->dir.map, n * sizeof(uint32_t));
+		head->dir.global_depth++;
+		return 1;
+	}
+	uint32_t *map = malloc(2 * (size_t)n * sizeof(uint32_t));
+	if (!map)
+	{
+		exit(1);
+	}
+	int moving = !head->dir.map_file;
+	int ok;
+	if (moving)
+	{
+		memcpy(map, head->dir.map, n * sizeof(uint32_t));
+		head->dir.map_file = dir_new_part(fs);
+		ok = head->dir.map_file != 0;
+	}
+	else
+	{
+		ok = fs_read_r(fs, head->dir.map_file, (unsigned char *)map, n * sizeof(uint32_t), 0) == n * sizeof(uint32_t);
+	}
+	memcpy(map + n, map, n * sizeof(uint32_t));
+	if (ok)
+	{
+		int length = (moving ? 2 * n : n) * sizeof(uint32_t);
+		ok = fs_write_r(fs, head->dir.map_file, (unsigned char *)(map + (moving ? 0 : n)), length, (moving ? 0 : n) * sizeof(uint32_t)) == length;
+	}
+	if (!ok && moving && head->dir.map_file)
+	{
+		fs_delete_r(fs, head->dir.map_file);
+	}
+	if (!ok && moving)
+	{
+		head->dir.map_file = 0;
+	}
+	free(map);
+	head->dir.global_depth += ok;
+	return ok;
+}
+
+// The inode holding bucket k, and its file block there.
+int dir_bucket_at(struct fs *fs, int dir, union fs_block *head, uint32_t k, int *fblkno)
+{
+	int per = dir_part_blocks(fs);
+	if (k < per)
+	{
+		*fblkno = k;
+		return dir;
+	}
+	*fblkno = (k - per) % per;
+	return head->dir.extents[(k - per) / per];
+}
+
+// Read bucket k of directory dir, whose inode is loaded.
+int dir_read_bucket(struct fs *fs, int dir, struct fs_inode *inode, union fs_block *head, uint32_t k, union fs_block *b)
+{
+	int fblkno;
+	int part = dir_bucket_at(fs, dir, head, k, &fblkno);
+	if (part == dir)
+	{
+		getfblock(fs, inode, b->data, fblkno, NULL);
+		return 1;
+	}
+	return fs_read_r(fs, part, b->data, fs->block_size, fblkno * fs->block_size) == fs->block_size;
+}
+
+int dir_write_block(struct fs *fs, int dir, int fblkno, union fs_block *b)
+{
+	return fs_write_r(fs, dir, b->data, fs->block_size, fblkno * fs->block_size) == fs->block_size;
+}
+
+int dir_write_bucket(struct fs *fs, int dir, union fs_block *head, uint32_t k, union fs_block *b)
+{
+	int fblkno;
+	int part = dir_bucket_at(fs, dir, head, k, &fblkno);
+	return dir_write_block(fs, part, fblkno, b);
+}
+
+int dir_check_name(const char *name)
+{
+	int len = strlen(name);
+	if (len == 0 || len > DIRENT_NAME_MAX || strchr(name, '/'))
+	{
+		return pemar("error: invalid file name");
+	}
+	return len;
+}
+
+// Find name in bucket b and return its slot, or -1.
+int dir_find(union fs_block *b, const char *name, int len, uint32_t hash)
+{
+	for (int i = 0; i < b->bucket.count; i++)
+	{
+		struct fs_dirent *e = &b->bucket.entries[i];
+		if (e->hash == hash && e->namelen == len && !memcmp(e->name, name, len))
+			return i;
+	}
+	return -1;
+}
+
+// Turn inode inumber into an empty directory.
+int dir_init(struct fs *fs, int inumber)
+{
+	BLOCK_BUFFER(b);
+	read_inode_block(fs, inumber, b);
+	inode_at(fs, b, inumber)->flags |= INODE_DIR;
+	write_inode_block(fs, inumber, b);
+
+	memset(b->data, 0, fs->block_size);
+	if (!dir_write_block(fs, inumber, 1, b))
+	{
+		return 0;
+	}
+	b->dir.magic = DIR_MAGIC;
+	b->dir.global_depth = 0;
+	b->dir.nbuckets = 1;
+	b->dir.map[0] = 1;
+	return dir_write_block(fs, inumber, 0, b);
+}
+
+int fs_root_r(struct fs *fs)
+{
+	/**
+	Return the inumber of the root directory, creating it the first time the
+	namespace is used. Returns zero on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->super.rootdir)
+	{
+		return fs->super.rootdir;
+	}
+	int root = fs_create_r(fs);
+	if (!root)
+	{
+		return 0;
+	}
+	if (!dir_init(fs, root))
+	{
+		fs_delete_r(fs, root);
+		return 0;
+	}
+	fs->super.rootdir = root;
+	write_super(fs);
+	return root;
+}
+
+int fs_lookup_r(struct fs *fs, int dir, const char *name)
+{
+	/**
+	Return the inumber that name maps to in directory dir, or zero if there
+	is no such entry.
+	**/
+	struct fs_inode inode;
+	BLOCK_BUFFER(head);
+	if (!dir_open(fs, dir, &inode, head))
+	{
+		return 0;
+	}
+	int len = strlen(name);
+	uint32_t hash = name_hash(name, len);
+	uint32_t bucket = dir_bucket_of(fs, head, hash);
+	BLOCK_BUFFER(b);
+	if (!bucket || !dir_read_bucket(fs, dir, &inode, head, bucket, b))
+	{
+		return 0;
+	}
+	int slot = dir_find(b, name, len, hash);
+	return slot < 0 ? 0 : b->bucket.entries[slot].inumber;
+}
+
+int fs_link_r(struct fs *fs, int dir, const char *name, int inumber)
+{
+	/**
+	Add the entry name -> inumber to directory dir. Fails if the name is
+	already present. Returns one on success, zero otherwise.
+	**/
+	struct fs_inode inode;
+	BLOCK_BUFFER(head);
+	if (!dir_open(fs, dir, &inode, head))
+	{
+		return 0;
+	}
+	int len = dir_check_name(name);
+	if (!len)
+	{
+		return 0;
+	}
+	if (inumber < 1 || inumber >= fs->super.ninodes)
+	{
+		return pemar("error: invalid inode");
+	}
+	uint32_t hash = name_hash(name, len);
+
+	while (1)
+	{
+		uint32_t bucket = dir_bucket_of(fs, head, hash);
+		BLOCK_BUFFER(b);
+		if (!bucket || !dir_read_bucket(fs, dir, &inode, head, bucket, b))
+		{
+			return 0;
+		}
+		if (dir_find(b, name, len, hash) >= 0)
+		{
+			return pemar("error: name already exists");
+		}
+
+		if (b->bucket.count < DIRENTS_PER_BUCKET)
+		{
+			struct fs_dirent *e = &b->bucket.entries[b->bucket.count++];
+			memset(e, 0, sizeof(*e));
+			e->inumber = inumber;
+			e->hash = hash;
+			e->namelen = len;
+			memcpy(e->name, name, len);
+			head->dir.nentries++;
+			return dir_write_bucket(fs, dir, head, bucket, b) && dir_write_block(fs, dir, 0, head);
+		}
+
+		// The bucket is full: split it on the next hash bit and retry.
+		uint32_t depth = b->bucket.local_depth;
+		if (depth == head->dir.global_depth)
+		{
+			if (depth == dir_max_depth(fs))
+			{
+				return pemar("error: directory is full");
+			}
+			if (!dir_grow_map(fs, head))
+			{
+				return pemar("error: no space to grow directory");
+			}
+		}
+
+		// past the directory's own blocks, the new bucket may need a new extent
+		uint32_t newbucket = head->dir.nbuckets + 1;
+		int per = dir_part_blocks(fs);
+		if (newbucket >= per && (newbucket - per) / per >= head->dir.nextents)
+		{
+			if (head->dir.nextents == DIR_EXTENTS)
+			{
+				return pemar("error: directory is full");
+			}
+			int extent = dir_new_part(fs);
+			if (!extent)
+			{
+				return pemar("error: no space to grow directory");
+			}
+			head->dir.extents[head->dir.nextents++] = extent;
+		}
+
+		BLOCK_BUFFER(sibling);
+		memset(sibling->data, 0, fs->block_size);
+		sibling->bucket.local_depth = b->bucket.local_depth = depth + 1;
+
+		int kept = 0;
+		for (int i = 0; i < b->bucket.count; i++)
+		{
+			struct fs_dirent *e = &b->bucket.entries[i];
+			if ((e->hash >> depth) & 1)
+				sibling->bucket.entries[sibling->bucket.count++] = *e;
+			else
+				b->bucket.entries[kept++] = *e;
+		}
+		memset(&b->bucket.entries[kept], 0, (b->bucket.count - kept) * sizeof(struct fs_dirent));
+		b->bucket.count = kept;
+
+		if (!dir_write_bucket(fs, dir, head, newbucket, sibling))
+		{
+			dir_write_block(fs, dir, 0, head);
+			return pemar("error: no space to grow directory");
+		}
+		head->dir.nbuckets = newbucket;
+		// the map entries of the old bucket are those that agree with hash
+		// on its low depth bits; the ones with the next bit set move
+		for (uint32_t i = (hash & ((1u << depth) - 1)) | (1u << depth); i < (1u << head->dir.global_depth); i += 2u << depth)
+		{
+			if (!dir_map_set(fs, head, i, newbucket))
+				return 0;
+		}
+		if (!dir_write_bucket(fs, dir, head, bucket, b) || !dir_write_block(fs, dir, 0, head))
+		{
+			return 0;
+		}
+		// the new bucket may have changed the inode's pointers
+		dir_open(fs, dir, &inode, head);
+	}
+}
+
+int fs_unlink_r(struct fs *fs, int dir, const char *name)
+{
+	/**
+	Remove the entry for name from directory dir. The inode it pointed to is
+	left alone. Returns one on success, zero otherwise.
+	**/
+	struct fs_inode inode;
+	BLOCK_BUFFER(head);
+	if (!dir_open(fs, dir, &inode, head))
+	{
+		return 0;
+	}
+	int len = strlen(name);
+	uint32_t hash = name_hash(name, len);
+	uint32_t bucket = dir_bucket_of(fs, head, hash);
+	BLOCK_BUFFER(b);
+	if (!bucket || !dir_read_bucket(fs, dir, &inode, head, bucket, b))
+	{
+		return 0;
+	}
+	int slot = dir_find(b, name, len, hash);
+	if (slot < 0)
+	{
+		return pemar("error: no such name");
+	}
+	b->bucket.entries[slot] = b->bucket.entries[--b->bucket.count];
+	memset(&b->bucket.entries[b->bucket.count], 0, sizeof(struct fs_dirent));
+	head->dir.nentries--;
+	return dir_write_bucket(fs, dir, head, bucket, b) && dir_write_block(fs, dir, 0, head);
+}
+
+int fs_mkdir_r(struct fs *fs, int dir, const char *name)
+{
+	/**
+	Create an empty directory and enter it in directory dir under name.
+	Returns the new directory's inumber, or zero on failure.
+	**/
+	if (!dir_check_name(name))
+	{
+		return 0;
+	}
+	if (fs_lookup_r(fs, dir, name))
+	{
+		return pemar("error: name already exists");
+	}
+	int inumber = fs_create_r(fs);
+	if (!inumber)
+	{
+		return 0;
+	}
+	if (!dir_init(fs, inumber) || !fs_link_r(fs, dir, name, inumber))
+	{
+		fs_delete_r(fs, inumber);
+		return 0;
+	}
+	return inumber;
+}
+
+int fs_readdir_r(struct fs *fs, int dir, void (*fn)(const char *name, int inumber, void *arg), void *arg)
+{
+	/**
+	Call fn once for every entry of directory dir, in hash order.
+	Returns the number of entries, or -1 on failure.
+	**/
+	struct fs_inode inode;
+	BLOCK_BUFFER(head);
+	if (!dir_open(fs, dir, &inode, head))
+	{
+		return -1;
+	}
+	for (uint32_t i = 1; i <= head->dir.nbuckets; i++)
+	{
+		BLOCK_BUFFER(b);
+		if (!dir_read_bucket(fs, dir, &inode, head, i, b))
+		{
+			return -1;
+		}
+		for (int j = 0; j < b->bucket.count; j++)
+		{
+			char name[DIRENT_NAME_MAX + 1];
+			struct fs_dirent *e = &b->bucket.entries[j];
+			memcpy(name, e->name, e->namelen);
+			name[e->namelen] = 0;
+			fn(name, e->inumber, arg);
+		}
+	}
+	return head->dir.nentries;
+}
+
+int fs_namei_r(struct fs *fs, const char *path)
+{
+	/**
+	Resolve a slash-separated path, starting at the root directory.
+	Returns the inumber it names, or zero if any component is missing.
+	**/
+	int inumber = fs_root_r(fs);
+	while (inumber && *path)
+	{
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		const char *end = strchr(path, '/');
+		int len = end ? end - path : strlen(path);
+		char name[DIRENT_NAME_MAX + 1];
+		if (len > DIRENT_NAME_MAX)
+		{
+			return 0;
+		}
+		memcpy(name, path, len);
+		name[len] = 0;
+		inumber = fs_lookup_r(fs, inumber, name);
+		path += len;
+	}
+	return inumber;
+}
+
+// Drop the references held by the inode table copies in table (n entries,
+// zero entries skipped), freeing blocks that nothing else uses.
+void snapshot_release(struct fs *fs, uint32_t *table, int n)
+{
+	BLOCK_BUFFER(b);
+	for (int i = 0; i < n; i++)
+	{
+		if (!table[i])
+			continue;
+		block_read(fs, table[i], b->data);
+		for (int j = 0; j < inodes_per_block(fs); j++)
+		{
+			release_tree(fs, (struct fs_inode *)(b->data + j * fs->super.inode_size));
+		}
+		release_block(fs, table[i]);
+	}
+}
+
+// The slot holding snapshot id, or NULL.
+struct fs_snapshot *snapshot_find(struct fs *fs, int id)
+{
+	if (!(fs->super.flags & FS_FORMAT_SNAPSHOTS) || id <= 0)
+		return NULL;
+	for (int i = 0; i < FS_MAX_SNAPSHOTS; i++)
+	{
+		if (fs->super.snapshots[i].id == id)
+			return &fs->super.snapshots[i];
+	}
+	return NULL;
+}
+
+// Read the inode table copies of snapshot s from its map chain into a new array.
+uint32_t *snapshot_table(struct fs *fs, struct fs_snapshot *s)
+{
+	uint32_t *table = malloc(fs->super.ninodeblocks * sizeof(uint32_t));
+	if (!table)
+	{
+		exit(1);
+	}
+	BLOCK_BUFFER(map);
+	int per_map = POINTERS_PER_BLOCK - 1;
+	uint32_t next = s->map;
+	for (int i = 0; i < fs->super.ninodeblocks; i += per_map)
+	{
+		if (next < first_data_block(fs) || next >= fs->super.nblocks)
+		{
+			free(table);
+			pemar("error: snapshot map is damaged");
+			return NULL;
+		}
+		block_read(fs, next, map->data);
+		memcpy(table + i, map->pointers + 1, MIN(per_map, fs->super.ninodeblocks - i) * sizeof(uint32_t));
+		next = map->pointers[0];
+	}
+	return table;
+}
+
+int fs_snapshot_r(struct fs *fs)
+{
+	/**
+	Freeze the current state of every file. Each inode table block is copied
+	to a fresh block and the blocks the copied inodes point to, direct and
+	indirect, gain a reference, so later writes copy shared blocks instead
+	of changing them. No indirect block is read: the blocks under one are
+	referenced for it when a write first copies it. Blocks of the inode
+	table that hold no inode all share one zero block.
+	Returns the (positive) snapshot id, or zero on failure.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only");
+	}
+	if (!(fs->super.flags & FS_FORMAT_SNAPSHOTS))
+	{
+		return pemar("error: the disk was not formatted with snapshots");
+	}
+
+	struct fs_snapshot *slot = NULL;
+	for (int i = 0; i < FS_MAX_SNAPSHOTS && !slot; i++)
+	{
+		if (!fs->super.snapshots[i].id)
+			slot = &fs->super.snapshots[i];
+	}
+	if (!slot)
+	{
+		return pemar("error: too many snapshots");
+	}
+
+	int n = fs->super.ninodeblocks;
+	int per_map = POINTERS_PER_BLOCK - 1;
+	int nmaps = (n + per_map - 1) / per_map;
+	uint32_t *table = calloc(n + nmaps, sizeof(uint32_t));
+	if (!table)
+	{
+		exit(1);
+	}
+	uint32_t *maps = table + n;
+	int zero = 0;
+
+	BLOCK_BUFFER(b);
+	for (int i = 0; i < n; i++)
+	{
+		read_itable(fs, i, b);
+		int used = 0;
+		for (int j = 0; j < inodes_per_block(fs) && !used; j++)
+		{
+			used = ((struct fs_inode *)(b->data + j * fs->super.inode_size))->isvalid;
+		}
+		if (!used && zero)
+		{
+			refcount_set(fs, zero, refcount_get(fs, zero) + 1);
+			table[i] = zero;
+			continue;
+		}
+		table[i] = allocate_block(fs);
+		if (!table[i])
+		{
+			break;
+		}
+		if (used)
+		{
+			for (int j = 0; j < inodes_per_block(fs); j++)
+			{
+				retain_tree(fs, (struct fs_inode *)(b->data + j * fs->super.inode_size));
+			}
+		}
+		else
+		{
+			zero = table[i];
+			memset(b->data, 0, fs->block_size);
+		}
+		disk_write(fs->disk, table[i], b->data);
+	}
+
+	for (int i = 0; i < nmaps && table[n - 1]; i++)
+	{
+		maps[i] = allocate_block(fs);
+		if (!maps[i])
+			break;
+	}
+
+	if (!table[n - 1] || !maps[nmaps - 1])
+	{
+		snapshot_release(fs, table, n);
+		for (int i = 0; i < nmaps; i++)
+		{
+			if (maps[i])
+				release_block(fs, maps[i]);
+		}
+		free(table);
+		metadata_flush(fs);
+		return pemar("error: not enough free blocks for a snapshot");
+	}
+
+	for (int i = 0; i < nmaps; i++)
+	{
+		memset(b->data, 0, fs->block_size);
+		b->pointers[0] = i + 1 < nmaps ? maps[i + 1] : 0;
+		memcpy(b->pointers + 1, table + i * per_map, MIN(per_map, n - i * per_map) * sizeof(uint32_t));
+		disk_write(fs->disk, maps[i], b->data);
+	}
+
+	if (!fs->super.next_snapshot)
+	{
+		fs->super.next_snapshot = 1;
+	}
+	slot->id = fs->super.next_snapshot++;
+	slot->map = maps[0];
+	slot->ctime = time(NULL);
+	slot->rootdir = fs->super.rootdir;
+	free(table);
+	metadata_flush(fs);
+	write_super(fs);
+
+	return slot->id;
+}
+
+int fs_snapshot_delete_r(struct fs *fs, int id)
+{
+	/**
+	Drop snapshot id, freeing every block only it still references.
+	Returns one on success, zero otherwise.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (fs->readonly)
+	{
+		return pemar("error: the filesystem is mounted read-only");
+	}
+	struct fs_snapshot *s = snapshot_find(fs, id);
+	if (!s)
+	{
+		return pemar("error: no such snapshot");
+	}
+	uint32_t *table = snapshot_table(fs, s);
+	if (!table)
+	{
+		return 0;
+	}
+	snapshot_release(fs, table, fs->super.ninodeblocks);
+	free(table);
+
+	BLOCK_BUFFER(map);
+	for (uint32_t next = s->map; next;)
+	{
+		block_read(fs, next, map->data);
+		release_block(fs, next);
+		next = map->pointers[0];
+	}
+
+	memset(s, 0, sizeof(*s));
+	metadata_flush(fs);
+	write_super(fs);
+	return 1;
+}
+
+int fs_snapshot_list_r(struct fs *fs, void (*fn)(int id, long ctime, void *arg), void *arg)
+{
+	/**
+	Call fn for every snapshot, oldest first. Returns how many there are.
+	**/
+	if (!fs->is_mounted)
+	{
+		return pemar("error: system is not mounted");
+	}
+	if (!(fs->super.flags & FS_FORMAT_SNAPSHOTS))
+	{
+		return 0;
+	}
+	int count = 0;
+	for (uint32_t id = 1; id < fs->super.next_snapshot; id++)
+	{
+		struct fs_snapshot *s = snapshot_find(fs, id);
+		if (s)
+		{
+			fn(s->id, s->ctime, arg);
+			count++;
+		}
+	}
+	return count;
+}
+
+int fs_mount_snapshot_r(struct fs *fs, int id)
+{
+	/**
+	Mount the filesystem as it was when snapshot id was taken. Every call
+	that would modify the disk fails until the next fs_mount.
+	Returns one on success, zero otherwise.
+	**/
+	if (!fs_mount_r(fs))
+	{
+		return 0;
+	}
+	struct fs_snapshot *s = snapshot_find(fs, id);
+	fs->view_table = s ? snapshot_table(fs, s) : NULL;
+	if (!fs->view_table)
+	{
+		fs->is_mounted = 0;
+		return s ? 0 : pemar("error: no such snapshot");
+	}
+	fs->readonly = 1;
+	fs->super.rootdir = s->rootdir;
+	return 1;
+}
+
+// The caches of a shared segment hold about this much each, and a process
+// waits this long (milliseconds) for another to finish building one.
+#define SHARED_ITABLE_BYTES (64 << 20)
+#define SHARED_CACHE_BYTES (64 << 20)
+#define SHARED_WAIT 30000
+
+// Round offset up to a multiple of align, a power of two.
+uint64_t shared_align(uint64_t offset, uint64_t align)
+{
+	return (offset + align - 1) & ~(align - 1);
+}
+
+// Lay out a cache of nslots blocks at offset; returns where it ends.
+uint64_t shared_cache_place(struct fs *fs, struct shared_cache *c, uint64_t offset, uint32_t nslots)
+{
+	c->nslots = nslots;
+	c->slots = offset;
+	c->data = shared_align(offset + (uint64_t)nslots * sizeof(struct shared_slot), fs->block_size);
+	return c->data + ((uint64_t)nslots << fs->block_shift);
+}
+
+// Mount the image the ordinary way and copy what the mount built into the
+// new, empty shared-memory object fd: the free map pages and their counts,
+// the group counters and the inode map. The caches start out empty; the
+// object is zero-filled, so every slot is.
+int shared_build(struct fs *fs, int fd)
+{
+	if (!fs_mount_r(fs))
+	{
+		return 0;
+	}
+	struct shared_header h;
+	memset(&h, 0, sizeof(h));
+	h.magic = SHARED_MAGIC;
+	h.super = fs->super;
+	h.map_npages = fs->map_npages;
+	uint64_t offset = shared_align(sizeof(h), 64);
+	h.groups = offset;
+	offset = shared_align(offset + (group_count(fs) + 1) * sizeof(struct group_info), 64);
+	if (fs->imap)
+	{
+		h.imap = offset;
+		offset += (uint64_t)fs->super.nimapblocks * fs->block_size;
+	}
+	h.map_free = offset;
+	offset = shared_align(offset + fs->map_npages * sizeof(uint32_t), fs->block_size);
+	h.map_pages = offset;
+	offset += (uint64_t)fs->map_npages << fs->block_shift;
+	int itable_slots = MIN(fs->super.ninodeblocks, MAX(16, SHARED_ITABLE_BYTES / fs->block_size));
+	offset = shared_cache_place(fs, &h.itable, offset, itable_slots);
+	offset = shared_cache_place(fs, &h.blocks, offset, MAX(16, SHARED_CACHE_BYTES / fs->block_size));
+	h.size = offset;
+
+	unsigned char *base = MAP_FAILED;
+	if (ftruncate(fd, h.size) == 0)
+	{
+		base = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (base == MAP_FAILED)
+	{
+		fs_unmount_r(fs);
+		return pemar("error: cannot create the shared segment");
+	}
+	memcpy(base + h.groups, fs->groups, (group_count(fs) + 1) * sizeof(struct group_info));
+	if (fs->imap)
+	{
+		memcpy(base + h.imap, fs->imap, (size_t)fs->super.nimapblocks * fs->block_size);
+	}
+	memcpy(base + h.map_free, fs->map_free, fs->map_npages * sizeof(uint32_t));
+	for (int p = 0; p < fs->map_npages; p++)
+	{
+		memcpy(base + h.map_pages + ((size_t)p << fs->block_shift), map_slot(fs, p)->b->data, fs->block_size);
+	}
+
+	// unmounting can still write the log checkpoint, so recognize the image
+	// by its superblock and modification time as they are left afterwards
+	fs_unmount_r(fs);
+	read_super(fs, &h.disk_super);
+	h.disk_mtime = disk_mtime(fs->disk);
+	memcpy(base, &h, sizeof(h));
+	__atomic_store_n(&((struct shared_header *)base)->ready, 1, __ATOMIC_RELEASE);
+	munmap(base, h.size);
+	return 1;
+}
+
+// Map the shared segment fd, once it is ready, and mount from it.
+int shared_attach(struct fs *fs, int fd)
+{
+	struct stat st;
+	struct shared_header *h = MAP_FAILED;
+	for (int waited = 0; waited <= SHARED_WAIT; waited++)
+	{
+		if (h == MAP_FAILED && fstat(fd, &st) == 0 && st.st_size >= sizeof(struct shared_header))
+		{
+			h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		if (h != MAP_FAILED && __atomic_load_n(&h->ready, __ATOMIC_ACQUIRE))
+			break;
+		usleep(1000);
+	}
+	if (h == MAP_FAILED || !__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE))
+	{
+		if (h != MAP_FAILED)
+			munmap(h, st.st_size);
+		return pemar("error: the shared segment was never finished");
+	}
+	struct fs_superblock sb;
+	read_super(fs, &sb);
+	if (h->magic != SHARED_MAGIC || h->size != st.st_size || memcmp(&sb, &h->disk_super, sizeof(sb)) ||
+		h->disk_mtime != disk_mtime(fs->disk) || h->super.nblocks > disk_nblocks(fs->disk) || !set_block_size(fs, h->super.block_size))
+	{
+		munmap(h, st.st_size);
+		return pemar("error: the shared segment belongs to a different image");
+	}
+
+	unsigned char *base = (unsigned char *)h;
+	fs->super = h->super;
+	fs->shared = h;
+	fs->groups = (struct group_info *)(base + h->groups);
+	fs->imap = h->imap ? (uint32_t *)(base + h->imap) : NULL;
+	fs->map_npages = h->map_npages;
+	fs->map_resident = 1;
+	fs->map_slots = h->map_npages;
+	fs->map_free = (uint32_t *)(base + h->map_free);
+	fs->map_cache = calloc(fs->map_slots, sizeof(struct map_slot));
+	if (!fs->map_cache)
+	{
+		exit(1);
+	}
+	for (int p = 0; p < fs->map_slots; p++)
+	{
+		fs->map_cache[p].page = p;
+		fs->map_cache[p].b = (union fs_block *)(base + h->map_pages + ((size_t)p << fs->block_shift));
+	}
+	fs->readonly = 1;
+	fs->is_mounted = 1;
+	return 1;
+}
+
+// Let go of the shared segment: everything pointing into it is forgotten
+// before fs_unmount_r frees the rest.
+void shared_detach(struct fs *fs)
+{
+	for (int i = 0; i < fs->map_slots; i++)
+	{
+		fs->map_cache[i].b = NULL;
+	}
+	fs->groups = NULL;
+	fs->imap = NULL;
+	fs->map_free = NULL;
+	munmap(fs->shared, fs->shared->size);
+	fs->shared = NULL;
+}
+
+int fs_mount_shared_r(struct fs *fs, const char *name)
+{
+	/**
+	Mount the filesystem read-only with its state in the POSIX shared
+	memory object name, so reader processes on the same host share it.
+	The first caller mounts the image as fs_mount does and puts the free
+	map, the group counters and the inode map in a new object, along with
+	an inode table cache and a block cache; later callers, from any
+	process and on any disk holding the same image, attach to the object
+	without scanning anything. Single block reads go through the caches,
+	which all of them fill and use; runs of whole blocks go to the disk.
+	The image must not change while the object exists: attaching fails
+	once its superblock or the modification time of its files differs,
+	and fs_shared_remove clears the way for the new image. As with a snapshot, every
+	call that would modify the disk fails. Returns one on success, zero
+	otherwise.
+	**/
+	if (fs->is_mounted)
+	{
+		fs_unmount_r(fs);
+	}
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd >= 0)
+	{
+		if (!shared_build(fs, fd))
+		{
+			shm_unlink(name);
+			close(fd);
+			return 0;
+		}
+	}
+	else if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0)
+	{
+		return pemar("error: cannot open the shared segment");
+	}
+	int ok = shared_attach(fs, fd);
+	close(fd);
+	return ok;
+}
+
+int fs_shared_remove(const char *name)
+{
+	/**
+	Remove the shared segment name. Processes mounted from it keep it
+	until they unmount; the next fs_mount_shared builds a new one.
+	Returns one on success, zero otherwise.
+	**/
+	if (shm_unlink(name) < 0)
+	{
+		return pemar("error: no such shared segment");
+	}
+	return 1;
+}
+
+// Async reads are cut into segments of this many bytes. Workers take
+// segments from the head of the queue, so the lookups and copies for
+// different parts of one large read run side by side under the shared
+// filesystem lock. A write, which changes allocation state and holds the
+// lock alone, is one segment, so it lands exactly as fs_write would.
+#define ASYNC_SEGMENT (256 * 1024)
+#define ASYNC_THREADS 4
+#define ASYNC_IN_FLIGHT 64
+
+struct fs_future
+{
+	struct fs *fs;
+	struct fs_future *next;
+	int write;
+	int inumber;
+	unsigned char *data;
+	int length;
+	int offset;
+	fs_callback done;
+	void *arg;
+	int segment;	// bytes per segment: ASYNC_SEGMENT for reads, all of a write
+	int nsegments;
+	int handed_out; // segments given to workers so far
+	int pending;	// segments not finished yet
+	int *results;	// bytes each segment transferred
+	int ready;
+	int result;
+};
+
+static void *async_worker(void *arg)
+{
+	struct fs *fs = arg;
+	pthread_mutex_lock(&fs->async_lock);
+	while (1)
+	{
+		while (!fs->async_head && !fs->async_stopping)
+			pthread_cond_wait(&fs->async_work, &fs->async_lock);
+		if (!fs->async_head)
+			break;
+
+		struct fs_future *f = fs->async_head;
+		int seg = f->handed_out++;
+		if (f->handed_out == f->nsegments)
+		{
+			fs->async_head = f->next;
+			if (!fs->async_head)
+				fs->async_tail = NULL;
+		}
+		pthread_mutex_unlock(&fs->async_lock);
+
+		int off = seg * f->segment;
+		int len = MIN(f->segment, f->length - off);
+		int n;
+		if (f->write)
+		{
+			pthread_rwlock_wrlock(&fs->fs_lock);
+			n = fs_write_r(fs, f->inumber, f->data + off, len, f->offset + off);
+		}
+		else
+		{
+			pthread_rwlock_rdlock(&fs->fs_lock);
+			n = fs_read_r(fs, f->inumber, f->data + off, len, f->offset + off);
+		}
+		pthread_rwlock_unlock(&fs->fs_lock);
+
+		pthread_mutex_lock(&fs->async_lock);
+		f->results[seg] = n;
+		if (--f->pending)
+			continue;
+
+		// the bytes transferred run up to the first short segment
+		f->result = 0;
+		for (int i = 0; i < f->nsegments; i++)
+		{
+			f->result += f->results[i];
+			if (f->results[i] < MIN(f->segment, f->length - i * f->segment))
+				break;
+		}
+		if (f->done)
+		{
+			pthread_mutex_unlock(&fs->async_lock);
+			f->done(f->result, f->arg);
+			free(f->results);
+			free(f);
+			pthread_mutex_lock(&fs->async_lock);
+		}
+		else
+		{
+			f->ready = 1;
+		}
+		// still in flight until the callback has returned, so a drain
+		// never finishes while one is touching the caller's state
+		fs->async_in_flight--;
+		pthread_cond_signal(&fs->async_space);
+		pthread_cond_broadcast(&fs->async_done);
+	}
+	pthread_mutex_unlock(&fs->async_lock);
+	return NULL;
+}
+
+int fs_async_start_r(struct fs *fs, int nthreads, int max_in_flight)
+{
+	/**
+	Start nthreads workers and allow up to max_in_flight requests at once;
+	further submissions wait for room. The first request starts a default
+	pool if this was not called. Returns one on success, zero otherwise.
+	**/
+	if (fs->async_threads)
+	{
+		return pemar("error: async workers are already running");
+	}
+	if (nthreads < 1 || max_in_flight < 1)
+	{
+		return pemar("error: invalid async pool size");
+	}
+	fs->async_threads = calloc(nthreads, sizeof(pthread_t));
+	if (!fs->async_threads)
+	{
+		exit(1);
+	}
+	fs->async_stopping = 0;
+	fs->async_limit = max_in_flight;
+	for (fs->async_nthreads = 0; fs->async_nthreads < nthreads; fs->async_nthreads++)
+	{
+		if (pthread_create(&fs->async_threads[fs->async_nthreads], NULL, async_worker, fs))
+		{
+			fs_async_stop_r(fs);
+			return pemar("error: cannot start async workers");
+		}
+	}
+	return 1;
+}
+
+void fs_async_drain_r(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->async_lock);
+	while (fs->async_in_flight)
+		pthread_cond_wait(&fs->async_done, &fs->async_lock);
+	pthread_mutex_unlock(&fs->async_lock);
+}
+
+void fs_async_stop_r(struct fs *fs)
+{
+	/**
+	Finish every request in flight and stop the workers.
+	**/
+	fs_async_drain_r(fs);
+	pthread_mutex_lock(&fs->async_lock);
+	fs->async_stopping = 1;
+	pthread_cond_broadcast(&fs->async_work);
+	pthread_mutex_unlock(&fs->async_lock);
+	for (int i = 0; i < fs->async_nthreads; i++)
+	{
+		pthread_join(fs->async_threads[i], NULL);
+	}
+	free(fs->async_threads);
+	fs->async_threads = NULL;
+	fs->async_nthreads = 0;
+}
+
+static struct fs_future *async_submit(struct fs *fs, int write, int inumber, unsigned char *data, int length, int offset, fs_callback done, void *arg)
+{
+	if (!fs->async_threads && !fs_async_start_r(fs, ASYNC_THREADS, ASYNC_IN_FLIGHT))
+	{
+		exit(1);
+	}
+	struct fs_future *f = calloc(1, sizeof(*f));
+	length = MAX(length, 0);
+	int segment = write ? MAX(length, 1) : ASYNC_SEGMENT;
+	int nsegments = MAX(1, (length + segment - 1) / segment);
+	int *results = calloc(nsegments, sizeof(int));
+	if (!f || !results)
+	{
+		exit(1);
+	}
+	f->fs = fs;
+	f->write = write;
+	f->inumber = inumber;
+	f->data = data;
+	f->length = length;
+	f->offset = offset;
+	f->done = done;
+	f->arg = arg;
+	f->segment = segment;
+	f->nsegments = nsegments;
+	f->pending = nsegments;
+	f->results = results;
+
+	pthread_mutex_lock(&fs->async_lock);
+	while (fs->async_in_flight >= fs->async_limit)
+		pthread_cond_wait(&fs->async_space, &fs->async_lock);
+	fs->async_in_flight++;
+	if (fs->async_tail)
+		fs->async_tail->next = f;
+	else
+		fs->async_head = f;
+	fs->async_tail = f;
+	pthread_cond_broadcast(&fs->async_work);
+	pthread_mutex_unlock(&fs->async_lock);
+
+	// with a callback the worker frees the request; the caller gets nothing to wait on
+	return done ? NULL : f;
+}
+
+struct fs_future *fs_read_async_r(struct fs *fs, int inumber, unsigned char *data, int length, int offset, fs_callback done, void *arg)
+{
+	/**
+	Queue a read of length bytes at offset into data, which must stay valid
+	until the request completes. The result is what fs_read would return.
+	**/
+	return async_submit(fs, 0, inumber, data, length, offset, done, arg);
+}
+
+struct fs_future *fs_write_async_r(struct fs *fs, int inumber, const unsigned char *data, int length, int offset, fs_callback done, void *arg)
+{
+	/**
+	Queue a write of length bytes from data at offset. data must stay valid
+	and unchanged until the request completes. The result is what fs_write
+	would return.
+	**/
+	return async_submit(fs, 1, inumber, (unsigned char *)data, length, offset, done, arg);
+}
+
+int fs_future_ready(struct fs_future *f)
+{
+	struct fs *fs = f->fs;
+	pthread_mutex_lock(&fs->async_lock);
+	int ready = f->ready;
+	pthread_mutex_unlock(&fs->async_lock);
+	return ready;
+}
+
+int fs_future_wait(struct fs_future *f)
+{
+	/**
+	Wait for the request behind f, release f and return its result.
+	**/
+	struct fs *fs = f->fs;
+	pthread_mutex_lock(&fs->async_lock);
+	while (!f->ready)
+		pthread_cond_wait(&fs->async_done, &fs->async_lock);
+	pthread_mutex_unlock(&fs->async_lock);
+	int result = f->result;
+	free(f->results);
+	free(f);
+	return result;
+}
+
+struct fs *fs_new(struct disk *d)
+{
+	/**
+	Make an unmounted filesystem context working on disk d. Returns null
+	when out of memory.
+	**/
+	struct fs *fs = calloc(1, sizeof(*fs));
+	if (!fs)
+	{
+		return NULL;
+	}
+	fs->disk = d;
+	fs->block_size = MIN_BLOCK_SIZE;
+	fs->block_shift = 12;
+	pthread_mutex_init(&fs->map_lock, NULL);
+	pthread_mutex_init(&fs->buffer_lock, NULL);
+	pthread_mutex_init(&fs->async_lock, NULL);
+	pthread_cond_init(&fs->async_work, NULL);
+	pthread_cond_init(&fs->async_space, NULL);
+	pthread_cond_init(&fs->async_done, NULL);
+	pthread_rwlock_init(&fs->fs_lock, NULL);
+	return fs;
+}
+
+void fs_free(struct fs *fs)
+{
+	/**
+	Stop the context's async workers, unmount it and release it. The disk
+	stays open.
+	**/
+	if (fs->async_threads)
+	{
+		fs_async_stop_r(fs);
+	}
+	fs_unmount_r(fs);
+	while (fs->nspare_buffers)
+		free(fs->spare_buffers[--fs->nspare_buffers]);
+	pthread_mutex_destroy(&fs->map_lock);
+	pthread_mutex_destroy(&fs->buffer_lock);
+	pthread_mutex_destroy(&fs->async_lock);
+	pthread_cond_destroy(&fs->async_work);
+	pthread_cond_destroy(&fs->async_space);
+	pthread_cond_destroy(&fs->async_done);
+	pthread_rwlock_destroy(&fs->fs_lock);
+	free(fs);
+}
+
+// The original interface works on one default context bound to thedisk.
+// thedisk is weak so programs that only use contexts need not define it.
+extern struct disk *thedisk __attribute__((weak));
+struct fs *default_fs = NULL;
+
+static struct fs *fs_default()
+{
+	if (!default_fs)
+	{
+		default_fs = fs_new(thedisk);
+		if (!default_fs)
+		{
+			exit(1);
+		}
+	}
+	// programs may close thedisk and open another between mounts; store
+	// only on a change, since async workers read fs->disk meanwhile
+	if (default_fs->disk != thedisk)
+	{
+		default_fs->disk = thedisk;
+	}
+	return default_fs;
+}
+
+int fs_format(int flags, int block_size)
+{
+	return fs_format_r(fs_default(), flags, block_size);
+}
+
+void fs_debug()
+{
+	fs_debug_r(fs_default());
+}
+
+int fs_stat_all(int *next, const struct fs_stat_filter *filter, struct fs_stat *records, int max)
+{
+	return fs_stat_all_r(fs_default(), next, filter, records, max);
+}
+
+int fs_mount()
+{
+	return fs_mount_r(fs_default());
+}
+
+void fs_unmount()
+{
+	fs_unmount_r(fs_default());
+}
+
+int fs_zero_inodes(int count)
+{
+	return fs_zero_inodes_r(fs_default(), count);
+}
+
+int fs_build(int flags, int block_size, int nfiles, const int *sizes, fs_fill fill, void *arg)
+{
+	return fs_build_r(fs_default(), flags, block_size, nfiles, sizes, fill, arg);
+}
+
+int fs_create()
+{
+	return fs_create_r(fs_default());
+}
+
+int fs_delete(int inumber)
+{
+	return fs_delete_r(fs_default(), inumber);
+}
+
+int fs_getsize(int inumber)
+{
+	return fs_getsize_r(fs_default(), inumber);
+}
+
+int fs_read(int inumber, unsigned char *data, int length, int offset)
+{
+	return fs_read_r(fs_default(), inumber, data, length, offset);
+}
+
+int fs_write(int inumber, const unsigned char *data, int length, int offset)
+{
+	return fs_write_r(fs_default(), inumber, data, length, offset);
+}
+
+int fs_fallocate(int inumber, int offset, int length)
+{
+	return fs_fallocate_r(fs_default(), inumber, offset, length);
+}
+
+int fs_seek(int inumber, int offset, int whence)
+{
+	return fs_seek_r(fs_default(), inumber, offset, whence);
+}
+
+int fs_fragments(int inumber)
+{
+	return fs_fragments_r(fs_default(), inumber);
+}
+
+int fs_defrag(int *inumber, int budget)
+{
+	return fs_defrag_r(fs_default(), inumber, budget);
+}
+
+int fs_clean(int budget)
+{
+	return fs_clean_r(fs_default(), budget);
+}
+
+int fs_sync()
+{
+	return fs_sync_r(fs_default());
+}
+
+int fs_root()
+{
+	return fs_root_r(fs_default());
+}
+
+int fs_namei(const char *path)
+{
+	return fs_namei_r(fs_default(), path);
+}
+
+int fs_lookup(int dir, const char *name)
+{
+	return fs_lookup_r(fs_default(), dir, name);
+}
+
+int fs_link(int dir, const char *name, int inumber)
+{
+	return fs_link_r(fs_default(), dir, name, inumber);
+}
+
+int fs_unlink(int dir, const char *name)
+{
+	return fs_unlink_r(fs_default(), dir, name);
+}
+
+int fs_mkdir(int dir, const char *name)
+{
+	return fs_mkdir_r(fs_default(), dir, name);
+}
+
+int fs_readdir(int dir, void (*fn)(const char *name, int inumber, void *arg), void *arg)
+{
+	return fs_readdir_r(fs_default(), dir, fn, arg);
+}
+
+int fs_snapshot()
+{
+	return fs_snapshot_r(fs_default());
+}
+
+int fs_snapshot_delete(int id)
+{
+	return fs_snapshot_delete_r(fs_default(), id);
+}
+
+int fs_snapshot_list(void (*fn)(int id, long ctime, void *arg), void *arg)
+{
+	return fs_snapshot_list_r(fs_default(), fn, arg);
+}
+
+int fs_mount_snapshot(int id)
+{
+	return fs_mount_snapshot_r(fs_default(), id);
+}
+
+int fs_mount_shared(const char *name)
+{
+	return fs_mount_shared_r(fs_default(), name);
+}
+
+int fs_async_start(int nthreads, int max_in_flight)
+{
+	return fs_async_start_r(fs_default(), nthreads, max_in_flight);
+}
+
+void fs_async_stop()
+{
+	fs_async_stop_r(fs_default());
+}
+
+void fs_async_drain()
+{
+	fs_async_drain_r(fs_default());
+}
+
+struct fs_future *fs_read_async(int inumber, unsigned char *data, int length, int offset, fs_callback done, void *arg)
+{
+	return fs_read_async_r(fs_default(), inumber, data, length, offset, done, arg);
+}
+
+struct fs_future *fs_write_async(int inumber, const unsigned char *data, int length, int offset, fs_callback done, void *arg)
+{
+	return fs_write_async_r(fs_default(), inumber, data, length, offset, done, arg);
+}
@@ -1,9 +1,55 @@
 #ifndef FS_H
 #define FS_H
 
-int  fs_format();
+// Options for fs_format, recorded in the superblock.
+#define FS_FORMAT_DEDUP 0x1	// share identical full blocks between files
+#define FS_FORMAT_WIDE_INODES 0x2	// 256-byte inodes that hold small files inline
+#define FS_FORMAT_SNAPSHOTS 0x4	// keep reference counts so snapshots can share blocks
+#define FS_FORMAT_GROUPS 0x8	// block groups: inodes, bitmap and data kept close together
+#define FS_FORMAT_LOG 0x10	// log-structured: every write appends to a segment log
+
+// What fs_seek looks for.
+#define FS_SEEK_DATA 0
+#define FS_SEEK_HOLE 1
+
+// One inode as fs_stat_all reports it. blocks counts the blocks the size
+// spans, holes included, plus the indirect block; inline files have none.
+struct fs_stat
+{
+	int inumber;
+	int size;
+	int blocks;
+	int flags;	// FS_STAT_* bits
+	long ctime;
+};
+#define FS_STAT_DIR 0x1	// a directory, or part of a large one
+#define FS_STAT_INLINE 0x2	// contents held in the inode slot
+
+// Which inodes fs_stat_all reports; a zero field matches everything.
+struct fs_stat_filter
+{
+	int min_size;	// at least this many bytes
+	int max_size;	// at most this many bytes
+	long min_ctime;	// created at or after this time
+	long max_ctime;	// created before this time
+	int flags;	// has all of these FS_STAT_* bits
+};
+
+int  fs_format( int flags, int block_size );
 void fs_debug();
+int  fs_stat_all( int *next, const struct fs_stat_filter *filter, struct fs_stat *records, int max );
 int  fs_mount();
+void fs_unmount();
+int  fs_zero_inodes( int count );
+
+// Offline image building: fs_build formats the disk and writes a whole set
+// of files in one pass. fill(file, data, length, offset, arg) copies
+// length bytes of that file, starting at offset, into data and returns how
+// many it copied. fs_max_file_size gives the largest file a build with
+// that block size (zero for the default) accepts.
+typedef int (*fs_fill)( int file, unsigned char *data, int length, int offset, void *arg );
+int  fs_build( int flags, int block_size, int nfiles, const int *sizes, fs_fill fill, void *arg );
+int  fs_max_file_size( int block_size );
 
 int  fs_create();
 int  fs_delete( int inumber );
@@ -11,5 +57,100 @@ int  fs_getsize();
 
 int  fs_read( int inumber,  unsigned char *data, int length, int offset );
 int  fs_write( int inumber, const unsigned  char *data, int length, int offset );
+int  fs_fallocate( int inumber, int offset, int length );
+int  fs_seek( int inumber, int offset, int whence );
+
+int  fs_fragments( int inumber );
+int  fs_defrag( int *inumber, int budget );
+int  fs_clean( int budget );
+int  fs_sync();
+
+int  fs_root();
+int  fs_namei( const char *path );
+int  fs_lookup( int dir, const char *name );
+int  fs_link( int dir, const char *name, int inumber );
+int  fs_unlink( int dir, const char *name );
+int  fs_mkdir( int dir, const char *name );
+int  fs_readdir( int dir, void (*fn)( const char *name, int inumber, void *arg ), void *arg );
+
+int  fs_snapshot();
+int  fs_snapshot_delete( int id );
+int  fs_snapshot_list( void (*fn)( int id, long ctime, void *arg ), void *arg );
+int  fs_mount_snapshot( int id );
+
+// Shared read-only mounts: the mount state and caches live in the POSIX
+// shared-memory object name, built by the first process to mount and
+// attached by every later one. The image must not change meanwhile.
+int  fs_mount_shared( const char *name );
+int  fs_shared_remove( const char *name );
+
+// Asynchronous reads and writes, carried out by a pool of worker threads.
+// A request completes exactly once: through done(result, arg), called on a
+// worker thread, or, when done is null, through the returned future.
+// While requests are in flight no other fs_* call may run; fs_async_drain
+// waits for all of them, callbacks included.
+typedef void (*fs_callback)( int result, void *arg );
+struct fs_future;
+
+int  fs_async_start( int nthreads, int max_in_flight );
+void fs_async_stop();
+void fs_async_drain();
+struct fs_future * fs_read_async( int inumber, unsigned char *data, int length, int offset, fs_callback done, void *arg );
+struct fs_future * fs_write_async( int inumber, const unsigned char *data, int length, int offset, fs_callback done, void *arg );
+int  fs_future_ready( struct fs_future *f );
+int  fs_future_wait( struct fs_future *f );
+
+// Filesystem contexts. All the state of a filesystem lives in a struct fs,
+// so one process can work on many images at once, each from its own
+// thread. fs_new makes a context for a disk and fs_free unmounts and
+// releases it. The *_r calls are the calls above on an explicit context;
+// the calls above use a default context on the program's thedisk.
+struct fs;
+struct disk;
+
+struct fs * fs_new( struct disk *d );
+void fs_free( struct fs *fs );
+
+int  fs_format_r( struct fs *fs, int flags, int block_size );
+void fs_debug_r( struct fs *fs );
+int  fs_stat_all_r( struct fs *fs, int *next, const struct fs_stat_filter *filter, struct fs_stat *records, int max );
+int  fs_mount_r( struct fs *fs );
+void fs_unmount_r( struct fs *fs );
+int  fs_zero_inodes_r( struct fs *fs, int count );
+int  fs_build_r( struct fs *fs, int flags, int block_size, int nfiles, const int *sizes, fs_fill fill, void *arg );
+
+int  fs_create_r( struct fs *fs );
+int  fs_delete_r( struct fs *fs, int inumber );
+int  fs_getsize_r( struct fs *fs, int inumber );
+
+int  fs_read_r( struct fs *fs, int inumber, unsigned char *data, int length, int offset );
+int  fs_write_r( struct fs *fs, int inumber, const unsigned char *data, int length, int offset );
+int  fs_fallocate_r( struct fs *fs, int inumber, int offset, int length );
+int  fs_seek_r( struct fs *fs, int inumber, int offset, int whence );
+
+int  fs_fragments_r( struct fs *fs, int inumber );
+int  fs_defrag_r( struct fs *fs, int *inumber, int budget );
+int  fs_clean_r( struct fs *fs, int budget );
+int  fs_sync_r( struct fs *fs );
+
+int  fs_root_r( struct fs *fs );
+int  fs_namei_r( struct fs *fs, const char *path );
+int  fs_lookup_r( struct fs *fs, int dir, const char *name );
+int  fs_link_r( struct fs *fs, int dir, const char *name, int inumber );
+int  fs_unlink_r( struct fs *fs, int dir, const char *name );
+int  fs_mkdir_r( struct fs *fs, int dir, const char *name );
+int  fs_readdir_r( struct fs *fs, int dir, void (*fn)( const char *name, int inumber, void *arg ), void *arg );
+
+int  fs_snapshot_r( struct fs *fs );
+int  fs_snapshot_delete_r( struct fs *fs, int id );
+int  fs_snapshot_list_r( struct fs *fs, void (*fn)( int id, long ctime, void *arg ), void *arg );
+int  fs_mount_snapshot_r( struct fs *fs, int id );
+int  fs_mount_shared_r( struct fs *fs, const char *name );
+
+int  fs_async_start_r( struct fs *fs, int nthreads, int max_in_flight );
+void fs_async_stop_r( struct fs *fs );
+void fs_async_drain_r( struct fs *fs );
+struct fs_future * fs_read_async_r( struct fs *fs, int inumber, unsigned char *data, int length, int offset, fs_callback done, void *arg );
+struct fs_future * fs_write_async_r( struct fs *fs, int inumber, const unsigned char *data, int length, int offset, fs_callback done, void *arg );
 
 #endif
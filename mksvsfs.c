@@ -0,0 +1,330 @@
+/* mksvsfs: build an SVSFS image from host files in one pass.
+ * Every path on the command line is loaded into the root directory: a
+ * file under its own name, a directory as its whole tree of files and
+ * subdirectories. The sizes are gathered first, so fs_build can lay all
+ * of the data out in advance and write it sequentially in large runs;
+ * the names are then entered through the ordinary directory calls.
+ */
+#define _GNU_SOURCE
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// One file or directory to load, in the order they are entered.
+struct entry
+{
+	char *host;
+	char *name;
+	int parent; // index of the directory entry it goes in, or -1 for the root
+	int is_dir;
+	int size;
+	int inumber;
+};
+
+struct source
+{
+	struct entry *entries;
+	int nentries, cap;
+	int *files; // fs_build's file i is entries[files[i]]
+	int current; // the file open on fd, or -1
+	int fd;
+};
+
+static int add_entry(struct source *s, const char *host, const char *name, int parent);
+static int add_tree(struct source *s, const char *host, int parent);
+static int fill(int file, unsigned char *data, int length, int offset, void *arg);
+static int compare_names(const void *a, const void *b);
+static double now();
+
+struct disk *thedisk = 0;
+static int max_file_size; // the largest file the chosen block size allows
+
+int main(int argc, char *argv[])
+{
+	// mksvsfs [-d] [-p] [-b <block size>] [-o <option>]... <diskfile> <nblocks> <path>...
+	int disk_flags = 0;
+	int flags = 0;
+	int block_size = 0;
+	int first = 1;
+	while (argc - first > 3 && argv[first][0] == '-')
+	{
+		if (!strcmp(argv[first], "-d"))
+		{
+			disk_flags |= DISK_DIRECT;
+			first++;
+		}
+		else if (!strcmp(argv[first], "-p"))
+		{
+			disk_flags |= DISK_SPARSE;
+			first++;
+		}
+		else if (!strcmp(argv[first], "-b"))
+		{
+			block_size = atoi(argv[first + 1]);
+			first += 2;
+		}
+		else if (!strcmp(argv[first], "-o") && !strcmp(argv[first + 1], "wide"))
+		{
+			flags |= FS_FORMAT_WIDE_INODES;
+			first += 2;
+		}
+		else if (!strcmp(argv[first], "-o") && !strcmp(argv[first + 1], "dedup"))
+		{
+			flags |= FS_FORMAT_DEDUP;
+			first += 2;
+		}
+		else if (!strcmp(argv[first], "-o") && !strcmp(argv[first + 1], "snapshots"))
+		{
+			flags |= FS_FORMAT_SNAPSHOTS;
+			first += 2;
+		}
+		else
+			break;
+	}
+	if (argc - first < 3)
+	{
+		printf("use: %s [-d] [-p] [-b <block size>] [-o wide|dedup|snapshots]... <diskfile> <nblocks> <path>...\n", argv[0]);
+		printf("formats the disk and loads every path into the root directory:\n");
+		printf("a file under its own name, a directory as everything inside it\n");
+		printf("-d opens the disk with O_DIRECT, bypassing the host's page cache\n");
+		printf("-p gives back to the host whatever the image held before\n");
+		return 1;
+	}
+
+	max_file_size = fs_max_file_size(block_size);
+	struct source s;
+	memset(&s, 0, sizeof(s));
+	s.current = -1;
+	s.fd = -1;
+	for (int i = first + 2; i < argc; i++)
+	{
+		// a directory named on the command line is loaded even through a symlink
+		struct stat st;
+		if (stat(argv[i], &st) < 0)
+		{
+			printf("couldn't open %s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+		char *copy = strdup(argv[i]);
+		if (!copy || !(S_ISDIR(st.st_mode) ? add_tree(&s, argv[i], -1) : add_entry(&s, argv[i], basename(copy), -1)))
+		{
+			return 1;
+		}
+		free(copy);
+	}
+
+	int nfiles = 0;
+	long long bytes = 0;
+	int *sizes = malloc((s.nentries + 1) * sizeof(int));
+	s.files = malloc((s.nentries + 1) * sizeof(int));
+	if (!sizes || !s.files)
+	{
+		return 1;
+	}
+	for (int i = 0; i < s.nentries; i++)
+	{
+		if (s.entries[i].is_dir)
+			continue;
+		s.entries[i].inumber = nfiles + 1;
+		s.files[nfiles] = i;
+		sizes[nfiles++] = s.entries[i].size;
+		bytes += s.entries[i].size;
+	}
+
+	thedisk = disk_open_flags((const char **)&argv[first], 1, atoi(argv[first + 1]), 0, disk_flags);
+	if (!thedisk)
+	{
+		printf("couldn't open %s: %s\n", argv[first], strerror(errno));
+		return 1;
+	}
+
+	double start = now();
+	if (!fs_build(flags, block_size, nfiles, sizes, fill, &s))
+	{
+		printf("couldn't build %s\n", argv[first]);
+		return 1;
+	}
+	if (s.fd >= 0)
+	{
+		close(s.fd);
+	}
+	double built = now() - start;
+
+	// parents come before their contents, so every directory exists by the time it is needed
+	if (!fs_mount() || !fs_root())
+	{
+		printf("couldn't mount %s\n", argv[first]);
+		return 1;
+	}
+	int ndirs = 0;
+	for (int i = 0; i < s.nentries; i++)
+	{
+		struct entry *e = &s.entries[i];
+		int dir = e->parent < 0 ? fs_root() : s.entries[e->parent].inumber;
+		int ok = e->is_dir ? (e->inumber = fs_mkdir(dir, e->name)) != 0 : fs_link(dir, e->name, e->inumber);
+		if (!ok)
+		{
+			printf("couldn't enter %s as %s\n", e->host, e->name);
+			return 1;
+		}
+		ndirs += e->is_dir;
+	}
+	fs_unmount();
+	disk_close(thedisk);
+
+	double elapsed = now() - start;
+	printf("%d files and %d directories, %lld bytes\n", nfiles, ndirs, bytes);
+	printf("data written in %.3f seconds (%.1f MB/s), names entered in %.3f\n", built,
+		   bytes / 1048576.0 / (built > 0 ? built : 1e-9), elapsed - built);
+	return 0;
+}
+
+static int add_entry(struct source *s, const char *host, const char *name, int parent)
+{
+	// symlinks to files are loaded as the file; symlinks to directories are
+	// skipped, since following them could walk a cycle forever
+	struct stat st;
+	if (lstat(host, &st) < 0)
+	{
+		printf("couldn't open %s: %s\n", host, strerror(errno));
+		return 0;
+	}
+	if (S_ISLNK(st.st_mode))
+	{
+		if (stat(host, &st) < 0 || S_ISDIR(st.st_mode))
+		{
+			printf("skipping %s: symlink to a directory or to nothing\n", host);
+			return 1;
+		}
+	}
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+	{
+		printf("skipping %s: not a file or directory\n", host);
+		return 1;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > max_file_size)
+	{
+		printf("%s is too large: files hold at most %d bytes\n", host, max_file_size);
+		return 0;
+	}
+	if (s->nentries == s->cap)
+	{
+		s->cap = s->cap ? 2 * s->cap : 64;
+		s->entries = realloc(s->entries, s->cap * sizeof(struct entry));
+		if (!s->entries)
+		{
+			return 0;
+		}
+	}
+	struct entry *e = &s->entries[s->nentries++];
+	e->host = strdup(host);
+	e->name = strdup(name);
+	e->parent = parent;
+	e->is_dir = S_ISDIR(st.st_mode);
+	e->size = e->is_dir ? 0 : st.st_size;
+	e->inumber = 0;
+	return e->host && e->name && (!e->is_dir || add_tree(s, host, s->nentries - 1));
+}
+
+// Add everything inside the host directory, in name order, so the files of
+// one directory end up next to each other on the disk.
+static int add_tree(struct source *s, const char *host, int parent)
+{
+	DIR *d = opendir(host);
+	if (!d)
+	{
+		printf("couldn't open %s: %s\n", host, strerror(errno));
+		return 0;
+	}
+	char **names = 0;
+	int n = 0, cap = 0;
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (n == cap)
+		{
+			cap = cap ? 2 * cap : 16;
+			names = realloc(names, cap * sizeof(char *));
+			if (!names)
+			{
+				return 0;
+			}
+		}
+		names[n++] = strdup(de->d_name);
+	}
+	closedir(d);
+	qsort(names, n, sizeof(char *), compare_names);
+
+	int ok = 1;
+	for (int i = 0; i < n; i++)
+	{
+		char *path = 0;
+		if (ok && asprintf(&path, "%s/%s", host, names[i]) < 0)
+		{
+			ok = 0;
+		}
+		else if (ok)
+		{
+			ok = add_entry(s, path, names[i], parent);
+		}
+		free(path);
+		free(names[i]);
+	}
+	free(names);
+	return ok;
+}
+
+// Hand fs_build the next piece of a file, opening it the first time.
+static int fill(int file, unsigned char *data, int length, int offset, void *arg)
+{
+	struct source *s = arg;
+	if (file != s->current)
+	{
+		if (s->fd >= 0)
+			close(s->fd);
+		s->current = file;
+		s->fd = open(s->entries[s->files[file]].host, O_RDONLY);
+		if (s->fd < 0)
+		{
+			printf("couldn't open %s: %s\n", s->entries[s->files[file]].host, strerror(errno));
+			return 0;
+		}
+	}
+	int done = 0;
+	while (done < length)
+	{
+		ssize_t n = pread(s->fd, data + done, length - done, offset + done);
+		if (n <= 0)
+		{
+			printf("%s changed while it was being read\n", s->entries[s->files[file]].host);
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
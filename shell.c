@@ -9,9 +9,30 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 static int do_copyin(const char *filename, int inumber);
 static int do_copyout(int inumber, const char *filename);
+static int format_options(char *line, int *flags, int *size);
+static int split_path(const char *path, char *name);
+static void print_dirent(const char *name, int inumber, void *arg);
+static void print_snapshot(int id, long ctime, void *arg);
+static int list_inodes(int json, int min_size);
+
+// copyin and copyout move data through this many buffers of this size
+#define COPY_SLOTS 4
+#define COPY_CHUNK (1 << 20)
+
+// defrag moves about this many blocks at a time, then waits (microseconds)
+#define DEFRAG_STEP 256
+#define DEFRAG_PAUSE 1000
+
+// clean copies about this many live blocks at a time, pausing the same way
+#define CLEAN_STEP 256
 
 struct disk *thedisk = 0;
 
@@ -21,22 +42,60 @@ int main(int argc, char *argv[])
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
 	int inumber, result, args;
 
-	if (argc != 3)
+	// svsfs [-d] [-p] [-s <stripe bytes>] <diskfile>... <nblocks>
+	int stripe_unit = 65536;
+	int flags = 0;
+	int first = 1;
+	while (argc - first > 2)
 	{
-		printf("use: %s <diskfile> <nblocks>\n", argv[0]);
+		if (!strcmp(argv[first], "-d"))
+		{
+			flags |= DISK_DIRECT;
+			first++;
+		}
+		else if (!strcmp(argv[first], "-p"))
+		{
+			flags |= DISK_SPARSE;
+			first++;
+		}
+		else if (!strcmp(argv[first], "-s"))
+		{
+			stripe_unit = atoi(argv[first + 1]);
+			first += 2;
+		}
+		else
+			break;
+	}
+
+	if (argc - first < 2)
+	{
+		printf("use: %s [-d] [-p] [-s <stripe bytes>] <diskfile>... <nblocks>\n", argv[0]);
+		printf("nblocks counts 4K units, whatever block size the disk is formatted with\n");
+		printf("several diskfiles are striped together; nblocks is their combined size\n");
+		printf("-d opens them with O_DIRECT, bypassing the host's page cache\n");
+		printf("-p gives freed blocks back to the host by punching holes in them\n");
 		return 1;
 	}
 
-	thedisk = disk_open(argv[1], atoi(argv[2]));
+	int nfiles = argc - first - 1;
+	thedisk = disk_open_flags((const char **)&argv[first], nfiles, atoi(argv[argc - 1]), stripe_unit, flags);
 	if (!thedisk)
 	{
-		printf("couldn't open %s: %s\n", argv[1], strerror(errno));
+		printf("couldn't open %s: %s\n", argv[first], strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n", argv[1], disk_nblocks(thedisk));
+	if (nfiles == 1)
+	{
+		printf("opened emulated disk image %s with %d blocks\n", argv[first], disk_nblocks(thedisk));
+	}
+	else
+	{
+		printf("opened %d striped disk images with %d blocks\n", nfiles, disk_nblocks(thedisk));
+	}
 
 	while (1)
 	{
@@ -50,15 +109,16 @@ int main(int argc, char *argv[])
 			continue;
 		line[strlen(line) - 1] = 0;
 
-		args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
+		args = sscanf(line, "%s %s %s %s", cmd, arg1, arg2, arg3);
 		if (args == 0)
 			continue;
 
 		if (!strcmp(cmd, "format"))
 		{
-			if (args == 1)
+			int flags, size;
+			if (format_options(line, &flags, &size))
 			{
-				if (fs_format())
+				if (fs_format(flags, size))
 				{
 					printf("disk formatted.\n");
 				}
@@ -69,16 +129,16 @@ int main(int argc, char *argv[])
 			}
 			else
 			{
-				printf("use: format\n");
+				printf("use: format [dedup] [wide] [snapshots] [groups] [log] [blocksize]\n");
 			}
 		}
 		else if (!strcmp(cmd, "mount"))
 		{
-			if (args == 1)
+			if (args == 1 || (args == 3 && !strcmp(arg1, "shared")))
 			{
-				if (fs_mount())
+				if (args == 1 ? fs_mount() : fs_mount_shared(arg2))
 				{
-					printf("disk mounted.\n");
+					printf(args == 1 ? "disk mounted.\n" : "disk mounted read-only, shared.\n");
 				}
 				else
 				{
@@ -87,7 +147,44 @@ int main(int argc, char *argv[])
 			}
 			else
 			{
-				printf("use: mount\n");
+				printf("use: mount [shared <name>]\n");
+			}
+		}
+		else if (!strcmp(cmd, "unshare"))
+		{
+			if (args == 2)
+			{
+				if (fs_shared_remove(arg1))
+				{
+					printf("shared segment %s removed.\n", arg1);
+				}
+				else
+				{
+					printf("unshare failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: unshare <name>\n");
+			}
+		}
+		else if (!strcmp(cmd, "zeroinodes"))
+		{
+			if (args <= 2)
+			{
+				result = fs_zero_inodes(args == 2 ? atoi(arg1) : INT_MAX);
+				if (result >= 0)
+				{
+					printf("%d inode blocks left to initialize\n", result);
+				}
+				else
+				{
+					printf("zeroinodes failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: zeroinodes [blocks]\n");
 			}
 		}
 		else if (!strcmp(cmd, "debug"))
@@ -159,6 +256,25 @@ int main(int argc, char *argv[])
 				printf("use: delete <inumber>\n");
 			}
 		}
+		else if (!strcmp(cmd, "fallocate"))
+		{
+			if (args == 4)
+			{
+				inumber = atoi(arg1);
+				if (fs_fallocate(inumber, atoi(arg2), atoi(arg3)))
+				{
+					printf("reserved %s bytes at %s in inode %d\n", arg3, arg2, inumber);
+				}
+				else
+				{
+					printf("fallocate failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: fallocate <inumber> <offset> <length>\n");
+			}
+		}
 		else if (!strcmp(cmd, "cat"))
 		{
 			if (args == 2)
@@ -212,18 +328,251 @@ int main(int argc, char *argv[])
 				printf("use: copyout <inumber> <filename>\n");
 			}
 		}
+		else if (!strcmp(cmd, "ls"))
+		{
+			if (args >= 2 && args <= 3 && (!strcmp(arg1, "-a") || !strcmp(arg1, "-j")))
+			{
+				if (!list_inodes(arg1[1] == 'j', args == 3 ? atoi(arg2) : 0))
+				{
+					printf("ls failed!\n");
+				}
+			}
+			else if (args <= 2)
+			{
+				inumber = fs_namei(args == 2 ? arg1 : "/");
+				if (!inumber || fs_readdir(inumber, print_dirent, 0) < 0)
+				{
+					printf("ls failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: ls [path] | ls -a [min size] | ls -j [min size]\n");
+			}
+		}
+		else if (!strcmp(cmd, "lookup"))
+		{
+			if (args == 2)
+			{
+				inumber = fs_namei(arg1);
+				if (inumber)
+				{
+					printf("%s is inode %d\n", arg1, inumber);
+				}
+				else
+				{
+					printf("lookup failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: lookup <path>\n");
+			}
+		}
+		else if (!strcmp(cmd, "mkdir"))
+		{
+			if (args == 2)
+			{
+				char name[1024];
+				int dir = split_path(arg1, name);
+				inumber = dir ? fs_mkdir(dir, name) : 0;
+				if (inumber)
+				{
+					printf("created directory %s as inode %d\n", arg1, inumber);
+				}
+				else
+				{
+					printf("mkdir failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: mkdir <path>\n");
+			}
+		}
+		else if (!strcmp(cmd, "link"))
+		{
+			if (args == 3)
+			{
+				char name[1024];
+				int dir = split_path(arg1, name);
+				inumber = atoi(arg2);
+				if (dir && fs_link(dir, name, inumber))
+				{
+					printf("linked %s to inode %d\n", arg1, inumber);
+				}
+				else
+				{
+					printf("link failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: link <path> <inumber>\n");
+			}
+		}
+		else if (!strcmp(cmd, "unlink"))
+		{
+			if (args == 2)
+			{
+				char name[1024];
+				int dir = split_path(arg1, name);
+				if (dir && fs_unlink(dir, name))
+				{
+					printf("unlinked %s\n", arg1);
+				}
+				else
+				{
+					printf("unlink failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: unlink <path>\n");
+			}
+		}
+		else if (!strcmp(cmd, "fragments"))
+		{
+			if (args == 2)
+			{
+				inumber = atoi(arg1);
+				result = fs_fragments(inumber);
+				if (result >= 0)
+				{
+					printf("inode %d is in %d pieces\n", inumber, result);
+				}
+				else
+				{
+					printf("fragments failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: fragments <inumber>\n");
+			}
+		}
+		else if (!strcmp(cmd, "defrag"))
+		{
+			if (args == 1)
+			{
+				// small steps with a pause between them leave the disk to other users
+				int next = 1, moved = 0;
+				do
+				{
+					result = fs_defrag(&next, DEFRAG_STEP);
+					if (result < 0)
+						break;
+					moved += result;
+					if (next)
+						usleep(DEFRAG_PAUSE);
+				} while (next);
+				if (result >= 0)
+				{
+					printf("defragmented: %d blocks moved\n", moved);
+				}
+				else
+				{
+					printf("defrag failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: defrag\n");
+			}
+		}
+		else if (!strcmp(cmd, "clean"))
+		{
+			if (args == 1)
+			{
+				int freed = 0;
+				while ((result = fs_clean(CLEAN_STEP)) > 0)
+				{
+					freed += result;
+					usleep(DEFRAG_PAUSE);
+				}
+				if (result >= 0)
+				{
+					printf("cleaned: %d segments freed\n", freed);
+				}
+				else
+				{
+					printf("clean failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: clean\n");
+			}
+		}
+		else if (!strcmp(cmd, "snapshot"))
+		{
+			if (args == 1)
+			{
+				result = fs_snapshot();
+				if (result)
+				{
+					printf("created snapshot %d\n", result);
+				}
+				else
+				{
+					printf("snapshot failed!\n");
+				}
+			}
+			else if (args == 2 && !strcmp(arg1, "list"))
+			{
+				fs_snapshot_list(print_snapshot, 0);
+			}
+			else if (args == 3 && !strcmp(arg1, "delete"))
+			{
+				if (fs_snapshot_delete(atoi(arg2)))
+				{
+					printf("snapshot %d deleted.\n", atoi(arg2));
+				}
+				else
+				{
+					printf("delete failed!\n");
+				}
+			}
+			else if (args == 3 && !strcmp(arg1, "mount"))
+			{
+				if (fs_mount_snapshot(atoi(arg2)))
+				{
+					printf("snapshot %d mounted read-only.\n", atoi(arg2));
+				}
+				else
+				{
+					printf("mount failed!\n");
+				}
+			}
+			else
+			{
+				printf("use: snapshot [list | delete <id> | mount <id>]\n");
+			}
+		}
 		else if (!strcmp(cmd, "help"))
 		{
 			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
+			printf("    format  [dedup] [wide] [snapshots] [groups] [log] [blocksize]\n");
+			printf("    mount   [shared <name>]\n");
+			printf("    unshare <name>\n");
+			printf("    zeroinodes [blocks]\n");
 			printf("    debug\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
 			printf("    getsize <inode>\n");
+			printf("    fallocate <inode> <offset> <length>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    ls      [path] | -a [min size] | -j [min size]\n");
+			printf("    lookup  <path>\n");
+			printf("    mkdir   <path>\n");
+			printf("    link    <path> <inode>\n");
+			printf("    unlink  <path>\n");
+			printf("    fragments <inode>\n");
+			printf("    defrag\n");
+			printf("    clean\n");
+			printf("    snapshot [list | delete <id> | mount <id>]\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -244,60 +593,246 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// the log layout takes its checkpoint here
+	fs_unmount();
 	printf("closing emulated disk.\n");
 	disk_close(thedisk);
 
 	return 0;
 }
 
-static int do_copyin(const char *filename, int inumber)
+// One copy between a host file and an inode. A reader thread fills the
+// slots of a ring of COPY_SLOTS buffers and a writer thread empties them in
+// order, so host-side stdio and image-side fs calls overlap. filled and
+// drained count slots; the ring is full when they differ by COPY_SLOTS.
+struct copy_pipe
 {
+	int copyin; // host file -> inode, else inode -> host file
 	FILE *file;
-	int offset = 0, result, actual;
-	unsigned char buffer[16384];
+	int inumber;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	unsigned char *slot[COPY_SLOTS];
+	int length[COPY_SLOTS];
+	int hole[COPY_SLOTS]; // the slot stands for length bytes of zeros, skipped over
+	int sparse;			  // copyout to a regular file, which can have holes
+	long filled;
+	long drained;
+	int eof;	// the reader has nothing more
+	int failed; // the writer gave up
+	int offset; // bytes the writer has placed
+};
 
-	file = fopen(filename, "r");
-	if (!file)
-	{
-		printf("couldn't open %s: %s\n", filename, strerror(errno));
-		return 0;
-	}
+static void *copy_reader(void *arg)
+{
+	struct copy_pipe *p = arg;
+	int offset = 0;
 
 	while (1)
 	{
-		result = fread(buffer, 1, sizeof(buffer), file);
+		pthread_mutex_lock(&p->lock);
+		while (p->filled - p->drained == COPY_SLOTS && !p->failed)
+			pthread_cond_wait(&p->changed, &p->lock);
+		int failed = p->failed;
+		pthread_mutex_unlock(&p->lock);
+		if (failed)
+			break;
 
+		// the writer never touches a slot it hasn't been handed
+		int i = p->filled % COPY_SLOTS;
+		int result;
+		int hole = 0;
+		if (p->copyin)
+			result = fread(p->slot[i], 1, COPY_CHUNK, p->file);
+		else
+		{
+			// holes of the inode are never read: the writer skips over them,
+			// or writes zeros where the host file can't have holes
+			int data = fs_seek(p->inumber, offset, FS_SEEK_DATA);
+			int end = data == offset ? fs_seek(p->inumber, offset, FS_SEEK_HOLE) : data;
+			int chunk = end - offset < COPY_CHUNK ? end - offset : COPY_CHUNK;
+			hole = data > offset;
+			if (data < 0 || end < 0)
+				result = -1;
+			else if (!hole)
+				result = fs_read(p->inumber, p->slot[i], chunk, offset);
+			else if (p->sparse)
+				result = end - offset;
+			else
+			{
+				result = chunk;
+				memset(p->slot[i], 0, result);
+				hole = 0;
+			}
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if (result <= 0)
+			p->eof = 1;
+		else
+		{
+			p->length[i] = result;
+			p->hole[i] = hole;
+			p->filled++;
+			offset += result;
+		}
+		pthread_cond_broadcast(&p->changed);
+		pthread_mutex_unlock(&p->lock);
 		if (result <= 0)
 			break;
+	}
+	return 0;
+}
 
-		if (result > 0)
+static void *copy_writer(void *arg)
+{
+	struct copy_pipe *p = arg;
+
+	while (1)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (p->drained == p->filled && !p->eof)
+			pthread_cond_wait(&p->changed, &p->lock);
+		int empty = p->drained == p->filled;
+		pthread_mutex_unlock(&p->lock);
+		if (empty)
+			break;
+
+		int i = p->drained % COPY_SLOTS;
+		int ok = 1;
+		if (p->copyin)
 		{
-			actual = fs_write(inumber, buffer, result, offset);
+			int actual = fs_write(p->inumber, p->slot[i], p->length[i], p->offset);
 			if (actual < 0)
 			{
 				printf("ERROR: fs_write return invalid result %d\n", actual);
-				break;
+				ok = 0;
 			}
-			offset += actual;
-			if (actual != result)
+			else
 			{
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n", actual, result);
-				break;
+				p->offset += actual;
+				if (actual != p->length[i])
+				{
+					printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n", actual, p->length[i]);
+					ok = 0;
+				}
 			}
 		}
+		else if (p->hole[i])
+		{
+			fseek(p->file, p->length[i], SEEK_CUR);
+			p->offset += p->length[i];
+		}
+		else
+		{
+			fwrite(p->slot[i], 1, p->length[i], p->file);
+			p->offset += p->length[i];
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if (ok)
+			p->drained++;
+		else
+			p->failed = 1;
+		pthread_cond_broadcast(&p->changed);
+		pthread_mutex_unlock(&p->lock);
+		if (!ok)
+			break;
 	}
+	return 0;
+}
 
-	printf("%d bytes copied\n", offset);
+// Run a copy through the ring and report its size and rate.
+static int copy_pipeline(int copyin, FILE *file, int inumber)
+{
+	struct copy_pipe p;
+	memset(&p, 0, sizeof(p));
+	p.copyin = copyin;
+	p.file = file;
+	p.inumber = inumber;
+	struct stat st;
+	p.sparse = !copyin && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+	pthread_mutex_init(&p.lock, 0);
+	pthread_cond_init(&p.changed, 0);
+
+	int ok = 1;
+	for (int i = 0; i < COPY_SLOTS; i++)
+	{
+		// aligned so O_DIRECT disks can use them without a bounce copy
+		p.slot[i] = disk_alloc(COPY_CHUNK);
+		ok = ok && p.slot[i];
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_t reader, writer;
+	if (ok && pthread_create(&reader, 0, copy_reader, &p) == 0)
+	{
+		if (pthread_create(&writer, 0, copy_writer, &p) == 0)
+		{
+			pthread_join(writer, 0);
+		}
+		else
+		{
+			pthread_mutex_lock(&p.lock);
+			p.failed = 1;
+			pthread_cond_broadcast(&p.changed);
+			pthread_mutex_unlock(&p.lock);
+			ok = 0;
+		}
+		pthread_join(reader, 0);
+	}
+	else
+	{
+		ok = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// a hole at the end only counts once the file is that long
+	if (ok && p.sparse && (fflush(file) || ftruncate(fileno(file), p.offset)))
+	{
+		printf("couldn't extend the file: %s\n", strerror(errno));
+		ok = 0;
+	}
+
+	if (ok)
+	{
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%d bytes copied in %.3f seconds (%.1f MB/s)\n", p.offset, seconds,
+			   seconds > 0 ? p.offset / seconds / (1 << 20) : 0.0);
+	}
+	else
+	{
+		printf("couldn't start the copy\n");
+	}
+
+	for (int i = 0; i < COPY_SLOTS; i++)
+		free(p.slot[i]);
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.changed);
+	return ok;
+}
+
+static int do_copyin(const char *filename, int inumber)
+{
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (!file)
+	{
+		printf("couldn't open %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	int result = copy_pipeline(1, file, inumber);
 
 	fclose(file);
-	return 1;
+	return result;
 }
 
 static int do_copyout(int inumber, const char *filename)
 {
 	FILE *file;
-	int offset = 0, result;
-	unsigned char buffer[16384];
 
 	file = fopen(filename, "w");
 	if (!file)
@@ -306,17 +841,128 @@ static int do_copyout(int inumber, const char *filename)
 		return 0;
 	}
 
-	while (1)
+	int result = copy_pipeline(0, file, inumber);
+
+	fclose(file);
+	return result;
+}
+
+// Parse the words after "format": option names and an optional block size.
+static int format_options(char *line, int *flags, int *size)
+{
+	char *word = strtok(line, " \t");
+
+	*flags = 0;
+	*size = 0;
+	while ((word = strtok(0, " \t")))
 	{
-		result = fs_read(inumber, buffer, sizeof(buffer), offset);
-		if (result <= 0)
-			break;
-		fwrite(buffer, 1, result, file);
-		offset += result;
+		if (!strcmp(word, "dedup"))
+			*flags |= FS_FORMAT_DEDUP;
+		else if (!strcmp(word, "wide"))
+			*flags |= FS_FORMAT_WIDE_INODES;
+		else if (!strcmp(word, "snapshots"))
+			*flags |= FS_FORMAT_SNAPSHOTS;
+		else if (!strcmp(word, "groups"))
+			*flags |= FS_FORMAT_GROUPS;
+		else if (!strcmp(word, "log"))
+			*flags |= FS_FORMAT_LOG;
+		else if (atoi(word) > 0)
+			*size = atoi(word);
+		else
+		{
+			printf("unknown format option: %s\n", word);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Resolve the directory part of path and copy its last component to name.
+// Returns the directory's inumber, or zero if it does not exist.
+static int split_path(const char *path, char *name)
+{
+	char parent[1024];
+	const char *slash = strrchr(path, '/');
+
+	if (!slash)
+	{
+		strcpy(name, path);
+		return fs_root();
 	}
+	strcpy(name, slash + 1);
+	memcpy(parent, path, slash - path);
+	parent[slash - path] = 0;
+	return fs_namei(parent);
+}
 
-	printf("%d bytes copied\n", offset);
+static void print_dirent(const char *name, int inumber, void *arg)
+{
+	printf("%8d  %s\n", inumber, name);
+}
 
-	fclose(file);
-	return 1;
+static void print_snapshot(int id, long ctime, void *arg)
+{
+	char when[30];
+	time_t t = ctime;
+	strftime(when, sizeof(when), "%a %b %d %H:%M:%S %Y", localtime(&t));
+	printf("%8d  %s\n", id, when);
+}
+
+// List every inode of at least min_size bytes, as a table or as a JSON
+// array. The whole listing is built in memory and written at once, and
+// the creation time is formatted again only when it changes, which it
+// rarely does between neighbouring inodes.
+static int list_inodes(int json, int min_size)
+{
+	struct fs_stat_filter filter = {min_size, 0, 0, 0, 0};
+	struct fs_stat records[1024];
+	size_t length = 0, cap = 1 << 20;
+	char *out = malloc(cap);
+	if (!out)
+	{
+		return 0;
+	}
+	char when[30] = "";
+	long when_for = -1;
+	int next = 0, n, count = 0;
+	length += sprintf(out, json ? "[" : "%8s %10s %8s %4s  %s\n", "inode", "size", "blocks", "type", "created");
+	while ((n = fs_stat_all(&next, &filter, records, sizeof(records) / sizeof(records[0]))) > 0)
+	{
+		for (int i = 0; i < n; i++, count++)
+		{
+			if (cap - length < 256)
+			{
+				char *grown = realloc(out, cap *= 2);
+				if (!grown)
+				{
+					free(out);
+					return 0;
+				}
+				out = grown;
+			}
+			struct fs_stat *st = &records[i];
+			const char *type = st->flags & FS_STAT_DIR ? "dir" : st->flags & FS_STAT_INLINE ? "inl" : "file";
+			if (json)
+			{
+				length += sprintf(out + length, "%s\n  {\"inode\": %d, \"size\": %d, \"blocks\": %d, \"ctime\": %ld, \"type\": \"%s\"}",
+								  count ? "," : "", st->inumber, st->size, st->blocks, st->ctime, type);
+				continue;
+			}
+			if (st->ctime != when_for)
+			{
+				time_t t = when_for = st->ctime;
+				strftime(when, sizeof(when), "%a %b %d %H:%M:%S %Y", localtime(&t));
+			}
+			length += sprintf(out + length, "%8d %10d %8d %4s  %s\n", st->inumber, st->size, st->blocks, type, when);
+		}
+	}
+	if (json)
+	{
+		length += sprintf(out + length, "\n]\n");
+	}
+	fflush(stdout);
+	int ok = n == 0 && fwrite(out, 1, length, stdout) == length;
+	fflush(stdout);
+	free(out);
+	return ok;
 }
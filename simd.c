@@ -0,0 +1,315 @@
+#include "simd.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Plain C versions; the vector ones fall back to these for the tails.
+
+static int nonzero_scalar(const int *p, int n, int *out)
+{
+	int count = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (p[i])
+			out[count++] = p[i];
+	}
+	return count;
+}
+
+static int out_of_range_scalar(const int *p, int n, int lo, int hi)
+{
+	// nothing is inside an empty range
+	if (hi <= lo)
+		return n > 0 ? 0 : -1;
+	for (int i = 0; i < n; i++)
+	{
+		if ((uint32_t)(p[i] - lo) >= (uint32_t)(hi - lo))
+			return i;
+	}
+	return -1;
+}
+
+// Finish a bit search byte by byte from j, skipping bytes that are all the
+// wrong value.
+static int find_bit_tail(const unsigned char *bits, int j, int n, int set)
+{
+	unsigned char skip = set ? 0x00 : 0xff;
+	for (; j < n; j++)
+	{
+		if (!(j & 7) && j + 8 <= n && bits[j >> 3] == skip)
+		{
+			j += 7;
+			continue;
+		}
+		if (((bits[j >> 3] >> (j & 7)) & 1) == set)
+			return j;
+	}
+	return -1;
+}
+
+static int find_bit_scalar(const unsigned char *bits, int from, int n, int set)
+{
+	return find_bit_tail(bits, from, n, set);
+}
+
+// No vector unit before AVX-512 can set scattered bits, so every version
+// uses this one.
+static int scatter_bits_scalar(unsigned char *bits, int base, const int *list, int n)
+{
+	int added = 0;
+	for (int i = 0; i < n; i++)
+	{
+		int j = list[i] - base;
+		unsigned char mask = 1 << (j & 7);
+		added += !(bits[j >> 3] & mask);
+		bits[j >> 3] |= mask;
+	}
+	return added;
+}
+
+#if defined(__x86_64__)
+
+static int nonzero_sse2(const int *p, int n, int *out)
+{
+	int count = 0, i = 0;
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		int mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) & 0xf;
+		while (mask)
+		{
+			out[count++] = p[i + __builtin_ctz(mask)];
+			mask &= mask - 1;
+		}
+	}
+	return count + nonzero_scalar(p + i, n - i, out + count);
+}
+
+static int out_of_range_sse2(const int *p, int n, int lo, int hi)
+{
+	// the limit below is hi - lo - 1, which needs a range that is not empty
+	if (hi <= lo)
+		return out_of_range_scalar(p, n, lo, hi);
+	// unsigned x - lo >= hi - lo, done as a signed compare with the sign bits flipped
+	__m128i bias = _mm_set1_epi32(INT32_MIN);
+	__m128i low = _mm_set1_epi32(lo);
+	__m128i limit = _mm_set1_epi32((int32_t)((uint32_t)(hi - lo - 1) ^ 0x80000000u));
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_xor_si128(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(p + i)), low), bias);
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, limit)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	int k = out_of_range_scalar(p + i, n - i, lo, hi);
+	return k < 0 ? -1 : i + k;
+}
+
+static int find_bit_sse2(const unsigned char *bits, int from, int n, int set)
+{
+	int j = from;
+	for (; j < n && (j & 7); j++)
+	{
+		if (((bits[j >> 3] >> (j & 7)) & 1) == set)
+			return j;
+	}
+	__m128i skip = _mm_set1_epi8(set ? 0x00 : (char)0xff);
+	for (; j + 128 <= n; j += 128)
+	{
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(bits + (j >> 3))), skip));
+		if (mask != 0xffff)
+		{
+			j += 8 * __builtin_ctz(~mask);
+			break;
+		}
+	}
+	return find_bit_tail(bits, j, n, set);
+}
+
+__attribute__((target("avx2"))) static int nonzero_avx2(const int *p, int n, int *out)
+{
+	// left-pack: a table of lane permutations, one per mask of nonzero lanes
+	static int32_t pack[256][8];
+	static int ready = 0;
+	if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+	{
+		for (int m = 0; m < 256; m++)
+		{
+			int k = 0;
+			for (int lane = 0; lane < 8; lane++)
+			{
+				if (m & (1 << lane))
+					pack[m][k++] = lane;
+			}
+			while (k < 8)
+				pack[m][k++] = 0;
+		}
+		__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+	}
+
+	int count = 0, i = 0;
+	__m256i zero = _mm256_setzero_si256();
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		int mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) & 0xff;
+		if (!mask)
+			continue;
+		// count <= i, so the full store stays inside the first i + 8 entries
+		__m256i order = _mm256_loadu_si256((const __m256i *)pack[mask]);
+		_mm256_storeu_si256((__m256i *)(out + count), _mm256_permutevar8x32_epi32(v, order));
+		count += __builtin_popcount(mask);
+	}
+	return count + nonzero_scalar(p + i, n - i, out + count);
+}
+
+__attribute__((target("avx2"))) static int out_of_range_avx2(const int *p, int n, int lo, int hi)
+{
+	if (hi <= lo)
+		return out_of_range_scalar(p, n, lo, hi);
+	__m256i low = _mm256_set1_epi32(lo);
+	__m256i span = _mm256_set1_epi32(hi - lo);
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		// x - lo >= span (unsigned) exactly when max(x - lo, span) == x - lo
+		__m256i v = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(p + i)), low);
+		__m256i bad = _mm256_cmpeq_epi32(_mm256_max_epu32(v, span), v);
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	int k = out_of_range_scalar(p + i, n - i, lo, hi);
+	return k < 0 ? -1 : i + k;
+}
+
+__attribute__((target("avx2"))) static int find_bit_avx2(const unsigned char *bits, int from, int n, int set)
+{
+	int j = from;
+	for (; j < n && (j & 7); j++)
+	{
+		if (((bits[j >> 3] >> (j & 7)) & 1) == set)
+			return j;
+	}
+	__m256i skip = _mm256_set1_epi8(set ? 0x00 : (char)0xff);
+	for (; j + 256 <= n; j += 256)
+	{
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(bits + (j >> 3))), skip));
+		if (mask != 0xffffffffu)
+		{
+			j += 8 * __builtin_ctz(~mask);
+			break;
+		}
+	}
+	return find_bit_tail(bits, j, n, set);
+}
+
+#elif defined(__aarch64__)
+
+static int nonzero_neon(const int *p, int n, int *out)
+{
+	int count = 0, i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		uint32x4_t v = vld1q_u32((const uint32_t *)(p + i));
+		if (!vmaxvq_u32(v))
+			continue;
+		for (int k = 0; k < 4; k++)
+		{
+			if (p[i + k])
+				out[count++] = p[i + k];
+		}
+	}
+	return count + nonzero_scalar(p + i, n - i, out + count);
+}
+
+static int out_of_range_neon(const int *p, int n, int lo, int hi)
+{
+	if (hi <= lo)
+		return out_of_range_scalar(p, n, lo, hi);
+	uint32x4_t low = vdupq_n_u32(lo);
+	uint32x4_t span = vdupq_n_u32(hi - lo);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		uint32x4_t bad = vcgeq_u32(vsubq_u32(vld1q_u32((const uint32_t *)(p + i)), low), span);
+		if (vmaxvq_u32(bad))
+			return i + out_of_range_scalar(p + i, 4, lo, hi);
+	}
+	int k = out_of_range_scalar(p + i, n - i, lo, hi);
+	return k < 0 ? -1 : i + k;
+}
+
+static int find_bit_neon(const unsigned char *bits, int from, int n, int set)
+{
+	int j = from;
+	for (; j < n && (j & 7); j++)
+	{
+		if (((bits[j >> 3] >> (j & 7)) & 1) == set)
+			return j;
+	}
+	uint8x16_t skip = vdupq_n_u8(set ? 0x00 : 0xff);
+	for (; j + 128 <= n; j += 128)
+	{
+		// any byte that differs from skip holds the bit
+		if (vmaxvq_u8(veorq_u8(vld1q_u8(bits + (j >> 3)), skip)))
+			break;
+	}
+	return find_bit_tail(bits, j, n, set);
+}
+
+#endif
+
+static const struct simd_kernels kernels[] = {
+#if defined(__x86_64__)
+	{"avx2", nonzero_avx2, out_of_range_avx2, find_bit_avx2, scatter_bits_scalar},
+	{"sse2", nonzero_sse2, out_of_range_sse2, find_bit_sse2, scatter_bits_scalar},
+#elif defined(__aarch64__)
+	{"neon", nonzero_neon, out_of_range_neon, find_bit_neon, scatter_bits_scalar},
+#endif
+	{"scalar", nonzero_scalar, out_of_range_scalar, find_bit_scalar, scatter_bits_scalar},
+};
+
+struct simd_kernels simd = {"scalar", nonzero_scalar, out_of_range_scalar, find_bit_scalar, scatter_bits_scalar};
+
+// Whether this CPU can run the named kernels.
+static int simd_supported(const char *name)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+int simd_select(const char *name)
+{
+	for (unsigned i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (!strcmp(kernels[i].name, name) && simd_supported(name))
+		{
+			simd = kernels[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// The table is in order of preference; take the first the CPU runs.
+__attribute__((constructor)) static void simd_init()
+{
+	for (unsigned i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (simd_select(kernels[i].name))
+			return;
+	}
+}
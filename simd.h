@@ -0,0 +1,33 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Vector kernels for the filesystem's hot loops over pointer arrays and the
+// free bitmap: AVX2 or SSE2 on x86-64, NEON on ARM64, plain C elsewhere.
+// The best version the CPU supports is chosen when the program starts.
+struct simd_kernels
+{
+	const char *name;
+
+	// Copy the nonzero entries of p[0..n) to out, in order, and return how
+	// many there were. out may be p itself; otherwise it needs room for n.
+	int (*nonzero)(const int *p, int n, int *out);
+
+	// Index of the first entry of p[0..n) outside [lo, hi), or -1. When
+	// hi <= lo the range is empty and that is the first entry.
+	int (*out_of_range)(const int *p, int n, int lo, int hi);
+
+	// Index of the first bit in [from, n) of the bitmap that equals set
+	// (bit j is bits[j / 8] >> (j % 8) & 1), or -1.
+	int (*find_bit)(const unsigned char *bits, int from, int n, int set);
+
+	// Set bit list[i] - base for every i and return how many were clear.
+	int (*scatter_bits)(unsigned char *bits, int base, const int *list, int n);
+};
+
+extern struct simd_kernels simd;
+
+// Switch to the named kernels ("scalar", "sse2", "avx2" or "neon"), for
+// benchmarks. Returns zero when this CPU can't run them.
+int simd_select(const char *name);
+
+#endif
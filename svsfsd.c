@@ -0,0 +1,346 @@
+/* svsfsd: serve one mounted SVSFS image to many local clients.
+ * The image is mounted once and every client talks to it over a Unix
+ * socket in the protocol of svsfsd.h. One thread runs a poll loop, so fs
+ * calls never overlap. Each time a connection becomes readable, every
+ * complete request in its input is carried out as one batch and all of
+ * the replies go back in a single write, once the writes of every batch
+ * served in that round are on disk. When no request has come for a
+ * while, a log-structured image is cleaned a step at a time.
+ */
+#define _GNU_SOURCE
+
+#include "fs.h"
+#include "disk.h"
+#include "svsfsd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CLIENTS 1024
+// bytes asked of read() at a time
+#define READ_CHUNK 65536
+// a client with this much unsent reply data is neither read from nor
+// served until it catches up
+#define OUT_LIMIT (8 << 20)
+// idle this long (milliseconds) before cleaning; each step copies about CLEAN_STEP blocks
+#define IDLE_WAIT 100
+#define CLEAN_STEP 256
+
+struct client
+{
+	int fd;
+	unsigned char *in;
+	size_t in_len, in_cap;
+	unsigned char *out;
+	size_t out_len, out_sent, out_cap;
+	int held; // serve_batch stopped at OUT_LIMIT with requests left in in
+	int failed;
+};
+
+static int reserve(unsigned char **buffer, size_t *cap, size_t need);
+static int serve_batch(struct client *c);
+static int client_read(struct client *c);
+static int client_flush(struct client *c);
+static void on_signal(int sig);
+
+struct disk *thedisk = 0;
+static volatile sig_atomic_t stopping = 0;
+static long long served = 0;
+
+int main(int argc, char *argv[])
+{
+	// svsfsd [-d] [-p] <socket> <diskfile> <nblocks>
+	int flags = 0;
+	int first = 1;
+	while (argc - first > 3)
+	{
+		if (!strcmp(argv[first], "-d"))
+			flags |= DISK_DIRECT;
+		else if (!strcmp(argv[first], "-p"))
+			flags |= DISK_SPARSE;
+		else
+			break;
+		first++;
+	}
+	if (argc - first != 3)
+	{
+		printf("use: %s [-d] [-p] <socket> <diskfile> <nblocks>\n", argv[0]);
+		printf("serves the image, which must already be formatted, until interrupted\n");
+		return 1;
+	}
+	const char *path = argv[first];
+
+	thedisk = disk_open_flags((const char **)&argv[first + 1], 1, atoi(argv[first + 2]), 0, flags);
+	if (!thedisk)
+	{
+		printf("couldn't open %s: %s\n", argv[first + 1], strerror(errno));
+		return 1;
+	}
+	if (!fs_mount())
+	{
+		printf("couldn't mount %s\n", argv[first + 1]);
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("socket path is too long: %s\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 128) < 0)
+	{
+		printf("couldn't listen on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	printf("serving %s on %s\n", argv[first + 1], path);
+	fflush(stdout);
+
+	struct client *clients = calloc(MAX_CLIENTS, sizeof(struct client));
+	struct pollfd *fds = calloc(MAX_CLIENTS + 1, sizeof(struct pollfd));
+	if (!clients || !fds)
+	{
+		return 1;
+	}
+	int nclients = 0;
+	// whether there may be cleaning to do, and whether the last poll timed out
+	int cleaning = 1;
+	int idle = 0;
+
+	while (!stopping)
+	{
+		fds[0].fd = listener;
+		fds[0].events = nclients < MAX_CLIENTS ? POLLIN : 0;
+		// held requests whose client has caught up are served without waiting
+		int resume = 0;
+		for (int i = 0; i < nclients; i++)
+		{
+			struct client *c = &clients[i];
+			size_t unsent = c->out_len - c->out_sent;
+			fds[i + 1].fd = c->fd;
+			fds[i + 1].events = (unsent ? POLLOUT : 0) | (unsent < OUT_LIMIT ? POLLIN : 0);
+			fds[i + 1].revents = 0;
+			resume |= c->held && unsent < OUT_LIMIT;
+		}
+		int ready = poll(fds, nclients + 1, resume ? 0 : !cleaning ? -1 : idle ? 0 : IDLE_WAIT);
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			printf("poll: %s\n", strerror(errno));
+			break;
+		}
+		if (ready == 0 && !resume)
+		{
+			// nothing else wants the disk: keep cleaning until there is nothing to gain
+			idle = 1;
+			cleaning = fs_clean(CLEAN_STEP) > 0;
+			continue;
+		}
+		// new requests may leave segments to clean
+		idle = 0;
+		cleaning = 1;
+
+		// serve every readable client first, so one sync covers all their writes
+		for (int i = 0; i < nclients; i++)
+		{
+			struct client *c = &clients[i];
+			if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				c->failed = !client_read(c);
+			else if (c->held && c->out_len - c->out_sent < OUT_LIMIT)
+				c->failed = !serve_batch(c);
+		}
+		// no reply goes out before what it reports is on disk
+		fs_sync();
+
+		// walk backwards so a closed client can be replaced by the last one
+		for (int i = nclients - 1; i >= 0; i--)
+		{
+			struct client *c = &clients[i];
+			int ok = !c->failed;
+			if (ok && c->out_len > c->out_sent)
+				ok = client_flush(c);
+			if (!ok)
+			{
+				close(c->fd);
+				free(c->in);
+				free(c->out);
+				clients[i] = clients[--nclients];
+			}
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			int fd;
+			while (nclients < MAX_CLIENTS && (fd = accept4(listener, 0, 0, SOCK_NONBLOCK)) >= 0)
+			{
+				memset(&clients[nclients], 0, sizeof(struct client));
+				clients[nclients++].fd = fd;
+			}
+		}
+	}
+
+	printf("served %lld requests\n", served);
+	for (int i = 0; i < nclients; i++)
+	{
+		close(clients[i].fd);
+		free(clients[i].in);
+		free(clients[i].out);
+	}
+	free(clients);
+	free(fds);
+	close(listener);
+	unlink(path);
+	fs_unmount();
+	disk_close(thedisk);
+	return 0;
+}
+
+static void on_signal(int sig)
+{
+	stopping = 1;
+}
+
+// Grow buffer to hold at least need bytes.
+static int reserve(unsigned char **buffer, size_t *cap, size_t need)
+{
+	if (need <= *cap)
+		return 1;
+	size_t size = *cap ? *cap : READ_CHUNK;
+	while (size < need)
+		size *= 2;
+	unsigned char *b = realloc(*buffer, size);
+	if (!b)
+		return 0;
+	*buffer = b;
+	*cap = size;
+	return 1;
+}
+
+// Read what the client has sent and serve it. Returns zero when the
+// connection should be closed.
+static int client_read(struct client *c)
+{
+	while (1)
+	{
+		if (!reserve(&c->in, &c->in_cap, c->in_len + READ_CHUNK))
+			return 0;
+		ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+		if (n == 0)
+			return 0;
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return 0;
+			break;
+		}
+		c->in_len += n;
+		if (c->in_len < c->in_cap)
+			break;
+	}
+	return serve_batch(c);
+}
+
+// Carry out every complete request in the client's input, appending the
+// replies to its output, until OUT_LIMIT bytes of it are unsent; the rest
+// stay in the input, held until the client reads its replies. Read data is
+// placed straight into the output. Returns zero on a malformed request.
+static int serve_batch(struct client *c)
+{
+	size_t used = 0;
+
+	c->held = 0;
+	while (c->in_len - used >= sizeof(struct svsfsd_request))
+	{
+		if (c->out_len - c->out_sent >= OUT_LIMIT)
+		{
+			c->held = 1;
+			break;
+		}
+		struct svsfsd_request request;
+		memcpy(&request, c->in + used, sizeof(request));
+		if (request.length < 0 || request.length > SVSFSD_MAX_IO)
+			return 0;
+		size_t need = sizeof(request) + (request.op == SVSFSD_WRITE ? request.length : 0);
+		if (c->in_len - used < need)
+			break;
+
+		struct svsfsd_reply reply = {request.tag, 0};
+		size_t extra = 0;
+		if (!reserve(&c->out, &c->out_cap, c->out_len + sizeof(reply) + (request.op == SVSFSD_READ ? request.length : 0)))
+			return 0;
+		unsigned char *data = c->out + c->out_len + sizeof(reply);
+
+		switch (request.op)
+		{
+		case SVSFSD_CREATE:
+			reply.result = fs_create();
+			break;
+		case SVSFSD_DELETE:
+			reply.result = fs_delete(request.inumber);
+			break;
+		case SVSFSD_GETSIZE:
+			reply.result = fs_getsize(request.inumber);
+			break;
+		case SVSFSD_READ:
+			reply.result = fs_read(request.inumber, data, request.length, request.offset);
+			extra = reply.result > 0 ? reply.result : 0;
+			break;
+		case SVSFSD_WRITE:
+			reply.result = fs_write(request.inumber, c->in + used + sizeof(request), request.length, request.offset);
+			break;
+		default:
+			return 0;
+		}
+
+		memcpy(c->out + c->out_len, &reply, sizeof(reply));
+		c->out_len += sizeof(reply) + extra;
+		used += need;
+		served++;
+	}
+
+	memmove(c->in, c->in + used, c->in_len - used);
+	c->in_len -= used;
+	return 1;
+}
+
+// Send as much pending output as the socket takes. Returns zero when the
+// connection should be closed.
+static int client_flush(struct client *c)
+{
+	while (c->out_sent < c->out_len)
+	{
+		ssize_t n = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return 0;
+			// keep the unsent part at the front
+			memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+			c->out_len -= c->out_sent;
+			c->out_sent = 0;
+			return 1;
+		}
+		c->out_sent += n;
+	}
+	c->out_len = c->out_sent = 0;
+	return 1;
+}
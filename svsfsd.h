@@ -0,0 +1,37 @@
+#ifndef SVSFSD_H
+#define SVSFSD_H
+
+#include <stdint.h>
+
+// Wire protocol between svsfsd and its clients, over a Unix stream socket.
+// A client sends requests back to back without waiting for replies; each
+// request is a header, followed for SVSFSD_WRITE by length bytes of data.
+// The server answers every request, in the order they were sent, with a
+// reply header, followed for a successful SVSFSD_READ by result bytes.
+// Fields are in host byte order: both ends run on the same machine.
+
+#define SVSFSD_CREATE 1	// result: new inumber, or 0
+#define SVSFSD_DELETE 2	// result: 1 or 0
+#define SVSFSD_GETSIZE 3	// result: size, or -1
+#define SVSFSD_READ 4	// result: bytes read
+#define SVSFSD_WRITE 5	// result: bytes written
+
+// Reads and writes move at most this much per request.
+#define SVSFSD_MAX_IO (1 << 20)
+
+struct svsfsd_request
+{
+	uint32_t tag; // echoed in the reply
+	uint32_t op;
+	int32_t inumber;
+	int32_t offset;
+	int32_t length;
+};
+
+struct svsfsd_reply
+{
+	uint32_t tag;
+	int32_t result;
+};
+
+#endif
@@ -0,0 +1,339 @@
+/* svsfsload: load generator for svsfsd.
+ * Each client connects, creates a file and fills it, then keeps up to
+ * depth reads and writes of one size in flight at random aligned offsets.
+ * A sender thread and a receiver thread share each connection, so the
+ * pipeline never stalls waiting for a reply. Reports throughput and the
+ * latency distribution over every request of every client.
+ */
+#include "svsfsd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// bytes each client's file spans; requests land anywhere inside it
+#define FILE_SPAN (1 << 20)
+
+struct load_client
+{
+	const char *path;
+	pthread_barrier_t *ready; // passed once the file is set up, so timing covers only the load
+	int fd;
+	int inumber;
+	int requests;
+	int depth;
+	int size;
+	int span; // the file's size: the largest multiple of size within FILE_SPAN
+	int write_percent;
+	unsigned int seed;
+	unsigned char *data;
+	unsigned char *back;
+	char *is_read;	  // per request
+	double *sent;	  // per request, when it went out
+	double *latency; // per request, seconds until its reply
+	int in_flight;
+	int broken; // the receiver gave up on the connection
+	int errors;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+static double now();
+static int send_all(int fd, const void *buffer, size_t length);
+static int recv_all(int fd, void *buffer, size_t length);
+static int call(struct load_client *c, int op, int inumber, const unsigned char *data, int length, int offset);
+static void *run_client(void *arg);
+static int setup_client(struct load_client *c);
+static void run_load(struct load_client *c);
+static void *receive_replies(void *arg);
+static int compare_doubles(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+	// svsfsload <socket> <clients> <requests> [depth] [size] [write percent]
+	if (argc < 4 || argc > 7)
+	{
+		printf("use: %s <socket> <clients> <requests per client> [depth] [size] [write percent]\n", argv[0]);
+		printf("defaults: depth 16, size 4096, 50%% writes\n");
+		return 1;
+	}
+	int nclients = atoi(argv[2]);
+	int requests = atoi(argv[3]);
+	int depth = argc > 4 ? atoi(argv[4]) : 16;
+	int size = argc > 5 ? atoi(argv[5]) : 4096;
+	int write_percent = argc > 6 ? atoi(argv[6]) : 50;
+	if (nclients < 1 || requests < 1 || depth < 1 || size < 1 || size > FILE_SPAN)
+	{
+		printf("clients, requests and depth must be positive and size from 1 to %d\n", FILE_SPAN);
+		return 1;
+	}
+
+	struct load_client *clients = calloc(nclients, sizeof(struct load_client));
+	pthread_t *threads = calloc(nclients, sizeof(pthread_t));
+	if (!clients || !threads)
+	{
+		return 1;
+	}
+
+	pthread_barrier_t ready;
+	pthread_barrier_init(&ready, 0, nclients + 1);
+	for (int i = 0; i < nclients; i++)
+	{
+		struct load_client *c = &clients[i];
+		c->path = argv[1];
+		c->ready = &ready;
+		c->requests = requests;
+		c->depth = depth;
+		c->size = size;
+		c->write_percent = write_percent;
+		c->seed = i + 1;
+		if (pthread_create(&threads[i], 0, run_client, c) != 0)
+		{
+			printf("couldn't start client %d\n", i);
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&ready);
+	double start = now();
+	int errors = 0;
+	for (int i = 0; i < nclients; i++)
+	{
+		pthread_join(threads[i], 0);
+		errors += clients[i].errors;
+	}
+	double elapsed = now() - start;
+
+	long long total = (long long)nclients * requests;
+	double *all = malloc(total * sizeof(double));
+	if (!all)
+	{
+		return 1;
+	}
+	for (int i = 0; i < nclients; i++)
+	{
+		memcpy(all + (long long)i * requests, clients[i].latency, requests * sizeof(double));
+		free(clients[i].latency);
+	}
+	qsort(all, total, sizeof(double), compare_doubles);
+
+	printf("%d clients, %lld requests of %d bytes, depth %d, %d%% writes\n", nclients, total, size, depth, write_percent);
+	printf("%.3f seconds, %.0f requests/s, %.1f MB/s\n", elapsed, total / elapsed, total * (double)size / elapsed / (1 << 20));
+	printf("latency (us): p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+		   all[total / 2] * 1e6, all[total * 9 / 10] * 1e6, all[total * 99 / 100] * 1e6,
+		   all[total * 999 / 1000] * 1e6, all[total - 1] * 1e6);
+	if (errors)
+	{
+		printf("%d requests failed\n", errors);
+	}
+
+	pthread_barrier_destroy(&ready);
+	free(all);
+	free(clients);
+	free(threads);
+	return errors != 0;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int send_all(int fd, const void *buffer, size_t length)
+{
+	const unsigned char *p = buffer;
+	while (length)
+	{
+		ssize_t n = send(fd, p, length, 0);
+		if (n <= 0)
+			return 0;
+		p += n;
+		length -= n;
+	}
+	return 1;
+}
+
+static int recv_all(int fd, void *buffer, size_t length)
+{
+	unsigned char *p = buffer;
+	while (length)
+	{
+		ssize_t n = recv(fd, p, length, 0);
+		if (n <= 0)
+			return 0;
+		p += n;
+		length -= n;
+	}
+	return 1;
+}
+
+// One request with nothing else in flight; returns its result, or -1 if
+// the connection failed. A read's data lands in c->back.
+static int call(struct load_client *c, int op, int inumber, const unsigned char *data, int length, int offset)
+{
+	struct svsfsd_request request = {0, op, inumber, offset, length};
+	struct svsfsd_reply reply;
+	if (!send_all(c->fd, &request, sizeof(request)) ||
+		(op == SVSFSD_WRITE && !send_all(c->fd, data, length)) ||
+		!recv_all(c->fd, &reply, sizeof(reply)) ||
+		(op == SVSFSD_READ && reply.result > 0 && !recv_all(c->fd, c->back, reply.result)))
+	{
+		return -1;
+	}
+	return reply.result;
+}
+
+static void *run_client(void *arg)
+{
+	struct load_client *c = arg;
+	int ok = setup_client(c);
+	pthread_barrier_wait(c->ready);
+	if (!ok)
+	{
+		c->errors = c->requests;
+		if (c->fd >= 0)
+			close(c->fd);
+		free(c->sent);
+		free(c->is_read);
+		free(c->data);
+		free(c->back);
+		return 0;
+	}
+	run_load(c);
+	return 0;
+}
+
+// Connect and create and fill the client's file.
+static int setup_client(struct load_client *c)
+{
+	c->fd = -1;
+	c->latency = calloc(c->requests, sizeof(double));
+	c->sent = calloc(c->requests, sizeof(double));
+	c->is_read = calloc(c->requests, 1);
+	c->data = malloc(FILE_SPAN);
+	c->back = malloc(FILE_SPAN);
+	if (!c->latency || !c->sent || !c->is_read || !c->data || !c->back)
+	{
+		return 0;
+	}
+	for (int i = 0; i < FILE_SPAN; i++)
+	{
+		c->data[i] = rand_r(&c->seed);
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+	c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		printf("couldn't connect to %s: %s\n", c->path, strerror(errno));
+		return 0;
+	}
+
+	// a file of its own, filled so every read finds data
+	c->span = FILE_SPAN / c->size * c->size;
+	c->inumber = call(c, SVSFSD_CREATE, 0, 0, 0, 0);
+	for (int offset = 0; c->inumber > 0 && offset < c->span; offset += c->size)
+	{
+		if (call(c, SVSFSD_WRITE, c->inumber, c->data + offset, c->size, offset) != c->size)
+			c->inumber = 0;
+	}
+	if (c->inumber <= 0)
+	{
+		printf("couldn't set up a file to test with\n");
+		return 0;
+	}
+	return 1;
+}
+
+// Keep depth requests in flight until all have been sent, then clean up.
+static void run_load(struct load_client *c)
+{
+	pthread_mutex_init(&c->lock, 0);
+	pthread_cond_init(&c->changed, 0);
+	pthread_t receiver;
+	if (pthread_create(&receiver, 0, receive_replies, c) != 0)
+	{
+		c->errors = c->requests;
+		close(c->fd);
+		return;
+	}
+
+	for (int i = 0; i < c->requests; i++)
+	{
+		pthread_mutex_lock(&c->lock);
+		while (c->in_flight == c->depth && !c->broken)
+			pthread_cond_wait(&c->changed, &c->lock);
+		c->in_flight++;
+		int broken = c->broken;
+		pthread_mutex_unlock(&c->lock);
+		if (broken)
+			break;
+
+		int write = (int)(rand_r(&c->seed) % 100) < c->write_percent;
+		int offset = rand_r(&c->seed) % (c->span / c->size) * c->size;
+		struct svsfsd_request request = {i, write ? SVSFSD_WRITE : SVSFSD_READ, c->inumber, offset, c->size};
+		c->is_read[i] = !write;
+		c->sent[i] = now();
+		if (!send_all(c->fd, &request, sizeof(request)) || (write && !send_all(c->fd, c->data + offset, c->size)))
+		{
+			break;
+		}
+	}
+	pthread_join(receiver, 0);
+
+	call(c, SVSFSD_DELETE, c->inumber, 0, 0, 0);
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->changed);
+	free(c->sent);
+	free(c->is_read);
+	free(c->data);
+	free(c->back);
+}
+
+// Collect the replies to a client's pipelined requests, in order.
+static void *receive_replies(void *arg)
+{
+	struct load_client *c = arg;
+
+	for (int i = 0; i < c->requests; i++)
+	{
+		struct svsfsd_reply reply;
+		if (!recv_all(c->fd, &reply, sizeof(reply)) || reply.tag != (uint32_t)i ||
+			(c->is_read[i] && reply.result > 0 && !recv_all(c->fd, c->back, reply.result)))
+		{
+			printf("connection failed at request %d\n", i);
+			c->errors += c->requests - i;
+			pthread_mutex_lock(&c->lock);
+			c->broken = 1;
+			pthread_cond_signal(&c->changed);
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		c->latency[i] = now() - c->sent[i];
+		if (reply.result != c->size)
+			c->errors++;
+
+		pthread_mutex_lock(&c->lock);
+		c->in_flight--;
+		pthread_cond_signal(&c->changed);
+		pthread_mutex_unlock(&c->lock);
+	}
+	return 0;
+}